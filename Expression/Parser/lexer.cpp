@@ -1,11 +1,70 @@
 #include "../../pch.hpp"
 
 #include "lexer.hpp"
-#include <regex>
+
+#include <algorithm>
+#include <cctype>
+
+tc::expression::LexTrie::LexTrie()
+	: m_Nodes(1)
+{
+}
+
+void tc::expression::LexTrie::insert(std::string_view name, std::int32_t index)
+{
+	std::int32_t node = 0;
+	for (char c : name) {
+		auto& children = m_Nodes[node].children;
+		auto it = std::find_if(children.begin(), children.end(), [c](const auto& child) { return child.first == c; });
+		if (it != children.end()) {
+			node = it->second;
+			continue;
+		}
+		std::int32_t child = m_Nodes.size();
+		children.emplace_back(c, child);
+		m_Nodes.emplace_back();
+		node = child;
+	}
+
+	if (m_Nodes[node].index == -1)
+		m_Nodes[node].index = index;
+}
+
+std::pair<std::int32_t, std::int32_t> tc::expression::LexTrie::match(std::string_view str) const
+{
+	std::pair<std::int32_t, std::int32_t> best(-1, 0);
+
+	std::int32_t node = 0;
+	for (std::int32_t i = 0; i < str.length(); ++i) {
+		auto& children = m_Nodes[node].children;
+		auto it = std::find_if(children.begin(), children.end(), [c = str[i]](const auto& child) { return child.first == c; });
+		if (it == children.end())
+			break;
+		node = it->second;
+
+		std::int32_t index = m_Nodes[node].index;
+		if (index != -1 && (best.first == -1 || index < best.first))
+			best = std::make_pair(index, i + 1);
+	}
+
+	return best;
+}
 
 tc::expression::Lexer::Lexer(LexContext&& lex_context)
 	: m_LexContext(std::move(lex_context))
 {
+	for (int i = 0; i < m_LexContext.unary_operators.size(); ++i) {
+		m_UnaryOperatorTrie.insert(m_LexContext.operator_id_name_map.at(m_LexContext.unary_operators[i].get_id()), i);
+	}
+	for (int i = 0; i < m_LexContext.binary_operators.size(); ++i) {
+		m_BinaryOperatorTrie.insert(m_LexContext.operator_id_name_map.at(m_LexContext.binary_operators[i].get_id()), i);
+	}
+	for (int i = 0; i < m_LexContext.functions.size(); ++i) {
+		m_FunctionTrie.insert(m_LexContext.function_id_name_map.at(m_LexContext.functions[i].get_id()), i);
+	}
+	for (int i = 0; i < m_LexContext.variables.size(); ++i) {
+		m_VariableTrie.insert(m_LexContext.variables[i].name, i);
+	}
 }
 
 std::vector<std::unique_ptr<tc::expression::Token>> tc::expression::Lexer::lex(std::string expression) const
@@ -33,6 +92,8 @@ std::vector<std::unique_ptr<tc::expression::Token>> tc::expression::Lexer::lex(s
 			throw std::runtime_error("Lexer ran more iterations than available charecters in expression, something wen't wrong");
 	}
 
+	check_function_arguments(lexed_tokens);
+
 	lexed_tokens.erase(lexed_tokens.begin());
 
 	return lexed_tokens;
@@ -125,18 +186,17 @@ std::pair<std::string_view, std::optional<tc::expression::CommaToken>> tc::expre
 std::pair<std::string_view, std::optional<tc::expression::UnaryOperatorToken>> tc::expression::Lexer::begins_with_unary_operator(std::string_view expr, 
 	const std::vector<std::unique_ptr<Token>>& lexed_tokens) const
 {
-	for (auto& uop : m_LexContext.unary_operators) {
-		std::string opstr = m_LexContext.operator_id_name_map.at(uop.get_id());
-		if (expr.rfind(opstr, 0) == 0) {
-			int32_t previous_token_id = lexed_tokens.back()->get_id();
-			for (auto& allowed_op : uop.allowed_left_tokens) {
-				if (allowed_op.get().get_id() == previous_token_id) {
-					return std::make_pair(expr.substr(opstr.length()), uop);
-				}
+	auto [index, length] = m_UnaryOperatorTrie.match(expr);
+	if (index != -1) {
+		auto& uop = m_LexContext.unary_operators[index];
+		int32_t previous_token_id = lexed_tokens.back()->get_id();
+		for (auto& allowed_op : uop.allowed_left_tokens) {
+			if (allowed_op.get().get_id() == previous_token_id) {
+				return std::make_pair(expr.substr(length), uop);
 			}
-			// The tokens id matched but previous token did not match any left allowed token, might for instance be another unary operator
-			return std::make_pair(expr, std::nullopt);
 		}
+		// The tokens id matched but previous token did not match any left allowed token, might for instance be another unary operator
+		return std::make_pair(expr, std::nullopt);
 	}
 	// No match
 	return std::make_pair(expr, std::nullopt);
@@ -145,18 +205,17 @@ std::pair<std::string_view, std::optional<tc::expression::UnaryOperatorToken>> t
 std::pair<std::string_view, std::optional<tc::expression::BinaryOperatorToken>> tc::expression::Lexer::begins_with_binary_operator(std::string_view expr,
 	const std::vector<std::unique_ptr<Token>>& lexed_tokens) const
 {
-	for (auto& bop : m_LexContext.binary_operators) {
-		std::string opstr = m_LexContext.operator_id_name_map.at(bop.get_id());
-		if (expr.rfind(opstr, 0) == 0) {
-			int32_t previous_token_id = lexed_tokens.back()->get_id();
-			for (auto& disallowed_op : bop.disallowed_left_tokens) {
-				if (disallowed_op.get().get_id() == previous_token_id) {
-					throw std::runtime_error("token with token-id: " + std::to_string(previous_token_id) + " is disallowed before binary operator with token-id: " + std::to_string(bop.get_id()));
-				}
+	auto [index, length] = m_BinaryOperatorTrie.match(expr);
+	if (index != -1) {
+		auto& bop = m_LexContext.binary_operators[index];
+		int32_t previous_token_id = lexed_tokens.back()->get_id();
+		for (auto& disallowed_op : bop.disallowed_left_tokens) {
+			if (disallowed_op.get().get_id() == previous_token_id) {
+				throw std::runtime_error("token with token-id: " + std::to_string(previous_token_id) + " is disallowed before binary operator with token-id: " + std::to_string(bop.get_id()));
 			}
-
-			return std::make_pair(expr.substr(opstr.length()), bop);
 		}
+
+		return std::make_pair(expr.substr(length), bop);
 	}
 	// No match
 	return std::make_pair(expr, std::nullopt);
@@ -164,65 +223,59 @@ std::pair<std::string_view, std::optional<tc::expression::BinaryOperatorToken>>
 
 std::pair<std::string_view, std::optional<tc::expression::FunctionToken>> tc::expression::Lexer::begins_with_function(std::string_view expr) const
 {
-	for (auto& func : m_LexContext.functions) {
-		std::string funcstr = m_LexContext.function_id_name_map.at(func.get_id());
-		if (expr.rfind(funcstr, 0) == 0) {
-			int name_length = funcstr.length();
-			if (expr.at(name_length) != '(')
-				throw std::runtime_error("A function must always be followed by a left parenthasis '('");
-
-			// Check if parenthasis are matched
-			int32_t parenthasis_diff = 1;
-			int32_t number_of_commas = 0;
-			for (int i = name_length + 1; parenthasis_diff != 0 && i < expr.length(); ++i) {
-				if (expr.at(i) == FixedTokens::LEFT_PAREN_CHAR) {
-					parenthasis_diff += 1;
-				}
-				else if (expr.at(i) == FixedTokens::RIGHT_PAREN_CHAR) {
-					parenthasis_diff -= 1;
-				}
-				else if (expr.at(i) == FixedTokens::COMMA_CHAR) {
-					number_of_commas += 1;
-				}
-			}
+	auto [index, length] = m_FunctionTrie.match(expr);
+	if (index != -1) {
+		if (length >= expr.length() || expr[length] != FixedTokens::LEFT_PAREN_CHAR)
+			throw std::runtime_error("A function must always be followed by a left parenthasis '('");
 
-			if (parenthasis_diff != 0)
-				throw std::runtime_error("Parenthasis after function: " + funcstr + ", did not match");
-
-			if (number_of_commas != (func.n_inputs - 1))
-				throw std::runtime_error("NumberToken of commas used in function: " + funcstr + ", was not consistent with expected number of inputs");
-
-			return std::make_pair(expr.substr(name_length), func);
-		}
+		return std::make_pair(expr.substr(length), m_LexContext.functions[index]);
 	}
 	return std::make_pair(expr, std::nullopt);
 }
 
 std::pair<std::string_view, std::optional<tc::expression::VariableToken>> tc::expression::Lexer::begins_with_variable(std::string_view expr) const
 {
-	for (auto& var : m_LexContext.variables) {
-		if (expr.rfind(var.name, 0) == 0) {
-			return std::make_pair(expr.substr(var.name.length()), var);
-		}
+	auto [index, length] = m_VariableTrie.match(expr);
+	if (index != -1) {
+		return std::make_pair(expr.substr(length), m_LexContext.variables[index]);
 	}
 	return std::make_pair(expr, std::nullopt);
 }
 
-
-namespace {
-	static std::regex scientific_regex("^([\\d]+(.\\d+)?(?:e-?\\d+)?)?(i?)", std::regex_constants::ECMAScript | std::regex_constants::icase);
-}
-
-
 std::pair<std::string_view, std::optional<tc::expression::NumberToken>> tc::expression::Lexer::begins_with_numberstr(std::string_view expr) const
 {
-	std::cmatch m;
-	std::string exprstr(expr);
-	if (std::regex_search(exprstr.c_str(), m, scientific_regex, std::regex_constants::match_not_null)) {
-		bool is_imaginary = m[3].str().length();
-		return std::make_pair(expr.substr(m[0].str().length()), NumberToken(m[1].str(), is_imaginary));
+	// digits, optionally followed by a fraction .digits and an exponent e-digits, then an optional imaginary unit i
+	auto is_digit = [&expr](std::size_t i) { return i < expr.length() && expr[i] >= '0' && expr[i] <= '9'; };
+	auto is_char = [&expr](std::size_t i, char c) { return i < expr.length() && std::tolower(expr[i]) == c; };
+
+	std::size_t end = 0;
+	while (is_digit(end))
+		++end;
+
+	if (end > 0) {
+		if (is_char(end, '.') && is_digit(end + 1)) {
+			end += 2;
+			while (is_digit(end))
+				++end;
+		}
+		if (is_char(end, 'e')) {
+			std::size_t exponent = end + 1;
+			if (is_char(exponent, '-'))
+				++exponent;
+			if (is_digit(exponent)) {
+				while (is_digit(exponent))
+					++exponent;
+				end = exponent;
+			}
+		}
 	}
-	return std::make_pair(expr, std::nullopt);
+
+	bool is_imaginary = is_char(end, 'i');
+	std::size_t length = is_imaginary ? end + 1 : end;
+	if (length == 0)
+		return std::make_pair(expr, std::nullopt);
+
+	return std::make_pair(expr.substr(length), NumberToken(std::string(expr.substr(0, end)), is_imaginary));
 }
 
 std::optional<tc::expression::ZeroToken> tc::expression::Lexer::begins_with_zero(const NumberToken& num) const
@@ -246,3 +299,45 @@ std::optional<tc::expression::UnityToken> tc::expression::Lexer::begins_with_uni
 
 	return std::nullopt;
 }
+
+void tc::expression::Lexer::check_function_arguments(const std::vector<std::unique_ptr<Token>>& lexed_tokens) const
+{
+	// One entry per open parenthesis, the function it belongs to or nullptr and the commas seen directly inside it
+	std::vector<std::pair<const FunctionToken*, std::int32_t>> open;
+	const FunctionToken* function = nullptr;
+
+	auto function_name = [this](const FunctionToken& func) {
+		return m_LexContext.function_id_name_map.at(func.get_id());
+	};
+
+	for (auto& tok : lexed_tokens) {
+		switch (tok->get_token_type()) {
+		case TokenType::FUNCTION_TYPE:
+			function = static_cast<const FunctionToken*>(tok.get());
+			continue;
+		case TokenType::LEFT_PAREN_TYPE:
+			open.emplace_back(function, 0);
+			break;
+		case TokenType::COMMA_TYPE:
+			if (!open.empty())
+				++open.back().second;
+			break;
+		case TokenType::RIGHT_PAREN_TYPE:
+			if (!open.empty()) {
+				auto [func, ncommas] = open.back();
+				open.pop_back();
+				if (func != nullptr && ncommas != func->n_inputs - 1)
+					throw std::runtime_error("NumberToken of commas used in function: " + function_name(*func) + ", was not consistent with expected number of inputs");
+			}
+			break;
+		default:
+			break;
+		}
+		function = nullptr;
+	}
+
+	for (auto& [func, ncommas] : open) {
+		if (func != nullptr)
+			throw std::runtime_error("Parenthasis after function: " + function_name(*func) + ", did not match");
+	}
+}
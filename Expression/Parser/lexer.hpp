@@ -1,5 +1,7 @@
 #pragma once
 
+#include <string_view>
+
 #include "../token.hpp"
 
 namespace tc {
@@ -39,6 +41,30 @@ namespace tc {
 
 		};
 
+		// Prefix trie over the names of one kind of token. Matching walks the input once and never allocates,
+		// names are mapped to the index they were inserted with
+		class LexTrie {
+		public:
+
+			LexTrie();
+
+			// A name inserted twice keeps its first index
+			void insert(std::string_view name, std::int32_t index);
+
+			// The smallest index of all names that are prefixes of str, and the length of that name,
+			// so the first inserted match wins just as with a scan in insertion order. Index -1 if none matched
+			std::pair<std::int32_t, std::int32_t> match(std::string_view str) const;
+
+		private:
+
+			struct TrieNode {
+				std::vector<std::pair<char, std::int32_t>> children;
+				std::int32_t index = -1;
+			};
+
+			std::vector<TrieNode> m_Nodes;
+		};
+
 		class Lexer {
 		public:
 
@@ -77,10 +103,20 @@ namespace tc {
 
 			std::optional<UnityToken> begins_with_unity(const NumberToken& num) const;
 
+			// Function argument counts are checked in one pass over the lexed tokens instead of by a scan
+			// ahead at every function
+			void check_function_arguments(const std::vector<std::unique_ptr<Token>>& lexed_tokens) const;
+
 		private:
 
 			LexContext m_LexContext;
 
+			// Tries over the names in the context, built once by the constructor
+			LexTrie m_UnaryOperatorTrie;
+			LexTrie m_BinaryOperatorTrie;
+			LexTrie m_FunctionTrie;
+			LexTrie m_VariableTrie;
+
 		};
 		
 		struct DefaultOperatorPrecedence {
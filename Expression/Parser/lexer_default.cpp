@@ -1,6 +1,7 @@
 #include "../../pch.hpp"
 
 #include "lexer.hpp"
+#include "../custom.hpp"
 
 tc::expression::LexContext::LexContext()
 {
@@ -79,4 +80,10 @@ tc::expression::LexContext::LexContext()
 	operator_id_name_map = DEFAULT_OPERATOR_MAPS;
 	function_id_name_map = DEFAULT_FUNCTION_MAPS;
 
+	// Custom functions registered so far
+	for (auto& [id, function] : CustomFunctionRegistry::instance().functions()) {
+		functions.emplace_back(id, function->n_inputs);
+		function_id_name_map[id] = function->name;
+	}
+
 }
\ No newline at end of file
@@ -0,0 +1,678 @@
+#include "../../pch.hpp"
+
+#include "simplify.hpp"
+
+#include <iomanip>
+#include <sstream>
+#include <unordered_set>
+
+namespace {
+
+	using namespace tc::expression;
+
+	struct SimplifyRules {
+		bool add_commutative = false;
+		bool mul_commutative = false;
+		bool real = true; // no imaginary numbers or complex tensors in the tree
+	};
+
+	SimplifyRules rules_from_context(const LexContext& context)
+	{
+		SimplifyRules rules;
+		for (auto& op : context.binary_operators) {
+			if (op.id == DefaultOperatorIDs::ADD_ID)
+				rules.add_commutative = op.commutative;
+			else if (op.id == DefaultOperatorIDs::MUL_ID)
+				rules.mul_commutative = op.commutative;
+		}
+		return rules;
+	}
+
+	bool is_real_tree(const Node& node, std::unordered_set<const Node*>& visited)
+	{
+		if (!visited.insert(&node).second)
+			return true;
+
+		switch (node.get_node_type()) {
+		case NodeType::TOKEN_NODE:
+		case NodeType::TOKEN_FETCHER_NODE:
+			if (node.m_pToken->get_token_type() == TokenType::NUMBER_TYPE) {
+				auto& numtok = static_cast<const NumberToken&>(*node.m_pToken);
+				if (numtok.is_imaginary || numtok.num.imag() != 0.0f)
+					return false;
+			}
+			break;
+		case NodeType::TENSOR_NODE:
+			if (static_cast<const TensorNode&>(node).get_tensor().is_complex())
+				return false;
+			break;
+		default:
+			break;
+		}
+
+		for (auto& child : node.m_Children) {
+			if (!is_real_tree(*child, visited))
+				return false;
+		}
+		return true;
+	}
+
+	bool is_literal(const Node& node)
+	{
+		auto type = node.get_node_type();
+		return type == NodeType::TOKEN_NODE || type == NodeType::TOKEN_FETCHER_NODE;
+	}
+
+	// Token fetcher nodes take their sizes from a fetcher at eval time and can't be folded
+	bool is_foldable(const Node& node)
+	{
+		return node.get_node_type() == NodeType::TOKEN_NODE;
+	}
+
+	std::optional<float> real_literal(const Node& node)
+	{
+		if (!is_literal(node))
+			return std::nullopt;
+
+		auto& tok = *node.m_pToken;
+		switch (tok.get_token_type()) {
+		case TokenType::ZERO_TYPE:
+			return 0.0f;
+		case TokenType::UNITY_TYPE:
+			return 1.0f;
+		case TokenType::NEG_UNITY_TYPE:
+			return -1.0f;
+		case TokenType::NUMBER_TYPE:
+		{
+			auto& numtok = static_cast<const NumberToken&>(tok);
+			if (numtok.num.imag() == 0.0f)
+				return numtok.num.real();
+			return std::nullopt;
+		}
+		default:
+			return std::nullopt;
+		}
+	}
+
+	// Lexed and folded numbers keep their text, parsing it again gives the literal in full double precision like
+	// the tape does. Texts that don't round to the stored number are not used
+	std::optional<double> real_literal_double(const Node& node)
+	{
+		auto lit = real_literal(node);
+		if (!lit.has_value())
+			return std::nullopt;
+
+		auto& tok = *node.m_pToken;
+		if (tok.get_token_type() == TokenType::NUMBER_TYPE) {
+			auto& numtok = static_cast<const NumberToken&>(tok);
+			if (!numtok.is_imaginary && !numtok.name.empty()) {
+				char* end;
+				double parsed = std::strtod(numtok.name.c_str(), &end);
+				if (*end == '\0' && static_cast<float>(parsed) == lit.value())
+					return parsed;
+			}
+		}
+		return lit.value();
+	}
+
+	std::string double_name(double value)
+	{
+		std::ostringstream ss;
+		ss << std::setprecision(std::numeric_limits<double>::max_digits10) << value;
+		return ss.str();
+	}
+
+	bool literal_equals(const Node& node, float value)
+	{
+		auto lit = real_literal(node);
+		return lit.has_value() && lit.value() == value;
+	}
+
+	// The number keeps value as its text, so double models get it exactly
+	std::shared_ptr<Node> literal_node(double value)
+	{
+		if (value == 0.0)
+			return std::make_unique<TokenNode>(ZeroToken());
+		if (value == 1.0)
+			return std::make_unique<TokenNode>(UnityToken());
+		if (value == -1.0)
+			return std::make_unique<TokenNode>(NegUnityToken());
+		return std::make_unique<TokenNode>(NumberToken(double_name(value), std::complex<float>(static_cast<float>(value)), false));
+	}
+
+	bool is_type(const Node& node, std::int32_t type)
+	{
+		return node.get_node_type() == type;
+	}
+
+	// The value of a subtree of real literals computed in double, nullopt if it has other nodes
+	std::optional<double> fold_real(const Node& node)
+	{
+		if (is_foldable(node))
+			return real_literal_double(node);
+
+		std::vector<double> x;
+		for (auto& child : node.m_Children) {
+			auto value = fold_real(*child);
+			if (!value.has_value())
+				return std::nullopt;
+			x.push_back(value.value());
+		}
+
+		switch (node.get_node_type()) {
+		// Operators
+		case NodeType::NEG_NODE: return -x[0];
+		case NodeType::MUL_NODE: return x[0] * x[1];
+		case NodeType::DIV_NODE: return x[0] / x[1];
+		case NodeType::ADD_NODE: return x[0] + x[1];
+		case NodeType::SUB_NODE: return x[0] - x[1];
+		case NodeType::POW_NODE: return std::pow(x[0], x[1]);
+		// Unary
+		case NodeType::SGN_NODE: return static_cast<double>((x[0] > 0.0) - (x[0] < 0.0));
+		case NodeType::ABS_NODE: return std::abs(x[0]);
+		case NodeType::SQRT_NODE: return std::sqrt(x[0]);
+		case NodeType::SQUARE_NODE: return x[0] * x[0];
+		case NodeType::EXP_NODE: return std::exp(x[0]);
+		case NodeType::LOG_NODE: return std::log(x[0]);
+		// Trig
+		case NodeType::SIN_NODE: return std::sin(x[0]);
+		case NodeType::COS_NODE: return std::cos(x[0]);
+		case NodeType::TAN_NODE: return std::tan(x[0]);
+		case NodeType::ASIN_NODE: return std::asin(x[0]);
+		case NodeType::ACOS_NODE: return std::acos(x[0]);
+		case NodeType::ATAN_NODE: return std::atan(x[0]);
+		case NodeType::SINH_NODE: return std::sinh(x[0]);
+		case NodeType::COSH_NODE: return std::cosh(x[0]);
+		case NodeType::TANH_NODE: return std::tanh(x[0]);
+		case NodeType::ASINH_NODE: return std::asinh(x[0]);
+		case NodeType::ACOSH_NODE: return std::acosh(x[0]);
+		case NodeType::ATANH_NODE: return std::atanh(x[0]);
+		// Fused
+		case NodeType::EXPM1_NODE: return std::expm1(x[0]);
+		case NodeType::LOG1P_NODE: return std::log1p(x[0]);
+		case NodeType::FMA_NODE: return x[2] + x[0] * x[1];
+		default: return std::nullopt;
+		}
+	}
+
+	// Evaluates a subtree of token nodes with the token algebra, leaves it as is if the
+	// token algebra can't handle it. The token algebra works in float, real numbers it folds
+	// to are computed again in double and keep that value as their text
+	std::shared_ptr<Node> fold(const std::shared_ptr<Node>& node)
+	{
+		try {
+			auto folded = node_from_pair(node->eval());
+			if (folded->m_pToken && folded->m_pToken->get_token_type() == TokenType::NUMBER_TYPE) {
+				auto& numtok = static_cast<NumberToken&>(*folded->m_pToken);
+				auto value = fold_real(*node);
+				if (!numtok.is_imaginary && numtok.num.imag() == 0.0f && value.has_value() && std::isfinite(value.value())) {
+					numtok.num = std::complex<float>(static_cast<float>(value.value()));
+					numtok.name = double_name(value.value());
+				}
+			}
+			return folded;
+		}
+		catch (const std::exception&) {
+			return node;
+		}
+	}
+
+	// node = base^exponent, exponent is set if it is a known real number
+	std::pair<const Node*, std::optional<float>> factor(const Node& node)
+	{
+		if (is_type(node, NodeType::SQUARE_NODE))
+			return std::make_pair(node.m_Children[0].get(), 2.0f);
+		if (is_type(node, NodeType::POW_NODE) && is_foldable(*node.m_Children[1]))
+			return std::make_pair(node.m_Children[0].get(), real_literal(*node.m_Children[1]));
+		return std::make_pair(&node, 1.0f);
+	}
+
+	std::shared_ptr<Node> take_base(const std::shared_ptr<Node>& node)
+	{
+		if (is_type(*node, NodeType::SQUARE_NODE))
+			return node->m_Children[0];
+		if (is_type(*node, NodeType::POW_NODE) && is_foldable(*node->m_Children[1]))
+			return node->m_Children[0];
+		return node;
+	}
+
+	// A node of the same type as node with the children ch, node itself if ch are its children. Nodes may be
+	// shared between several trees, so simplification never changes a node, it builds new ones
+	std::shared_ptr<Node> rebuild(const std::shared_ptr<Node>& node, std::vector<std::shared_ptr<Node>> ch)
+	{
+		if (ch == node->m_Children)
+			return node;
+
+		switch (node->get_node_type()) {
+		// Operators
+		case NodeType::NEG_NODE:
+			return std::make_unique<NegNode>(std::move(ch[0]));
+		case NodeType::MUL_NODE:
+			return std::make_unique<MulNode>(std::move(ch[0]), std::move(ch[1]));
+		case NodeType::DIV_NODE:
+			return std::make_unique<DivNode>(std::move(ch[0]), std::move(ch[1]));
+		case NodeType::ADD_NODE:
+			return std::make_unique<AddNode>(std::move(ch[0]), std::move(ch[1]));
+		case NodeType::SUB_NODE:
+			return std::make_unique<SubNode>(std::move(ch[0]), std::move(ch[1]));
+		case NodeType::POW_NODE:
+			return std::make_unique<PowNode>(std::move(ch[0]), std::move(ch[1]));
+		// Unary
+		case NodeType::SGN_NODE:
+			return std::make_unique<SgnNode>(std::move(ch[0]));
+		case NodeType::ABS_NODE:
+			return std::make_unique<AbsNode>(std::move(ch[0]));
+		case NodeType::SQRT_NODE:
+			return std::make_unique<SqrtNode>(std::move(ch[0]));
+		case NodeType::SQUARE_NODE:
+			return std::make_unique<SquareNode>(std::move(ch[0]));
+		case NodeType::EXP_NODE:
+			return std::make_unique<ExpNode>(std::move(ch[0]));
+		case NodeType::LOG_NODE:
+			return std::make_unique<LogNode>(std::move(ch[0]));
+		// Trig
+		case NodeType::SIN_NODE:
+			return std::make_unique<SinNode>(std::move(ch[0]));
+		case NodeType::COS_NODE:
+			return std::make_unique<CosNode>(std::move(ch[0]));
+		case NodeType::TAN_NODE:
+			return std::make_unique<TanNode>(std::move(ch[0]));
+		case NodeType::ASIN_NODE:
+			return std::make_unique<AsinNode>(std::move(ch[0]));
+		case NodeType::ACOS_NODE:
+			return std::make_unique<AcosNode>(std::move(ch[0]));
+		case NodeType::ATAN_NODE:
+			return std::make_unique<AtanNode>(std::move(ch[0]));
+		case NodeType::SINH_NODE:
+			return std::make_unique<SinhNode>(std::move(ch[0]));
+		case NodeType::COSH_NODE:
+			return std::make_unique<CoshNode>(std::move(ch[0]));
+		case NodeType::TANH_NODE:
+			return std::make_unique<TanhNode>(std::move(ch[0]));
+		case NodeType::ASINH_NODE:
+			return std::make_unique<AsinhNode>(std::move(ch[0]));
+		case NodeType::ACOSH_NODE:
+			return std::make_unique<AcoshNode>(std::move(ch[0]));
+		case NodeType::ATANH_NODE:
+			return std::make_unique<AtanhNode>(std::move(ch[0]));
+		// Fused
+		case NodeType::EXPM1_NODE:
+			return std::make_unique<Expm1Node>(std::move(ch[0]));
+		case NodeType::LOG1P_NODE:
+			return std::make_unique<Log1pNode>(std::move(ch[0]));
+		case NodeType::FMA_NODE:
+			return std::make_unique<FmaNode>(std::move(ch[0]), std::move(ch[1]), std::move(ch[2]));
+		// Custom
+		case NodeType::CUSTOM_NODE:
+		{
+			auto& custom = static_cast<const CustomNode&>(*node);
+			return std::make_unique<CustomNode>(custom.get_function(), custom.get_partials(), std::move(ch));
+		}
+		// Outputs
+		case NodeType::CONCAT_NODE:
+		{
+			std::vector<std::shared_ptr<Node>> pieces(ch.begin(), ch.begin() + ch.size() / 2);
+			std::vector<std::shared_ptr<Node>> shapes(ch.begin() + ch.size() / 2, ch.end());
+			return std::make_unique<ConcatNode>(std::move(pieces), std::move(shapes));
+		}
+		default:
+			throw std::runtime_error("node type can't be rebuilt by simplify");
+		}
+	}
+
+	int rank(const Node& node)
+	{
+		switch (node.get_node_type()) {
+		case NodeType::TOKEN_NODE:
+			return 0;
+		case NodeType::TOKEN_FETCHER_NODE:
+			return 1;
+		case NodeType::TENSOR_NODE:
+			return 2;
+		case NodeType::VARIABLE_NODE:
+			return 3;
+		default:
+			return 4;
+		}
+	}
+
+	int node_compare(const Node& a, const Node& b)
+	{
+		if (&a == &b)
+			return 0;
+
+		int ra = rank(a);
+		int rb = rank(b);
+		if (ra != rb)
+			return ra < rb ? -1 : 1;
+
+		switch (ra) {
+		case 0:
+		case 1:
+			return 0;
+		case 2:
+		{
+			auto pa = static_cast<const TensorNode&>(a).get_tensor().unsafeGetTensorImpl();
+			auto pb = static_cast<const TensorNode&>(b).get_tensor().unsafeGetTensorImpl();
+			if (pa == pb)
+				return 0;
+			return std::less<const void*>()(pa, pb) ? -1 : 1;
+		}
+		case 3:
+			return static_cast<const VariableNode&>(a).get_variable_token().name.compare(
+				static_cast<const VariableNode&>(b).get_variable_token().name);
+		default:
+			break;
+		}
+
+		if (a.get_node_type() != b.get_node_type())
+			return a.get_node_type() < b.get_node_type() ? -1 : 1;
+
+		if (a.get_node_type() == NodeType::CUSTOM_NODE) {
+			auto& ca = static_cast<const CustomNode&>(a);
+			auto& cb = static_cast<const CustomNode&>(b);
+			if (ca.get_function() != cb.get_function())
+				return std::less<const void*>()(ca.get_function().get(), cb.get_function().get()) ? -1 : 1;
+			if (ca.get_partials() != cb.get_partials())
+				return ca.get_partials() < cb.get_partials() ? -1 : 1;
+		}
+
+		if (a.m_Children.size() != b.m_Children.size())
+			return a.m_Children.size() < b.m_Children.size() ? -1 : 1;
+
+		for (int i = 0; i < a.m_Children.size(); ++i) {
+			int c = node_compare(*a.m_Children[i], *b.m_Children[i]);
+			if (c != 0)
+				return c;
+		}
+		return 0;
+	}
+
+	std::shared_ptr<Node> simplify_node(std::shared_ptr<Node> node, const SimplifyRules& rules);
+
+	std::shared_ptr<Node> simplify_pow(std::shared_ptr<Node> node, const SimplifyRules& rules)
+	{
+		auto& ch = node->m_Children;
+		if (!is_foldable(*ch[1]))
+			return node;
+
+		auto exponent = real_literal(*ch[1]);
+		if (!exponent.has_value())
+			return node;
+
+		float e = exponent.value();
+		if (e == 0.0f)
+			return literal_node(1.0f);
+		if (e == 1.0f)
+			return ch[0];
+		if (e == 2.0f)
+			return simplify_node(std::make_unique<SquareNode>(ch[0]), rules);
+		if (e == 0.5f)
+			return std::make_unique<SqrtNode>(ch[0]);
+		if (e == -1.0f)
+			return std::make_unique<DivNode>(literal_node(1.0f), ch[0]);
+		return node;
+	}
+
+	std::shared_ptr<Node> simplify_node(std::shared_ptr<Node> node, const SimplifyRules& rules)
+	{
+		auto& ch = node->m_Children;
+		std::int32_t type = node->get_node_type();
+
+		if (type == NodeType::EXPRESSION_NODE)
+			return node;
+
+		// Constant folding
+		if (!ch.empty() && std::all_of(ch.begin(), ch.end(), [](const std::shared_ptr<Node>& c) { return is_foldable(*c); }))
+			return fold(node);
+
+		switch (type) {
+		case NodeType::NEG_NODE:
+		{
+			if (is_type(*ch[0], NodeType::NEG_NODE))
+				return ch[0]->m_Children[0];
+		}
+		break;
+		case NodeType::ADD_NODE:
+		{
+			if (rules.add_commutative && node_compare(*ch[1], *ch[0]) < 0)
+				return simplify_node(rebuild(node, { ch[1], ch[0] }), rules);
+
+			if (literal_equals(*ch[0], 0.0f))
+				return ch[1];
+			if (literal_equals(*ch[1], 0.0f))
+				return ch[0];
+
+			if (is_type(*ch[1], NodeType::NEG_NODE))
+				return simplify_node(std::make_unique<SubNode>(ch[0], ch[1]->m_Children[0]), rules);
+			if (is_type(*ch[0], NodeType::NEG_NODE))
+				return simplify_node(std::make_unique<SubNode>(ch[1], ch[0]->m_Children[0]), rules);
+
+			// exp(x) + -1 -> expm1(x)
+			if (is_type(*ch[0], NodeType::EXP_NODE) && literal_equals(*ch[1], -1.0f))
+				return std::make_unique<Expm1Node>(ch[0]->m_Children[0]);
+			if (is_type(*ch[1], NodeType::EXP_NODE) && literal_equals(*ch[0], -1.0f))
+				return std::make_unique<Expm1Node>(ch[1]->m_Children[0]);
+
+			// a*b + c -> fma(a,b,c)
+			if (is_type(*ch[0], NodeType::MUL_NODE))
+				return simplify_node(std::make_unique<FmaNode>(ch[0]->m_Children[0], ch[0]->m_Children[1], ch[1]), rules);
+			if (is_type(*ch[1], NodeType::MUL_NODE))
+				return simplify_node(std::make_unique<FmaNode>(ch[1]->m_Children[0], ch[1]->m_Children[1], ch[0]), rules);
+		}
+		break;
+		case NodeType::SUB_NODE:
+		{
+			if (literal_equals(*ch[1], 0.0f))
+				return ch[0];
+			if (literal_equals(*ch[0], 0.0f))
+				return simplify_node(std::make_unique<NegNode>(ch[1]), rules);
+
+			if (is_type(*ch[1], NodeType::NEG_NODE))
+				return simplify_node(std::make_unique<AddNode>(ch[0], ch[1]->m_Children[0]), rules);
+
+			// exp(x) - 1 -> expm1(x), 1 - exp(x) -> -expm1(x)
+			if (is_type(*ch[0], NodeType::EXP_NODE) && literal_equals(*ch[1], 1.0f))
+				return std::make_unique<Expm1Node>(ch[0]->m_Children[0]);
+			if (is_type(*ch[1], NodeType::EXP_NODE) && literal_equals(*ch[0], 1.0f))
+				return std::make_unique<NegNode>(std::make_unique<Expm1Node>(ch[1]->m_Children[0]));
+		}
+		break;
+		case NodeType::MUL_NODE:
+		{
+			if (rules.mul_commutative && node_compare(*ch[1], *ch[0]) < 0)
+				return simplify_node(rebuild(node, { ch[1], ch[0] }), rules);
+
+			if (literal_equals(*ch[0], 0.0f))
+				return ch[0];
+			if (literal_equals(*ch[1], 0.0f))
+				return ch[1];
+
+			if (literal_equals(*ch[0], 1.0f))
+				return ch[1];
+			if (literal_equals(*ch[1], 1.0f))
+				return ch[0];
+
+			if (literal_equals(*ch[0], -1.0f))
+				return simplify_node(std::make_unique<NegNode>(ch[1]), rules);
+			if (literal_equals(*ch[1], -1.0f))
+				return simplify_node(std::make_unique<NegNode>(ch[0]), rules);
+
+			if (is_type(*ch[0], NodeType::NEG_NODE) && is_type(*ch[1], NodeType::NEG_NODE))
+				return simplify_node(std::make_unique<MulNode>(ch[0]->m_Children[0], ch[1]->m_Children[0]), rules);
+
+			// Repeated factors, x*x -> square(x), x*square(x) -> pow(x,3), pow(x,a)*pow(x,b) -> pow(x,a+b)
+			auto [lbase, lexp] = factor(*ch[0]);
+			auto [rbase, rexp] = factor(*ch[1]);
+			if (lexp.has_value() && rexp.has_value() && node_equal(*lbase, *rbase)) {
+				float e = lexp.value() + rexp.value();
+				return simplify_pow(std::make_unique<PowNode>(take_base(ch[0]), literal_node(e)), rules);
+			}
+		}
+		break;
+		case NodeType::DIV_NODE:
+		{
+			if (literal_equals(*ch[1], 1.0f))
+				return ch[0];
+			if (literal_equals(*ch[1], -1.0f))
+				return simplify_node(std::make_unique<NegNode>(ch[0]), rules);
+
+			// Division by a constant is a multiplication with its reciprocal
+			if (is_foldable(*ch[1])) {
+				auto lit = real_literal_double(*ch[1]);
+				if (lit.has_value() && lit.value() != 0.0)
+					return simplify_node(std::make_unique<MulNode>(literal_node(1.0 / lit.value()), ch[0]), rules);
+			}
+
+			if (is_type(*ch[0], NodeType::NEG_NODE) && is_type(*ch[1], NodeType::NEG_NODE))
+				return simplify_node(std::make_unique<DivNode>(ch[0]->m_Children[0], ch[1]->m_Children[0]), rules);
+		}
+		break;
+		case NodeType::POW_NODE:
+			return simplify_pow(std::move(node), rules);
+		case NodeType::LOG_NODE:
+		{
+			// log(exp(x)) -> x, complex x only comes back modulo 2*pi*i
+			if (rules.real && is_type(*ch[0], NodeType::EXP_NODE))
+				return ch[0]->m_Children[0];
+
+			// log(1 + x) -> log1p(x)
+			if (is_type(*ch[0], NodeType::ADD_NODE)) {
+				auto& add = ch[0]->m_Children;
+				if (literal_equals(*add[0], 1.0f))
+					return std::make_unique<Log1pNode>(add[1]);
+				if (literal_equals(*add[1], 1.0f))
+					return std::make_unique<Log1pNode>(add[0]);
+			}
+
+			// Children are simplified first, so 1 + a*b has already become fma(a,b,1)
+			if (is_type(*ch[0], NodeType::FMA_NODE)) {
+				auto& fma = ch[0]->m_Children;
+				if (literal_equals(*fma[2], 1.0f))
+					return std::make_unique<Log1pNode>(simplify_node(std::make_unique<MulNode>(fma[0], fma[1]), rules));
+			}
+		}
+		break;
+		case NodeType::FMA_NODE:
+		{
+			if (literal_equals(*ch[0], 0.0f) || literal_equals(*ch[1], 0.0f))
+				return ch[2];
+			if (literal_equals(*ch[2], 0.0f))
+				return simplify_node(std::make_unique<MulNode>(ch[0], ch[1]), rules);
+			if (literal_equals(*ch[0], 1.0f))
+				return simplify_node(std::make_unique<AddNode>(ch[1], ch[2]), rules);
+			if (literal_equals(*ch[1], 1.0f))
+				return simplify_node(std::make_unique<AddNode>(ch[0], ch[2]), rules);
+		}
+		break;
+		case NodeType::SQUARE_NODE:
+		case NodeType::ABS_NODE:
+		{
+			// square(-x) = square(x), abs(-x) = abs(x)
+			if (is_type(*ch[0], NodeType::NEG_NODE))
+				return rebuild(node, { ch[0]->m_Children[0] });
+		}
+		break;
+		default:
+			break;
+		}
+
+		return node;
+	}
+
+	// Simplified nodes by the node they were simplified from, shared subtrees are simplified once
+	using SimplifyMemo = std::unordered_map<const Node*, std::shared_ptr<Node>>;
+
+	std::shared_ptr<Node> simplify_tree(const std::shared_ptr<Node>& node, const SimplifyRules& rules, SimplifyMemo& memo)
+	{
+		auto it = memo.find(node.get());
+		if (it != memo.end())
+			return it->second;
+
+		// Nested expressions are simplified on their own
+		if (is_type(*node, NodeType::EXPRESSION_NODE))
+			return node;
+
+		std::vector<std::shared_ptr<Node>> children;
+		children.reserve(node->m_Children.size());
+		for (auto& child : node->m_Children) {
+			children.push_back(simplify_tree(child, rules, memo));
+		}
+
+		auto simplified = simplify_node(rebuild(node, std::move(children)), rules);
+		memo.emplace(node.get(), simplified);
+		return simplified;
+	}
+
+}
+
+bool tc::expression::node_equal(const Node& a, const Node& b)
+{
+	if (&a == &b)
+		return true;
+
+	if (a.get_node_type() != b.get_node_type())
+		return false;
+
+	switch (a.get_node_type()) {
+	case NodeType::TOKEN_FETCHER_NODE:
+		if (&static_cast<const TokenFetcherNode&>(a).get_fetcher().get() != &static_cast<const TokenFetcherNode&>(b).get_fetcher().get())
+			return false;
+		[[fallthrough]];
+	case NodeType::TOKEN_NODE:
+	{
+		auto& atok = *a.m_pToken;
+		auto& btok = *b.m_pToken;
+		if (atok.get_token_type() != btok.get_token_type())
+			return false;
+		if (atok.get_token_type() == TokenType::NUMBER_TYPE) {
+			auto& anum = static_cast<const NumberToken&>(atok);
+			auto& bnum = static_cast<const NumberToken&>(btok);
+			return anum.num == bnum.num && anum.is_imaginary == bnum.is_imaginary;
+		}
+		return true;
+	}
+	case NodeType::TENSOR_NODE:
+		return static_cast<const TensorNode&>(a).get_tensor().is_same(static_cast<const TensorNode&>(b).get_tensor());
+	case NodeType::VARIABLE_NODE:
+		return static_cast<const VariableNode&>(a).get_variable_token().name == static_cast<const VariableNode&>(b).get_variable_token().name;
+	case NodeType::CUSTOM_NODE:
+	{
+		auto& ca = static_cast<const CustomNode&>(a);
+		auto& cb = static_cast<const CustomNode&>(b);
+		if (ca.get_function() != cb.get_function() || ca.get_partials() != cb.get_partials())
+			return false;
+	}
+	break;
+	default:
+		break;
+	}
+
+	if (a.m_Children.size() != b.m_Children.size())
+		return false;
+
+	for (int i = 0; i < a.m_Children.size(); ++i) {
+		if (!node_equal(*a.m_Children[i], *b.m_Children[i]))
+			return false;
+	}
+	return true;
+}
+
+bool tc::expression::node_less(const Node& a, const Node& b)
+{
+	return node_compare(a, b) < 0;
+}
+
+std::shared_ptr<tc::expression::Node> tc::expression::simplify(const std::shared_ptr<Node>& node, const LexContext& context)
+{
+	SimplifyMemo memo;
+	std::unordered_set<const Node*> visited;
+	auto rules = rules_from_context(context);
+	rules.real = is_real_tree(*node, visited);
+	return simplify_tree(node, rules, memo);
+}
+
+void tc::expression::simplify(Expression& expression, const LexContext& context)
+{
+	expression.m_Children[0] = simplify(expression.m_Children[0], context);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "../../pch.hpp"
+
+#include "../nodes.hpp"
+#include "../expression.hpp"
+#include "../Parser/lexer.hpp"
+
+namespace tc {
+	namespace expression {
+
+		// Structural equality, variables compare by name and tensors by identity
+		bool node_equal(const Node& a, const Node& b);
+
+		// Strict weak ordering used to put the operands of commutative operators in a canonical order,
+		// literals always come first
+		bool node_less(const Node& a, const Node& b);
+
+		// Rewrites the tree bottom up, folds constant subtrees, removes identity and zero terms,
+		// merges repeated factors into square/pow, rewrites exp(x)-1, log(1+x), log(exp(x)) and a*b+c into
+		// the fused nodes and orders the operands of the operators that are commutative in context.
+		// node is left as it is, the result shares the subtrees that didn't change
+		std::shared_ptr<Node> simplify(const std::shared_ptr<Node>& node, const LexContext& context);
+
+		void simplify(Expression& expression, const LexContext& context);
+
+	}
+}
@@ -0,0 +1,447 @@
+#include "../../pch.hpp"
+
+#include "fused.hpp"
+
+namespace {
+
+	// Strides that broadcast t to sizes, 0 along broadcast dimensions
+	std::vector<int64_t> broadcast_strides(const torch::Tensor& t, const std::vector<int64_t>& sizes)
+	{
+		std::vector<int64_t> strides(sizes.size(), 0);
+		int64_t offset = sizes.size() - t.dim();
+		for (int64_t i = 0; i < t.dim(); ++i) {
+			if (t.size(i) != 1)
+				strides[offset + i] = t.stride(i);
+		}
+		return strides;
+	}
+
+	std::vector<int64_t> broadcast_sizes(const std::vector<int64_t>& a, c10::IntArrayRef b)
+	{
+		if (a.empty())
+			return b.vec();
+		if (b.empty())
+			return a;
+		return tc::tc_broadcast_shapes(a, b.vec());
+	}
+
+	// The loop always runs over two dimensions, lower dimensional results get leading ones
+	template<typename T>
+	std::pair<T, T> as_2d(const std::vector<T>& v, T pad)
+	{
+		if (v.size() == 0)
+			return { pad, pad };
+		if (v.size() == 1)
+			return { pad, v[0] };
+		return { v[0], v[1] };
+	}
+
+}
+
+tc::expression::FusedKernel::FusedKernel(const Tape& tape)
+	: m_Tape(tape), m_End(tape.root_end(0))
+{
+	if (!fusible(tape))
+		throw std::runtime_error("tapes with complex literals, custom functions or concatenations can't be fused");
+
+	for (auto& lit : tape.literals()) {
+		m_Literals.push_back(lit.num.real());
+	}
+}
+
+bool tc::expression::FusedKernel::fusible(const Tape& tape)
+{
+	return tape.is_real() && tape.is_elementwise();
+}
+
+bool tc::expression::FusedKernel::supports(const std::vector<torch::Tensor>& inputs) const
+{
+	auto& instrs = m_Tape.instructions();
+
+	std::optional<torch::ScalarType> dtype;
+	auto check = [&dtype](const torch::Tensor& t) {
+		if (!t.defined() || !t.device().is_cpu() || !torch::isFloatingType(t.scalar_type()) || t.dim() > 2)
+			return false;
+		if (!dtype.has_value())
+			dtype = t.scalar_type();
+		return dtype.value() == t.scalar_type();
+	};
+
+	for (int i = 0; i < m_End; ++i) {
+		auto& instr = instrs[i];
+		if (instr.op == TapeOp::INPUT && !check(inputs[instr.payload]))
+			return false;
+		if (instr.op == TapeOp::TENSOR && !check(m_Tape.tensors()[instr.payload]))
+			return false;
+	}
+	return true;
+}
+
+std::vector<int64_t> tc::expression::FusedKernel::result_sizes(const std::vector<torch::Tensor>& inputs, const torch::Tensor& data) const
+{
+	auto& instrs = m_Tape.instructions();
+
+	// All ops are elementwise, so the result has the broadcast shape of everything the root reads
+	std::vector<int64_t> sizes;
+	for (int i = 0; i < m_End; ++i) {
+		auto& instr = instrs[i];
+		if (instr.op == TapeOp::INPUT)
+			sizes = broadcast_sizes(sizes, inputs[instr.payload].sizes());
+		else if (instr.op == TapeOp::TENSOR)
+			sizes = broadcast_sizes(sizes, m_Tape.tensors()[instr.payload].sizes());
+	}
+	if (data.defined())
+		sizes = broadcast_sizes(sizes, data.sizes());
+	return sizes;
+}
+
+void tc::expression::FusedKernel::eval(const std::vector<torch::Tensor>& inputs, const std::vector<std::int32_t>& seeds, std::int32_t nseeds,
+	torch::Tensor& values, const torch::Tensor& data, torch::Tensor& jacobian) const
+{
+	if (inputs.size() != m_Tape.input_names().size() || seeds.size() != inputs.size())
+		throw std::runtime_error("number of inputs or seeds given to fused kernel did not match number of tape inputs");
+
+	if (!supports(inputs))
+		throw std::runtime_error("fused kernel only supports real floating point cpu inputs of one dtype with at most two dimensions");
+
+	auto sizes = result_sizes(inputs, data);
+	if (sizes.size() > 2)
+		throw std::runtime_error("fused kernel results can have at most two dimensions");
+
+	// The dtype of the root is the dtype of the inputs, the literals are 0-dim and don't promote
+	torch::ScalarType dtype = torch::kFloat;
+	for (int i = 0; i < m_End; ++i) {
+		auto& instr = m_Tape.instructions()[i];
+		if (instr.op == TapeOp::INPUT) {
+			dtype = inputs[instr.payload].scalar_type();
+			break;
+		}
+		if (instr.op == TapeOp::TENSOR) {
+			dtype = m_Tape.tensors()[instr.payload].scalar_type();
+			break;
+		}
+	}
+
+	if (data.defined() && (data.scalar_type() != dtype || !data.device().is_cpu()))
+		throw std::runtime_error("data must be a cpu tensor of the same dtype as the inputs");
+
+	if (!values.defined() || values.sizes() != at::IntArrayRef(sizes) || values.scalar_type() != dtype || !values.device().is_cpu())
+		values = torch::empty(sizes, torch::TensorOptions().dtype(dtype));
+
+	if (jacobian.defined()) {
+		auto jsizes = sizes;
+		jsizes.push_back(nseeds);
+		if (jacobian.sizes() != at::IntArrayRef(jsizes) || jacobian.scalar_type() != dtype || !jacobian.device().is_cpu())
+			throw std::runtime_error("jacobian must be a cpu tensor of the result shape followed by nseeds");
+	}
+
+	AT_DISPATCH_FLOATING_TYPES(dtype, "fused_tape_eval", [&] {
+		run<scalar_t>(inputs, seeds, nseeds, sizes, values, data, jacobian);
+	});
+}
+
+template<typename scalar_t>
+void tc::expression::FusedKernel::run(const std::vector<torch::Tensor>& inputs, const std::vector<std::int32_t>& seeds, std::int32_t nseeds,
+	const std::vector<int64_t>& sizes, torch::Tensor& values, const torch::Tensor& data, torch::Tensor& jacobian) const
+{
+	auto& instrs = m_Tape.instructions();
+	std::int32_t nslots = m_End;
+	std::int32_t root = m_Tape.root();
+	bool jac = jacobian.defined();
+
+	struct Leaf {
+		const scalar_t* ptr = nullptr;
+		int64_t s0 = 0;
+		int64_t s1 = 0;
+	};
+
+	auto leaf = [&sizes](const torch::Tensor& t) {
+		auto strides = as_2d(broadcast_strides(t, sizes), int64_t(0));
+		return Leaf{ t.data_ptr<scalar_t>(), strides.first, strides.second };
+	};
+
+	// Leaves by slot, active slots depend on a seeded input
+	std::vector<Leaf> leaves(nslots);
+	std::vector<std::int32_t> slot_seeds(nslots, -1);
+	std::vector<char> active(nslots, false);
+	std::vector<scalar_t> literals(m_Literals.begin(), m_Literals.end());
+	for (int i = 0; i < nslots; ++i) {
+		auto& instr = instrs[i];
+		switch (instr.op) {
+		case TapeOp::INPUT:
+			leaves[instr.out] = leaf(inputs[instr.payload]);
+			slot_seeds[instr.out] = seeds[instr.payload];
+			active[instr.out] = seeds[instr.payload] >= 0;
+			break;
+		case TapeOp::TENSOR:
+			leaves[instr.out] = leaf(m_Tape.tensors()[instr.payload]);
+			break;
+		case TapeOp::LITERAL:
+			break;
+		default:
+			for (auto in : instr.in) {
+				active[instr.out] = active[instr.out] || active[in];
+			}
+		}
+	}
+
+	Leaf dleaf;
+	if (data.defined())
+		dleaf = leaf(data);
+
+	auto vstrides = as_2d(broadcast_strides(values, sizes), int64_t(0));
+	scalar_t* vptr = values.data_ptr<scalar_t>();
+
+	std::array<int64_t, 3> jstrides = { 0, 0, 0 };
+	scalar_t* jptr = nullptr;
+	if (jac) {
+		jptr = jacobian.data_ptr<scalar_t>();
+		auto s = as_2d(broadcast_strides(jacobian.select(-1, 0), sizes), int64_t(0));
+		jstrides = { s.first, s.second, jacobian.stride(-1) };
+	}
+
+	auto extent = as_2d(sizes, int64_t(1));
+	int64_t nrows = extent.first;
+	int64_t ncols = extent.second;
+
+	int64_t grain = std::max<int64_t>(1, at::internal::GRAIN_SIZE / std::max<int64_t>(1, ncols * nslots));
+
+	at::parallel_for(0, nrows, grain, [&](int64_t begin, int64_t end) {
+		// Registers for the values and, for active slots, the gradients of every slot of one element
+		std::vector<scalar_t> v(nslots);
+		std::vector<scalar_t> g(jac ? nslots * nseeds : 0);
+
+		for (int64_t r = begin; r < end; ++r) {
+			for (int64_t c = 0; c < ncols; ++c) {
+				for (int i = 0; i < nslots; ++i) {
+					auto& instr = instrs[i];
+					scalar_t& out = v[instr.out];
+					scalar_t a = instr.in.size() > 0 ? v[instr.in[0]] : scalar_t(0);
+					scalar_t b = instr.in.size() > 1 ? v[instr.in[1]] : scalar_t(0);
+					scalar_t e = instr.in.size() > 2 ? v[instr.in[2]] : scalar_t(0);
+
+					switch (instr.op) {
+					case TapeOp::INPUT:
+					case TapeOp::TENSOR:
+					{
+						auto& l = leaves[instr.out];
+						out = l.ptr[r * l.s0 + c * l.s1];
+						if (jac && active[instr.out]) {
+							scalar_t* go = &g[instr.out * nseeds];
+							std::fill(go, go + nseeds, scalar_t(0));
+							go[slot_seeds[instr.out]] = scalar_t(1);
+						}
+						continue;
+					}
+					case TapeOp::LITERAL:
+						out = literals[instr.payload];
+						continue;
+					// Operators
+					case TapeOp::NEG:
+						out = -a;
+						break;
+					case TapeOp::ADD:
+						out = a + b;
+						break;
+					case TapeOp::SUB:
+						out = a - b;
+						break;
+					case TapeOp::MUL:
+						out = a * b;
+						break;
+					case TapeOp::DIV:
+						out = a / b;
+						break;
+					case TapeOp::POW:
+						out = std::pow(a, b);
+						break;
+					// Unary
+					case TapeOp::SGN:
+						out = scalar_t((scalar_t(0) < a) - (a < scalar_t(0)));
+						break;
+					case TapeOp::ABS:
+						out = std::abs(a);
+						break;
+					case TapeOp::SQRT:
+						out = std::sqrt(a);
+						break;
+					case TapeOp::SQUARE:
+						out = a * a;
+						break;
+					case TapeOp::EXP:
+						out = std::exp(a);
+						break;
+					case TapeOp::LOG:
+						out = std::log(a);
+						break;
+					// Trig
+					case TapeOp::SIN:
+						out = std::sin(a);
+						break;
+					case TapeOp::COS:
+						out = std::cos(a);
+						break;
+					case TapeOp::TAN:
+						out = std::tan(a);
+						break;
+					case TapeOp::ASIN:
+						out = std::asin(a);
+						break;
+					case TapeOp::ACOS:
+						out = std::acos(a);
+						break;
+					case TapeOp::ATAN:
+						out = std::atan(a);
+						break;
+					case TapeOp::SINH:
+						out = std::sinh(a);
+						break;
+					case TapeOp::COSH:
+						out = std::cosh(a);
+						break;
+					case TapeOp::TANH:
+						out = std::tanh(a);
+						break;
+					case TapeOp::ASINH:
+						out = std::asinh(a);
+						break;
+					case TapeOp::ACOSH:
+						out = std::acosh(a);
+						break;
+					case TapeOp::ATANH:
+						out = std::atanh(a);
+						break;
+					// Fused
+					case TapeOp::EXPM1:
+						out = std::expm1(a);
+						break;
+					case TapeOp::LOG1P:
+						out = std::log1p(a);
+						break;
+					case TapeOp::FMA:
+						out = std::fma(b, e, a);
+						break;
+					}
+
+					if (!jac || !active[instr.out])
+						continue;
+
+					// Partial derivatives with respect to the operands
+					scalar_t da = 0;
+					scalar_t db = 0;
+					scalar_t de = 0;
+					switch (instr.op) {
+					case TapeOp::NEG:
+						da = -1;
+						break;
+					case TapeOp::ADD:
+						da = 1;
+						db = 1;
+						break;
+					case TapeOp::SUB:
+						da = 1;
+						db = -1;
+						break;
+					case TapeOp::MUL:
+						da = b;
+						db = a;
+						break;
+					case TapeOp::DIV:
+						da = scalar_t(1) / b;
+						db = -out / b;
+						break;
+					case TapeOp::POW:
+						da = b * std::pow(a, b - scalar_t(1));
+						if (active[instr.in[1]])
+							db = out * std::log(a);
+						break;
+					case TapeOp::SGN:
+						break;
+					case TapeOp::ABS:
+						da = scalar_t((scalar_t(0) < a) - (a < scalar_t(0)));
+						break;
+					case TapeOp::SQRT:
+						da = scalar_t(0.5) / out;
+						break;
+					case TapeOp::SQUARE:
+						da = scalar_t(2) * a;
+						break;
+					case TapeOp::EXP:
+						da = out;
+						break;
+					case TapeOp::LOG:
+						da = scalar_t(1) / a;
+						break;
+					case TapeOp::SIN:
+						da = std::cos(a);
+						break;
+					case TapeOp::COS:
+						da = -std::sin(a);
+						break;
+					case TapeOp::TAN:
+						da = scalar_t(1) + out * out;
+						break;
+					case TapeOp::ASIN:
+						da = scalar_t(1) / std::sqrt(scalar_t(1) - a * a);
+						break;
+					case TapeOp::ACOS:
+						da = scalar_t(-1) / std::sqrt(scalar_t(1) - a * a);
+						break;
+					case TapeOp::ATAN:
+						da = scalar_t(1) / (scalar_t(1) + a * a);
+						break;
+					case TapeOp::SINH:
+						da = std::cosh(a);
+						break;
+					case TapeOp::COSH:
+						da = std::sinh(a);
+						break;
+					case TapeOp::TANH:
+						da = scalar_t(1) - out * out;
+						break;
+					case TapeOp::ASINH:
+						da = scalar_t(1) / std::sqrt(a * a + scalar_t(1));
+						break;
+					case TapeOp::ACOSH:
+						da = scalar_t(1) / std::sqrt(a * a - scalar_t(1));
+						break;
+					case TapeOp::ATANH:
+						da = scalar_t(1) / (scalar_t(1) - a * a);
+						break;
+					case TapeOp::EXPM1:
+						da = out + scalar_t(1);
+						break;
+					case TapeOp::LOG1P:
+						da = scalar_t(1) / (scalar_t(1) + a);
+						break;
+					case TapeOp::FMA:
+						da = 1;
+						db = e;
+						de = b;
+						break;
+					}
+
+					scalar_t* go = &g[instr.out * nseeds];
+					const scalar_t* ga = active[instr.in[0]] ? &g[instr.in[0] * nseeds] : nullptr;
+					const scalar_t* gb = (instr.in.size() > 1 && active[instr.in[1]]) ? &g[instr.in[1] * nseeds] : nullptr;
+					const scalar_t* ge = (instr.in.size() > 2 && active[instr.in[2]]) ? &g[instr.in[2] * nseeds] : nullptr;
+					for (int s = 0; s < nseeds; ++s) {
+						go[s] = (ga ? da * ga[s] : scalar_t(0)) + (gb ? db * gb[s] : scalar_t(0)) + (ge ? de * ge[s] : scalar_t(0));
+					}
+				}
+
+				scalar_t value = v[root];
+				if (dleaf.ptr)
+					value -= dleaf.ptr[r * dleaf.s0 + c * dleaf.s1];
+				vptr[r * vstrides.first + c * vstrides.second] = value;
+
+				if (jac) {
+					scalar_t* jo = jptr + r * jstrides[0] + c * jstrides[1];
+					for (int s = 0; s < nseeds; ++s) {
+						jo[s * jstrides[2]] = active[root] ? g[root * nseeds + s] : scalar_t(0);
+					}
+				}
+			}
+		}
+	});
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "../../pch.hpp"
+
+#include <array>
+
+#include "tape.hpp"
+
+namespace tc {
+	namespace expression {
+
+		// Evaluates the first root of a tape in one loop over the elements of the result, running all
+		// instructions on scalars for one element at a time instead of one libtorch kernel per instruction.
+		// The jacobian with respect to the seeded inputs is carried along by forward mode, so values and
+		// jacobian are produced in a single pass over memory. CPU and real floating point only.
+		class FusedKernel {
+		public:
+
+			// Throws if the tape has complex literals
+			FusedKernel(const Tape& tape);
+
+			// True if the tape is real and elementwise, see Tape::is_real and Tape::is_elementwise
+			static bool fusible(const Tape& tape);
+
+			// True if all inputs and tape tensors are real floating point cpu tensors of one dtype
+			// and the result has at most two dimensions
+			bool supports(const std::vector<torch::Tensor>& inputs) const;
+
+			// Broadcast shape of all inputs and tensors the root reads, and of data if it is defined
+			std::vector<int64_t> result_sizes(const std::vector<torch::Tensor>& inputs, const torch::Tensor& data) const;
+
+			// values gets the root minus data, or the root if data is undefined, and is replaced by a new tensor
+			// unless it already has the result shape. With jacobian defined it must have the result shape followed
+			// by nseeds, entry k along the last dimension is the derivative with respect to the input with seeds[i] == k
+			void eval(const std::vector<torch::Tensor>& inputs, const std::vector<std::int32_t>& seeds, std::int32_t nseeds,
+				torch::Tensor& values, const torch::Tensor& data, torch::Tensor& jacobian) const;
+
+		private:
+
+			template<typename scalar_t>
+			void run(const std::vector<torch::Tensor>& inputs, const std::vector<std::int32_t>& seeds, std::int32_t nseeds,
+				const std::vector<int64_t>& sizes, torch::Tensor& values, const torch::Tensor& data, torch::Tensor& jacobian) const;
+
+		private:
+
+			const Tape& m_Tape;
+			std::int32_t m_End;
+			std::vector<double> m_Literals;
+		};
+
+	}
+}
@@ -0,0 +1,185 @@
+#include "../../pch.hpp"
+
+#include "script.hpp"
+
+#include <torch/csrc/jit/passes/common_subexpression_elimination.h>
+#include <torch/csrc/jit/passes/constant_propagation.h>
+#include <torch/csrc/jit/passes/dead_code_elimination.h>
+
+namespace {
+
+	const char* tape_op_name(std::int32_t op)
+	{
+		using namespace tc::expression;
+		switch (op) {
+		case TapeOp::NEG: return "neg";
+		case TapeOp::ADD: return "add";
+		case TapeOp::SUB: return "sub";
+		case TapeOp::MUL: return "mul";
+		case TapeOp::DIV: return "div";
+		case TapeOp::POW: return "pow";
+		case TapeOp::SGN: return "sgn";
+		case TapeOp::ABS: return "abs";
+		case TapeOp::SQRT: return "sqrt";
+		case TapeOp::SQUARE: return "square";
+		case TapeOp::EXP: return "exp";
+		case TapeOp::LOG: return "log";
+		case TapeOp::SIN: return "sin";
+		case TapeOp::COS: return "cos";
+		case TapeOp::TAN: return "tan";
+		case TapeOp::ASIN: return "asin";
+		case TapeOp::ACOS: return "acos";
+		case TapeOp::ATAN: return "atan";
+		case TapeOp::SINH: return "sinh";
+		case TapeOp::COSH: return "cosh";
+		case TapeOp::TANH: return "tanh";
+		case TapeOp::ASINH: return "asinh";
+		case TapeOp::ACOSH: return "acosh";
+		case TapeOp::ATANH: return "atanh";
+		case TapeOp::EXPM1: return "expm1";
+		case TapeOp::LOG1P: return "log1p";
+		case TapeOp::FMA: return "addcmul";
+		default:
+			throw std::runtime_error("tape op has no aten counterpart");
+		}
+	}
+
+	void optimize(std::shared_ptr<torch::jit::Graph>& graph)
+	{
+		torch::jit::ConstantPropagation(graph);
+		torch::jit::EliminateCommonSubexpression(graph);
+		torch::jit::EliminateDeadCode(graph);
+	}
+
+}
+
+tc::expression::ScriptedTape::ScriptedTape(const Tape& tape)
+	: m_Tape(tape), m_Module(c10::QualifiedName("__torch__.tc.ScriptedTape"))
+{
+
+}
+
+bool tc::expression::ScriptedTape::scriptable(const Tape& tape)
+{
+	return tape.is_real() && tape.is_elementwise();
+}
+
+std::shared_ptr<torch::jit::Graph> tc::expression::ScriptedTape::lower(const Tape& tape, std::int32_t nroots)
+{
+	auto graph = std::make_shared<torch::jit::Graph>();
+
+	std::vector<torch::jit::Value*> values;
+	for (auto& name : tape.input_names()) {
+		values.push_back(graph->addInput(name)->setType(c10::TensorType::get()));
+	}
+	lower_into(tape, nroots, *graph, values);
+
+	optimize(graph);
+	return graph;
+}
+
+void tc::expression::ScriptedTape::add_method(const std::string& name, std::int32_t nroots)
+{
+	auto graph = std::make_shared<torch::jit::Graph>();
+
+	graph->addInput("self")->setType(m_Module.type());
+	std::vector<torch::jit::Value*> values;
+	for (auto& input_name : m_Tape.input_names()) {
+		values.push_back(graph->addInput(input_name)->setType(c10::TensorType::get()));
+	}
+	lower_into(m_Tape, nroots, *graph, values);
+
+	optimize(graph);
+
+	auto fn = m_Module._ivalue()->compilation_unit()->create_function(
+		c10::QualifiedName(*m_Module.type()->name(), name), graph);
+	m_Module.type()->addMethod(fn);
+	m_MethodRoots[name] = nroots;
+}
+
+bool tc::expression::ScriptedTape::has_method(const std::string& name) const
+{
+	return m_MethodRoots.find(name) != m_MethodRoots.end();
+}
+
+std::int32_t tc::expression::ScriptedTape::method_roots(const std::string& name) const
+{
+	auto it = m_MethodRoots.find(name);
+	if (it == m_MethodRoots.end())
+		throw std::runtime_error("scripted tape has no method " + name);
+	return it->second;
+}
+
+void tc::expression::ScriptedTape::run(const std::string& name, const std::vector<torch::Tensor>& inputs, std::vector<torch::Tensor>& outputs)
+{
+	if (inputs.size() != m_Tape.input_names().size())
+		throw std::runtime_error("number of inputs given to scripted tape did not match number of tape inputs");
+
+	if (!has_method(name))
+		throw std::runtime_error("scripted tape has no method " + name);
+
+	std::vector<c10::IValue> stack(inputs.begin(), inputs.end());
+	auto result = m_Module.get_method(name)(std::move(stack));
+
+	auto& elements = result.toTuple()->elements();
+	outputs.resize(elements.size());
+	for (int i = 0; i < elements.size(); ++i) {
+		outputs[i] = elements[i].toTensor();
+	}
+}
+
+std::shared_ptr<torch::jit::Graph> tc::expression::ScriptedTape::graph(const std::string& name) const
+{
+	if (!has_method(name))
+		throw std::runtime_error("scripted tape has no method " + name);
+	return m_Module.get_method(name).graph();
+}
+
+torch::jit::Module& tc::expression::ScriptedTape::module()
+{
+	return m_Module;
+}
+
+void tc::expression::ScriptedTape::lower_into(const Tape& tape, std::int32_t nroots, torch::jit::Graph& graph, std::vector<torch::jit::Value*>& values)
+{
+	if (nroots < 1 || nroots > tape.roots().size())
+		throw std::runtime_error("nroots must be in [1, number of tape roots]");
+
+	// values holds the graph inputs on entry, the slots are filled in as the instructions are lowered
+	std::vector<torch::jit::Value*> inputs = std::move(values);
+	values.assign(tape.num_slots(), nullptr);
+
+	std::int32_t end = tape.root_end(nroots - 1);
+	for (int i = 0; i < end; ++i) {
+		auto& instr = tape.instructions()[i];
+		switch (instr.op) {
+		case TapeOp::INPUT:
+			values[instr.out] = inputs[instr.payload];
+			break;
+		case TapeOp::LITERAL:
+		{
+			// Methods are shared by all input dtypes. A 0-dim double never promotes a float tensor, so double literals
+			// give float inputs the float literals of the eager tape and double inputs their exact double constants
+			values[instr.out] = graph.insertConstant(Tape::literal_tensor(tape.literals()[instr.payload], torch::kDouble));
+		}
+		break;
+		case TapeOp::TENSOR:
+			values[instr.out] = graph.insertConstant(tape.tensors()[instr.payload]);
+			break;
+		default:
+		{
+			std::vector<torch::jit::NamedValue> args;
+			for (auto in : instr.in) {
+				args.emplace_back(values[in]);
+			}
+			values[instr.out] = graph.insert(c10::Symbol::aten(tape_op_name(instr.op)), args);
+		}
+		}
+	}
+
+	std::vector<torch::jit::Value*> roots;
+	for (int i = 0; i < nroots; ++i) {
+		roots.push_back(values[tape.roots()[i]]);
+	}
+	graph.registerOutput(graph.insertNode(graph.createTuple(roots))->output());
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "../../pch.hpp"
+
+#include <torch/csrc/jit/ir/ir.h>
+#include <torch/csrc/jit/api/module.h>
+
+#include "tape.hpp"
+
+namespace tc {
+	namespace expression {
+
+		// A tape lowered to TorchScript graphs, held as methods of a scripted module so that the graph
+		// executor can optimize and fuse them. Each method takes the tape inputs in order and returns the
+		// values of a prefix of the roots as a tuple. The tape must outlive the module
+		class ScriptedTape {
+		public:
+
+			ScriptedTape(const Tape& tape);
+
+			// Custom functions and concatenations are not lowered to TorchScript, tapes using them can't be scripted.
+			// Neither can complex tapes, the precision of their complex literals depends on the input dtypes
+			static bool scriptable(const Tape& tape);
+
+			// Lowers the instructions needed by the first nroots roots to a graph with one input per tape input
+			static std::shared_ptr<torch::jit::Graph> lower(const Tape& tape, std::int32_t nroots);
+
+			// Adds a method evaluating the first nroots roots
+			void add_method(const std::string& name, std::int32_t nroots);
+
+			bool has_method(const std::string& name) const;
+
+			// Number of roots method name returns
+			std::int32_t method_roots(const std::string& name) const;
+
+			// Runs method name, outputs gets one tensor per root in root order
+			void run(const std::string& name, const std::vector<torch::Tensor>& inputs, std::vector<torch::Tensor>& outputs);
+
+			std::shared_ptr<torch::jit::Graph> graph(const std::string& name) const;
+
+			torch::jit::Module& module();
+
+		private:
+
+			// Adds the instructions needed by the first nroots roots and their output tuple to graph,
+			// values holds the graph inputs on entry and the graph value of every slot on return
+			static void lower_into(const Tape& tape, std::int32_t nroots, torch::jit::Graph& graph, std::vector<torch::jit::Value*>& values);
+
+		private:
+
+			const Tape& m_Tape;
+			torch::jit::Module m_Module;
+			std::map<std::string, std::int32_t> m_MethodRoots;
+		};
+
+	}
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "../../pch.hpp"
+
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <type_traits>
+
+namespace tc {
+	namespace expression {
+
+		// Little helpers for the binary formats of tapes and compiled models. Values are written in the byte order
+		// of the writing machine, strings and vectors are prefixed by their length
+
+		// Longest string or vector a stream may announce, larger lengths can only come from a corrupt stream
+		constexpr std::uint64_t BINARY_LENGTH_LIMIT = std::uint64_t(1) << 32;
+
+		template<typename T>
+		void write_binary(std::ostream& out, const T& value)
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "only trivially copyable values are written as raw bytes");
+			out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+		}
+
+		template<typename T>
+		T read_binary(std::istream& in)
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "only trivially copyable values are read as raw bytes");
+			T value;
+			in.read(reinterpret_cast<char*>(&value), sizeof(T));
+			if (!in)
+				throw std::runtime_error("unexpected end of serialized stream");
+			return value;
+		}
+
+		inline std::uint64_t read_binary_length(std::istream& in)
+		{
+			auto size = read_binary<std::uint64_t>(in);
+			if (size > BINARY_LENGTH_LIMIT)
+				throw std::runtime_error("serialized stream has an invalid length");
+			return size;
+		}
+
+		inline void write_binary(std::ostream& out, const std::string& str)
+		{
+			write_binary<std::uint64_t>(out, str.size());
+			out.write(str.data(), str.size());
+		}
+
+		inline std::string read_binary_string(std::istream& in)
+		{
+			auto size = read_binary_length(in);
+
+			// Read in chunks, so a truncated stream ends before the announced size is ever allocated
+			std::string str;
+			char chunk[1 << 16];
+			while (str.size() < size) {
+				std::uint64_t n = std::min<std::uint64_t>(size - str.size(), sizeof(chunk));
+				in.read(chunk, n);
+				if (!in)
+					throw std::runtime_error("unexpected end of serialized stream");
+				str.append(chunk, n);
+			}
+			return str;
+		}
+
+		template<typename T>
+		void write_binary(std::ostream& out, const std::vector<T>& values)
+		{
+			write_binary<std::uint64_t>(out, values.size());
+			for (auto& value : values) {
+				write_binary(out, value);
+			}
+		}
+
+		template<typename T>
+		std::vector<T> read_binary_vector(std::istream& in)
+		{
+			auto size = read_binary_length(in);
+			std::vector<T> values;
+			values.reserve(std::min<std::uint64_t>(size, 1 << 16));
+			for (std::uint64_t i = 0; i < size; ++i) {
+				if constexpr (std::is_same_v<T, std::string>)
+					values.push_back(read_binary_string(in));
+				else
+					values.push_back(read_binary<T>(in));
+			}
+			return values;
+		}
+
+		// Tensors go through torch::save into a length prefixed blob so they can sit in the middle of a stream
+		inline void write_binary(std::ostream& out, const torch::Tensor& tensor)
+		{
+			std::ostringstream blob;
+			torch::save(tensor, blob);
+			write_binary(out, blob.str());
+		}
+
+		inline torch::Tensor read_binary_tensor(std::istream& in)
+		{
+			std::istringstream blob(read_binary_string(in));
+			torch::Tensor tensor;
+			torch::load(tensor, blob);
+			return tensor;
+		}
+
+		// Writes and checks the four character magic and version that start every format
+		inline void write_binary_header(std::ostream& out, const char(&magic)[5], std::uint32_t version)
+		{
+			out.write(magic, 4);
+			write_binary(out, version);
+		}
+
+		inline void read_binary_header(std::istream& in, const char(&magic)[5], std::uint32_t version)
+		{
+			char read_magic[4];
+			in.read(read_magic, 4);
+			if (!in || !std::equal(read_magic, read_magic + 4, magic))
+				throw std::runtime_error(std::string("stream does not start with the magic ") + magic);
+
+			auto read_version = read_binary<std::uint32_t>(in);
+			if (read_version != version)
+				throw std::runtime_error(std::string(magic) + " stream has version " + std::to_string(read_version) +
+					", expected " + std::to_string(version));
+		}
+
+	}
+}
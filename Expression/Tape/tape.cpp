@@ -0,0 +1,1520 @@
+#include "../../pch.hpp"
+
+#include "tape.hpp"
+#include "serialize.hpp"
+#include "../expression.hpp"
+
+namespace {
+
+	// Rough costs of the schedule, in elements of a cheap elementwise op: dispatching one torch op, and
+	// handing a level to the thread pool and waiting for all of it to finish
+	constexpr int64_t SCHEDULE_OP_COST = 2048;
+	constexpr int64_t SCHEDULE_LEVEL_COST = 8192;
+
+	tc::expression::TapeShapeKey shape_key(const torch::Tensor& t)
+	{
+		if (!t.defined())
+			return { {}, -1, -1, -1 };
+		return { t.sizes().vec(), static_cast<std::int32_t>(t.scalar_type()),
+			static_cast<std::int32_t>(t.device().type()), static_cast<std::int32_t>(t.device().index()) };
+	}
+
+	bool key_matches(const tc::expression::TapeShapeKey& key, const torch::Tensor& t)
+	{
+		if (!t.defined())
+			return std::get<1>(key) == -1;
+		return t.sizes() == at::IntArrayRef(std::get<0>(key)) && std::get<1>(key) == static_cast<std::int32_t>(t.scalar_type()) &&
+			std::get<2>(key) == static_cast<std::int32_t>(t.device().type()) && std::get<3>(key) == static_cast<std::int32_t>(t.device().index());
+	}
+
+	// Derivative of a unary tape op given its input a and output out, undefined if it is zero
+	torch::Tensor unary_derivative(std::int32_t op, const torch::Tensor& a, const torch::Tensor& out)
+	{
+		using namespace tc::expression;
+
+		switch (op) {
+		case TapeOp::SGN:
+			return torch::Tensor();
+		case TapeOp::ABS:
+			return torch::sgn(a);
+		case TapeOp::SQRT:
+			return 0.5 / out;
+		case TapeOp::SQUARE:
+			return 2.0 * a;
+		case TapeOp::EXP:
+			return out;
+		case TapeOp::LOG:
+			return 1.0 / a;
+		case TapeOp::SIN:
+			return torch::cos(a);
+		case TapeOp::COS:
+			return torch::neg(torch::sin(a));
+		case TapeOp::TAN:
+			return 1.0 + torch::square(out);
+		case TapeOp::ASIN:
+			return torch::rsqrt(1.0 - torch::square(a));
+		case TapeOp::ACOS:
+			return torch::neg(torch::rsqrt(1.0 - torch::square(a)));
+		case TapeOp::ATAN:
+			return 1.0 / (1.0 + torch::square(a));
+		case TapeOp::SINH:
+			return torch::cosh(a);
+		case TapeOp::COSH:
+			return torch::sinh(a);
+		case TapeOp::TANH:
+			return 1.0 - torch::square(out);
+		case TapeOp::ASINH:
+			return torch::rsqrt(torch::square(a) + 1.0);
+		case TapeOp::ACOSH:
+			return torch::rsqrt(torch::square(a) - 1.0);
+		case TapeOp::ATANH:
+			return 1.0 / (1.0 - torch::square(a));
+		// Fused
+		case TapeOp::EXPM1:
+			return out + 1.0;
+		case TapeOp::LOG1P:
+			return 1.0 / (1.0 + a);
+		default:
+			throw std::runtime_error("unknown unary tape op");
+		}
+	}
+
+	// The kernel of custom, with partial appended to its partials unless it is -1, called on the operands of instr
+	torch::Tensor eval_custom(const tc::expression::TapeCustom& custom, std::int32_t partial, const tc::expression::TapeInstruction& instr,
+		const std::vector<torch::Tensor>& slots)
+	{
+		auto partials = custom.partials;
+		if (partial != -1)
+			partials.push_back(partial);
+
+		std::vector<torch::Tensor> args;
+		args.reserve(instr.in.size());
+		for (auto in : instr.in) {
+			args.push_back(slots[in]);
+		}
+		return custom.function->kernel(partials)(args);
+	}
+
+	// The sizes the pieces of a CONCAT instruction are expanded to, given the sizes of every slot
+	template<typename SizesOf>
+	std::vector<std::vector<int64_t>> concat_piece_sizes(const tc::expression::TapeInstruction& instr, SizesOf sizes_of)
+	{
+		std::int32_t npieces = instr.in.size() / 2;
+		std::vector<std::vector<int64_t>> pieces;
+		std::vector<std::vector<int64_t>> shapes;
+		for (int i = 0; i < npieces; ++i) {
+			pieces.push_back(sizes_of(instr.in[i]));
+			shapes.push_back(sizes_of(instr.in[npieces + i]));
+		}
+		return tc::expression::concat_sizes(pieces, shapes);
+	}
+
+}
+
+tc::expression::Tape::Tape(const Node& root)
+	: Tape(std::vector<tc::refw<const Node>>{ root })
+{
+}
+
+tc::expression::Tape::Tape(const std::vector<tc::refw<const Node>>& roots)
+{
+	lower_roots(roots);
+}
+
+tc::expression::Tape::Tape(const std::vector<tc::refw<const Node>>& roots, const std::vector<std::string>& input_names)
+	: m_InputNames(input_names), m_InputFetchers(input_names.size()), m_BoundInputs(true)
+{
+	lower_roots(roots);
+}
+
+void tc::expression::Tape::fetch_inputs(std::vector<torch::Tensor>& inputs) const
+{
+	inputs.resize(m_InputFetchers.size());
+	for (int i = 0; i < m_InputFetchers.size(); ++i) {
+		auto& fetcher = m_InputFetchers[i];
+		inputs[i] = fetcher.has_value() ? fetcher.value().get()() : torch::Tensor();
+	}
+}
+
+void tc::expression::Tape::eval(const std::vector<torch::Tensor>& inputs, std::vector<torch::Tensor>& slots) const
+{
+	eval(inputs, slots, m_Roots.size());
+}
+
+void tc::expression::Tape::eval(const std::vector<torch::Tensor>& inputs, std::vector<torch::Tensor>& slots, std::int32_t nroots) const
+{
+	if (nroots < 1 || nroots > m_Roots.size())
+		throw std::runtime_error("nroots must be in [1, number of tape roots]");
+
+	if (inputs.size() != m_InputNames.size())
+		throw std::runtime_error("number of inputs given to tape did not match number of tape inputs");
+
+	if (slots.size() < m_Instructions.size())
+		slots.resize(m_Instructions.size());
+
+	auto& literals = literal_tensors(inputs);
+
+	std::int32_t end = m_RootEnds[nroots - 1];
+	for (int i = 0; i < end; ++i) {
+		eval_instruction(m_Instructions[i], inputs, literals, slots);
+	}
+}
+
+void tc::expression::Tape::eval_forward(const std::vector<torch::Tensor>& inputs, const std::vector<std::int32_t>& seeds, std::int32_t nseeds,
+	std::vector<torch::Tensor>& slots, std::vector<torch::Tensor>& grads, std::int32_t nroots) const
+{
+	if (nroots < 1 || nroots > m_Roots.size())
+		throw std::runtime_error("nroots must be in [1, number of tape roots]");
+
+	if (inputs.size() != m_InputNames.size() || seeds.size() != m_InputNames.size())
+		throw std::runtime_error("number of inputs or seeds given to tape did not match number of tape inputs");
+
+	if (slots.size() < m_Instructions.size())
+		slots.resize(m_Instructions.size());
+	if (grads.size() < m_Instructions.size())
+		grads.resize(m_Instructions.size());
+
+	// Gradients carry one extra trailing dimension of size nseeds, an undefined gradient means
+	// the slot doesn't depend on any seeded input
+	auto ex = [&slots](std::int32_t slot) {
+		return slots[slot].unsqueeze(-1);
+	};
+
+	auto sum = [](const torch::Tensor& a, const torch::Tensor& b) {
+		if (!a.defined())
+			return b;
+		if (!b.defined())
+			return a;
+		return torch::add(a, b);
+	};
+
+	auto& literals = literal_tensors(inputs);
+
+	std::int32_t end = m_RootEnds[nroots - 1];
+	for (int i = 0; i < end; ++i) {
+		auto& instr = m_Instructions[i];
+		eval_instruction(instr, inputs, literals, slots);
+
+		torch::Tensor& g = grads[instr.out];
+		g = torch::Tensor();
+
+		if (instr.op == TapeOp::INPUT) {
+			std::int32_t seed = seeds[instr.payload];
+			if (seed >= 0) {
+				auto& input = inputs[instr.payload];
+				std::vector<int64_t> shape(input.dim(), 1);
+				shape.push_back(nseeds);
+				g = torch::zeros({ nseeds }, input.options());
+				g[seed] = 1;
+				g = g.view(shape);
+			}
+			continue;
+		}
+
+		if (instr.in.empty())
+			continue;
+
+		const torch::Tensor& out = slots[instr.out];
+		const torch::Tensor& a = slots[instr.in[0]];
+		const torch::Tensor& ga = grads[instr.in[0]];
+
+		if (instr.op == TapeOp::CUSTOM) {
+			// d f(x) = sum_j df/dx_j dx_j
+			for (int j = 0; j < instr.in.size(); ++j) {
+				const torch::Tensor& gj = grads[instr.in[j]];
+				if (gj.defined())
+					g = sum(g, torch::mul(gj, eval_custom(m_Customs[instr.payload], j, instr, slots).unsqueeze(-1)));
+			}
+			continue;
+		}
+
+		if (instr.op == TapeOp::CONCAT) {
+			// The gradient pieces are expanded like the value pieces and stacked along the dimension before the seeds,
+			// pieces that don't depend on a seed get zeros
+			std::int32_t npieces = instr.in.size() / 2;
+			bool any = false;
+			for (int j = 0; j < npieces; ++j) {
+				any = any || grads[instr.in[j]].defined();
+			}
+			if (!any)
+				continue;
+
+			auto sizes = concat_piece_sizes(instr, [&slots](std::int32_t slot) { return slots[slot].sizes().vec(); });
+			std::vector<torch::Tensor> pieces;
+			for (int j = 0; j < npieces; ++j) {
+				sizes[j].push_back(nseeds);
+				const torch::Tensor& gj = grads[instr.in[j]];
+				pieces.push_back(gj.defined() ? gj.expand(sizes[j]) : torch::zeros(sizes[j], out.options()));
+			}
+			g = torch::cat(pieces, -2);
+			continue;
+		}
+
+		if (instr.op == TapeOp::FMA) {
+			// d(a + b c) = da + c db + b dc
+			const torch::Tensor& gb = grads[instr.in[1]];
+			const torch::Tensor& gc = grads[instr.in[2]];
+			torch::Tensor bg, cg;
+			if (gb.defined())
+				bg = torch::mul(gb, ex(instr.in[2]));
+			if (gc.defined())
+				cg = torch::mul(gc, ex(instr.in[1]));
+			g = sum(ga, sum(bg, cg));
+			continue;
+		}
+
+		if (instr.in.size() == 2) {
+			const torch::Tensor& b = slots[instr.in[1]];
+			const torch::Tensor& gb = grads[instr.in[1]];
+			if (!ga.defined() && !gb.defined())
+				continue;
+
+			torch::Tensor lg, rg;
+			switch (instr.op) {
+			case TapeOp::ADD:
+				lg = ga;
+				rg = gb;
+				break;
+			case TapeOp::SUB:
+				lg = ga;
+				if (gb.defined())
+					rg = torch::neg(gb);
+				break;
+			case TapeOp::MUL:
+				if (ga.defined())
+					lg = torch::mul(ga, ex(instr.in[1]));
+				if (gb.defined())
+					rg = torch::mul(gb, ex(instr.in[0]));
+				break;
+			case TapeOp::DIV:
+				// d(a/b) = (da - (a/b) db) / b
+				if (ga.defined())
+					lg = torch::div(ga, ex(instr.in[1]));
+				if (gb.defined())
+					rg = torch::neg(torch::div(torch::mul(gb, ex(instr.out)), ex(instr.in[1])));
+				break;
+			case TapeOp::POW:
+				// d(a^b) = b a^(b-1) da + a^b log(a) db
+				if (ga.defined())
+					lg = torch::mul(ga, torch::mul(b, torch::pow(a, b - 1)).unsqueeze(-1));
+				if (gb.defined())
+					rg = torch::mul(gb, torch::mul(out, torch::log(a)).unsqueeze(-1));
+				break;
+			default:
+				throw std::runtime_error("unknown binary tape op");
+			}
+			g = sum(lg, rg);
+			continue;
+		}
+
+		if (!ga.defined())
+			continue;
+
+		if (instr.op == TapeOp::NEG) {
+			g = torch::neg(ga);
+			continue;
+		}
+
+		torch::Tensor d = unary_derivative(instr.op, a, out);
+		if (d.defined())
+			g = torch::mul(ga, d.unsqueeze(-1));
+	}
+}
+
+void tc::expression::Tape::eval_reverse(const std::vector<torch::Tensor>& slots, const std::vector<std::int32_t>& seeds, std::int32_t root_index,
+	const torch::Tensor& root_adjoint, std::vector<torch::Tensor>& adjoints, std::vector<torch::Tensor>& input_adjoints) const
+{
+	if (root_index < 0 || root_index >= m_Roots.size())
+		throw std::runtime_error("root_index must be in [0, number of tape roots)");
+
+	if (seeds.size() != m_InputNames.size())
+		throw std::runtime_error("number of seeds given to tape did not match number of tape inputs");
+
+	std::int32_t end = m_RootEnds[root_index];
+
+	// Only slots that depend on a seeded input need an adjoint
+	std::vector<bool> active(end, false);
+	for (int i = 0; i < end; ++i) {
+		auto& instr = m_Instructions[i];
+		if (instr.op == TapeOp::INPUT) {
+			active[instr.out] = seeds[instr.payload] >= 0;
+			continue;
+		}
+		for (auto in : instr.in) {
+			if (active[in]) {
+				active[instr.out] = true;
+				break;
+			}
+		}
+	}
+
+	if (adjoints.size() < m_Instructions.size())
+		adjoints.resize(m_Instructions.size());
+	for (int i = 0; i < end; ++i) {
+		adjoints[i] = torch::Tensor();
+	}
+
+	input_adjoints.assign(m_InputNames.size(), torch::Tensor());
+
+	std::int32_t root = m_Roots[root_index];
+	if (!active[root])
+		return;
+	adjoints[root] = root_adjoint;
+
+	// Adjoints are summed over the dimensions the value was broadcast along
+	auto accumulate = [&slots, &adjoints, &active](std::int32_t slot, const torch::Tensor& adj) {
+		if (!active[slot])
+			return;
+		auto& value = slots[slot];
+		torch::Tensor reduced = adj.sizes() == value.sizes() ? adj : adj.sum_to_size(value.sizes());
+		if (adjoints[slot].defined())
+			adjoints[slot] = torch::add(adjoints[slot], reduced);
+		else
+			adjoints[slot] = reduced;
+	};
+
+	for (int i = end - 1; i >= 0; --i) {
+		auto& instr = m_Instructions[i];
+		const torch::Tensor& adj = adjoints[instr.out];
+		if (!adj.defined())
+			continue;
+
+		if (instr.op == TapeOp::INPUT) {
+			if (input_adjoints[instr.payload].defined())
+				input_adjoints[instr.payload] = torch::add(input_adjoints[instr.payload], adj);
+			else
+				input_adjoints[instr.payload] = adj;
+			continue;
+		}
+
+		if (instr.in.empty())
+			continue;
+
+		const torch::Tensor& out = slots[instr.out];
+		const torch::Tensor& a = slots[instr.in[0]];
+
+		if (instr.op == TapeOp::CUSTOM) {
+			for (int j = 0; j < instr.in.size(); ++j) {
+				if (active[instr.in[j]])
+					accumulate(instr.in[j], torch::mul(adj, eval_custom(m_Customs[instr.payload], j, instr, slots)));
+			}
+			continue;
+		}
+
+		if (instr.op == TapeOp::CONCAT) {
+			// Every piece gets its columns of the adjoint, the shapes are only read for their sizes
+			auto sizes = concat_piece_sizes(instr, [&slots](std::int32_t slot) { return slots[slot].sizes().vec(); });
+			int64_t start = 0;
+			for (int j = 0; j < sizes.size(); ++j) {
+				int64_t width = sizes[j].back();
+				if (active[instr.in[j]])
+					accumulate(instr.in[j], adj.narrow(-1, start, width));
+				start += width;
+			}
+			continue;
+		}
+
+		if (instr.op == TapeOp::FMA) {
+			accumulate(instr.in[0], adj);
+			if (active[instr.in[1]])
+				accumulate(instr.in[1], torch::mul(adj, slots[instr.in[2]]));
+			if (active[instr.in[2]])
+				accumulate(instr.in[2], torch::mul(adj, slots[instr.in[1]]));
+			continue;
+		}
+
+		if (instr.in.size() == 2) {
+			const torch::Tensor& b = slots[instr.in[1]];
+			std::int32_t ain = instr.in[0];
+			std::int32_t bin = instr.in[1];
+			switch (instr.op) {
+			case TapeOp::ADD:
+				accumulate(ain, adj);
+				accumulate(bin, adj);
+				break;
+			case TapeOp::SUB:
+				accumulate(ain, adj);
+				if (active[bin])
+					accumulate(bin, torch::neg(adj));
+				break;
+			case TapeOp::MUL:
+				if (active[ain])
+					accumulate(ain, torch::mul(adj, b));
+				if (active[bin])
+					accumulate(bin, torch::mul(adj, a));
+				break;
+			case TapeOp::DIV:
+				if (active[ain])
+					accumulate(ain, torch::div(adj, b));
+				if (active[bin])
+					accumulate(bin, torch::neg(torch::div(torch::mul(adj, out), b)));
+				break;
+			case TapeOp::POW:
+				if (active[ain])
+					accumulate(ain, torch::mul(adj, torch::mul(b, torch::pow(a, b - 1))));
+				if (active[bin])
+					accumulate(bin, torch::mul(adj, torch::mul(out, torch::log(a))));
+				break;
+			default:
+				throw std::runtime_error("unknown binary tape op");
+			}
+			continue;
+		}
+
+		if (instr.op == TapeOp::NEG) {
+			accumulate(instr.in[0], torch::neg(adj));
+			continue;
+		}
+
+		torch::Tensor d = unary_derivative(instr.op, a, out);
+		if (d.defined())
+			accumulate(instr.in[0], torch::mul(adj, d));
+	}
+}
+
+void tc::expression::Tape::eval(const std::vector<torch::Tensor>& inputs, const TapeBufferPlan& plan, std::vector<torch::Tensor>& buffers,
+	std::vector<torch::Tensor>& slots, std::int32_t nroots, bool refresh) const
+{
+	if (nroots < 1 || nroots > m_Roots.size())
+		throw std::runtime_error("nroots must be in [1, number of tape roots]");
+
+	if (inputs.size() != m_InputNames.size())
+		throw std::runtime_error("number of inputs given to tape did not match number of tape inputs");
+
+	if (!plan_matches(plan, inputs))
+		throw std::runtime_error("buffer plan was not made for this tape and these input shapes");
+
+	if (buffers.size() != plan.buffer_keys.size())
+		throw std::runtime_error("buffers were not allocated for this plan");
+
+	if (slots.size() < m_Instructions.size())
+		slots.resize(m_Instructions.size());
+
+	auto& literals = literal_tensors(inputs);
+
+	if (refresh) {
+		for (auto& instr : m_Instructions) {
+			if (plan.hoisted[instr.out])
+				eval_instruction(instr, inputs, literals, slots);
+		}
+	}
+
+	std::int32_t end = m_RootEnds[nroots - 1];
+	if (plan.schedule.levels.empty()) {
+		for (int i = 0; i < end; ++i) {
+			eval_planned(m_Instructions[i], inputs, literals, plan, buffers, slots);
+		}
+		return;
+	}
+
+	// Inputs, literals and tensors first, then the levels in order. Every instruction of a level writes its own
+	// slot and buffer and only reads those of earlier levels, so a level can be split over the pool as it is
+	for (int i = 0; i < end; ++i) {
+		if (m_Instructions[i].in.empty())
+			eval_planned(m_Instructions[i], inputs, literals, plan, buffers, slots);
+	}
+
+	for (int l = 0; l < plan.schedule.levels.size(); ++l) {
+		auto& level = plan.schedule.levels[l];
+		int64_t count = std::lower_bound(level.begin(), level.end(), end) - level.begin();
+
+		auto run = [&](int64_t begin, int64_t stop) {
+			for (int64_t k = begin; k < stop; ++k) {
+				eval_planned(m_Instructions[level[k]], inputs, literals, plan, buffers, slots);
+			}
+		};
+
+		// Torch ops run single threaded inside the pool, so only the levels the cost model picked are split
+		if (plan.schedule.parallel[l] && count > 1)
+			at::parallel_for(0, count, 1, run);
+		else
+			run(0, count);
+	}
+}
+
+std::vector<tc::expression::TapeShapeKey> tc::expression::Tape::infer_shapes(const std::vector<torch::Tensor>& inputs) const
+{
+	if (inputs.size() != m_InputNames.size())
+		throw std::runtime_error("number of inputs given to tape did not match number of tape inputs");
+
+	std::vector<TapeShapeKey> keys(m_Instructions.size());
+	auto& literals = literal_tensors(inputs);
+
+	// Sizes follow the broadcasting rules, the dtype of an op is found by running it on empty
+	// tensors of the same dtype and dimension, so it follows the type promotion of torch exactly
+	std::vector<torch::Tensor> proxies(m_Instructions.size());
+	auto proxy = [](const torch::Tensor& t) {
+		if (!t.defined())
+			return torch::Tensor();
+		return torch::empty(std::vector<int64_t>(t.dim(), 0), t.options().device(torch::kCPU));
+	};
+
+	for (auto& instr : m_Instructions) {
+		switch (instr.op) {
+		case TapeOp::INPUT:
+			keys[instr.out] = shape_key(inputs[instr.payload]);
+			proxies[instr.out] = proxy(inputs[instr.payload]);
+			break;
+		case TapeOp::LITERAL:
+			keys[instr.out] = shape_key(literals[instr.payload]);
+			proxies[instr.out] = proxy(literals[instr.payload]);
+			break;
+		case TapeOp::TENSOR:
+			keys[instr.out] = shape_key(m_Tensors[instr.payload]);
+			proxies[instr.out] = proxy(m_Tensors[instr.payload]);
+			break;
+		default:
+		{
+			eval_instruction(instr, {}, literals, proxies);
+
+			TapeShapeKey key = keys[instr.in[0]];
+			for (int j = 1; j < instr.in.size(); ++j) {
+				auto& b = keys[instr.in[j]];
+				// 0-dim literals live on the cpu whatever device the other operands are on
+				bool a_literal = std::get<0>(key).empty() && std::get<2>(key) == static_cast<std::int32_t>(torch::kCPU);
+				if (a_literal) {
+					std::get<2>(key) = std::get<2>(b);
+					std::get<3>(key) = std::get<3>(b);
+				}
+				if (instr.op == TapeOp::CONCAT)
+					continue;
+				if (std::get<0>(key).empty())
+					std::get<0>(key) = std::get<0>(b);
+				else if (!std::get<0>(b).empty())
+					std::get<0>(key) = tc_broadcast_shapes(std::get<0>(key), std::get<0>(b));
+			}
+			if (instr.op == TapeOp::CONCAT) {
+				auto sizes = concat_piece_sizes(instr, [&keys](std::int32_t slot) { return std::get<0>(keys[slot]); });
+				std::vector<int64_t> concat_sizes = sizes[0];
+				for (int j = 1; j < sizes.size(); ++j) {
+					concat_sizes.back() += sizes[j].back();
+				}
+				std::get<0>(key) = std::move(concat_sizes);
+			}
+			std::get<1>(key) = static_cast<std::int32_t>(proxies[instr.out].scalar_type());
+			keys[instr.out] = std::move(key);
+		}
+		}
+	}
+
+	return keys;
+}
+
+tc::expression::TapeSchedule tc::expression::Tape::plan_schedule(const std::vector<torch::Tensor>& inputs) const
+{
+	return plan_schedule(infer_shapes(inputs));
+}
+
+tc::expression::TapeBufferPlan tc::expression::Tape::plan_buffers(const std::vector<torch::Tensor>& inputs, const std::vector<bool>& constant_inputs,
+	bool concurrent) const
+{
+	if (!constant_inputs.empty() && constant_inputs.size() != m_InputNames.size())
+		throw std::runtime_error("constant_inputs must be empty or have one entry per tape input");
+
+	auto keys = infer_shapes(inputs);
+
+	std::int32_t n = m_Instructions.size();
+
+	TapeBufferPlan plan;
+	plan.slot_buffers.assign(n, -1);
+	plan.hoisted.assign(n, false);
+	for (auto& input : inputs) {
+		plan.input_keys.push_back(shape_key(input));
+	}
+
+	// Literals, tensors and constant inputs never change between refreshes, nor does anything computed only from them
+	if (!constant_inputs.empty()) {
+		for (auto& instr : m_Instructions) {
+			switch (instr.op) {
+			case TapeOp::INPUT:
+				plan.hoisted[instr.out] = constant_inputs[instr.payload];
+				break;
+			case TapeOp::LITERAL:
+			case TapeOp::TENSOR:
+				plan.hoisted[instr.out] = true;
+				break;
+			default:
+				plan.hoisted[instr.out] = std::all_of(instr.in.begin(), instr.in.end(),
+					[&plan](std::int32_t in) { return plan.hoisted[in]; });
+			}
+		}
+	}
+
+	if (concurrent) {
+		auto schedule = plan_schedule(keys);
+		if (std::find(schedule.parallel.begin(), schedule.parallel.end(), true) != schedule.parallel.end())
+			plan.schedule = std::move(schedule);
+	}
+
+	// Sequentially every operation is a step of its own, concurrently every level is one step
+	std::vector<std::vector<std::int32_t>> steps;
+	if (plan.schedule.levels.empty()) {
+		for (int i = 0; i < n; ++i) {
+			if (!m_Instructions[i].in.empty())
+				steps.push_back({ i });
+		}
+	}
+	else {
+		steps = plan.schedule.levels;
+	}
+	bool sequential = plan.schedule.levels.empty();
+
+	std::vector<std::int32_t> last_use(n, -1);
+	for (int s = 0; s < steps.size(); ++s) {
+		for (auto i : steps[s]) {
+			for (auto in : m_Instructions[i].in) {
+				last_use[in] = s;
+			}
+		}
+	}
+	for (auto root : m_Roots) {
+		last_use[root] = steps.size();
+	}
+
+	std::map<TapeShapeKey, std::vector<std::int32_t>> free_buffers;
+	auto release = [&](std::int32_t s) {
+		for (auto i : steps[s]) {
+			for (auto in : m_Instructions[i].in) {
+				std::int32_t buffer = plan.slot_buffers[in];
+				if (last_use[in] == s && buffer != -1) {
+					free_buffers[plan.buffer_keys[buffer]].push_back(buffer);
+					last_use[in] = -1; // an operand repeated in the same step is only released once
+				}
+			}
+		}
+	};
+
+	for (int s = 0; s < steps.size(); ++s) {
+		// Sequentially operands are released before the output is placed, the elementwise kernels allow
+		// the output to be the very same tensor as one of the inputs. cat_out doesn't, so the operands of
+		// a concatenation are released after its output is placed
+		bool release_first = sequential && m_Instructions[steps[s][0]].op != TapeOp::CONCAT;
+		if (release_first)
+			release(s);
+
+		for (auto i : steps[s]) {
+			auto& instr = m_Instructions[i];
+			if (plan.hoisted[instr.out])
+				continue;
+
+			auto& key = keys[instr.out];
+			auto& candidates = free_buffers[key];
+			if (candidates.empty()) {
+				plan.slot_buffers[instr.out] = plan.buffer_keys.size();
+				plan.buffer_keys.push_back(key);
+			}
+			else {
+				plan.slot_buffers[instr.out] = candidates.back();
+				candidates.pop_back();
+			}
+		}
+
+		// The instructions of a level run at the same time, so what they read is only free for later levels
+		if (!release_first)
+			release(s);
+	}
+
+	return plan;
+}
+
+void tc::expression::Tape::allocate_buffers(const TapeBufferPlan& plan, std::vector<torch::Tensor>& buffers) const
+{
+	buffers.resize(plan.buffer_keys.size());
+	for (int i = 0; i < buffers.size(); ++i) {
+		auto& key = plan.buffer_keys[i];
+		torch::Device device(static_cast<c10::DeviceType>(std::get<2>(key)), static_cast<c10::DeviceIndex>(std::get<3>(key)));
+		buffers[i] = torch::empty(std::get<0>(key), torch::TensorOptions().dtype(static_cast<torch::ScalarType>(std::get<1>(key))).device(device));
+	}
+}
+
+bool tc::expression::Tape::plan_matches(const TapeBufferPlan& plan, const std::vector<torch::Tensor>& inputs) const
+{
+	if (plan.slot_buffers.size() != m_Instructions.size() || plan.input_keys.size() != inputs.size())
+		return false;
+
+	for (int i = 0; i < inputs.size(); ++i) {
+		if (!key_matches(plan.input_keys[i], inputs[i]))
+			return false;
+	}
+	return true;
+}
+
+bool tc::expression::Tape::is_real() const
+{
+	return m_IsReal;
+}
+
+bool tc::expression::Tape::is_elementwise() const
+{
+	return std::none_of(m_Instructions.begin(), m_Instructions.end(), [](const TapeInstruction& instr) {
+		return instr.op == TapeOp::CUSTOM || instr.op == TapeOp::CONCAT;
+	});
+}
+
+torch::ScalarType tc::expression::Tape::literal_dtype(const std::vector<torch::Tensor>& inputs)
+{
+	for (auto& input : inputs) {
+		if (input.defined() && (input.scalar_type() == torch::kDouble || input.scalar_type() == torch::kComplexDouble))
+			return torch::kDouble;
+	}
+	return torch::kFloat;
+}
+
+tc::expression::TapeSchedule tc::expression::Tape::plan_schedule(const std::vector<TapeShapeKey>& keys) const
+{
+	TapeSchedule schedule;
+
+	// Inputs, literals and tensors have depth -1, an operation sits one level below its deepest operand
+	std::vector<std::int32_t> depth(m_Instructions.size(), -1);
+	for (int i = 0; i < m_Instructions.size(); ++i) {
+		auto& instr = m_Instructions[i];
+		if (instr.in.empty())
+			continue;
+
+		std::int32_t d = 0;
+		for (auto in : instr.in) {
+			d = std::max(d, depth[in] + 1);
+		}
+		depth[instr.out] = d;
+
+		if (d >= schedule.levels.size())
+			schedule.levels.resize(d + 1);
+		schedule.levels[d].push_back(i);
+	}
+
+	// Costs are counted in elements. One by one, operations large enough for libtorch to split get every
+	// thread, concurrently each operation runs on a single thread and the level waits for its slowest one
+	int64_t nthreads = at::get_num_threads();
+	schedule.parallel.assign(schedule.levels.size(), false);
+	for (int l = 0; nthreads > 1 && l < schedule.levels.size(); ++l) {
+		auto& level = schedule.levels[l];
+		if (level.size() < 2)
+			continue;
+
+		bool cpu = true;
+		int64_t sequential_cost = 0;
+		int64_t total_cost = 0;
+		int64_t longest_cost = 0;
+		for (auto i : level) {
+			auto& key = keys[m_Instructions[i].out];
+			cpu = cpu && std::get<2>(key) == static_cast<std::int32_t>(torch::kCPU);
+
+			int64_t numel = 1;
+			for (auto size : std::get<0>(key)) {
+				numel *= size;
+			}
+
+			int64_t cost = SCHEDULE_OP_COST + numel;
+			sequential_cost += numel >= at::internal::GRAIN_SIZE ? SCHEDULE_OP_COST + numel / nthreads : cost;
+			total_cost += cost;
+			longest_cost = std::max(longest_cost, cost);
+		}
+
+		int64_t width = std::min<int64_t>(nthreads, level.size());
+		int64_t concurrent_cost = SCHEDULE_LEVEL_COST + std::max(longest_cost, total_cost / width);
+		schedule.parallel[l] = cpu && concurrent_cost < sequential_cost;
+	}
+
+	return schedule;
+}
+
+void tc::expression::Tape::eval_planned(const TapeInstruction& instr, const std::vector<torch::Tensor>& inputs, const std::vector<torch::Tensor>& literals,
+	const TapeBufferPlan& plan, std::vector<torch::Tensor>& buffers, std::vector<torch::Tensor>& slots) const
+{
+	if (plan.hoisted[instr.out])
+		return;
+
+	std::int32_t buffer = plan.slot_buffers[instr.out];
+	if (buffer == -1) {
+		eval_instruction(instr, inputs, literals, slots);
+		return;
+	}
+	slots[instr.out] = buffers[buffer];
+	eval_instruction(instr, inputs, literals, slots, true);
+}
+
+const std::vector<torch::Tensor>& tc::expression::Tape::literal_tensors(const std::vector<torch::Tensor>& inputs) const
+{
+	return literal_dtype(inputs) == torch::kDouble ? m_DoubleLiterals : m_FloatLiterals;
+}
+
+torch::Tensor tc::expression::Tape::eval() const
+{
+	std::vector<torch::Tensor> inputs;
+	fetch_inputs(inputs);
+	std::vector<torch::Tensor> slots;
+	eval(inputs, slots, 1);
+	return slots[m_Roots[0]];
+}
+
+std::int32_t tc::expression::Tape::root() const
+{
+	return m_Roots[0];
+}
+
+const std::vector<std::int32_t>& tc::expression::Tape::roots() const
+{
+	return m_Roots;
+}
+
+std::int32_t tc::expression::Tape::num_slots() const
+{
+	return m_Instructions.size();
+}
+
+const std::vector<tc::expression::TapeInstruction>& tc::expression::Tape::instructions() const
+{
+	return m_Instructions;
+}
+
+const std::vector<std::string>& tc::expression::Tape::input_names() const
+{
+	return m_InputNames;
+}
+
+const std::vector<tc::expression::TapeLiteral>& tc::expression::Tape::literals() const
+{
+	return m_Literals;
+}
+
+const std::vector<torch::Tensor>& tc::expression::Tape::tensors() const
+{
+	return m_Tensors;
+}
+
+const std::vector<tc::expression::TapeCustom>& tc::expression::Tape::customs() const
+{
+	return m_Customs;
+}
+
+std::int32_t tc::expression::Tape::root_end(std::int32_t index) const
+{
+	return m_RootEnds[index];
+}
+
+void tc::expression::Tape::save(std::ostream& out) const
+{
+	write_binary_header(out, "TCTP", TAPE_FORMAT_VERSION);
+
+	write_binary(out, m_InputNames);
+
+	write_binary<std::uint64_t>(out, m_Instructions.size());
+	for (auto& instr : m_Instructions) {
+		write_binary(out, instr.op);
+		write_binary(out, instr.out);
+		write_binary(out, instr.payload);
+		write_binary(out, instr.in);
+	}
+
+	write_binary<std::uint64_t>(out, m_Literals.size());
+	for (auto& lit : m_Literals) {
+		write_binary<double>(out, lit.num.real());
+		write_binary<double>(out, lit.num.imag());
+		write_binary<std::uint8_t>(out, lit.is_imaginary);
+	}
+
+	write_binary<std::uint64_t>(out, m_Tensors.size());
+	for (auto& tensor : m_Tensors) {
+		write_binary(out, tensor);
+	}
+
+	write_binary<std::uint64_t>(out, m_Customs.size());
+	for (auto& custom : m_Customs) {
+		write_binary(out, custom.function->name);
+		write_binary(out, custom.partials);
+	}
+
+	write_binary(out, m_Roots);
+	write_binary(out, m_RootEnds);
+
+	if (!out)
+		throw std::runtime_error("failed to write tape");
+}
+
+tc::expression::Tape tc::expression::Tape::load(std::istream& in)
+{
+	read_binary_header(in, "TCTP", TAPE_FORMAT_VERSION);
+
+	Tape tape;
+	tape.m_InputNames = read_binary_vector<std::string>(in);
+	tape.m_InputFetchers.resize(tape.m_InputNames.size());
+	tape.m_BoundInputs = true;
+
+	auto ninstr = read_binary_length(in);
+	for (std::uint64_t i = 0; i < ninstr; ++i) {
+		TapeInstruction instr;
+		instr.op = read_binary<std::int32_t>(in);
+		instr.out = read_binary<std::int32_t>(in);
+		instr.payload = read_binary<std::int32_t>(in);
+		instr.in = read_binary_vector<std::int32_t>(in);
+		tape.m_Instructions.push_back(std::move(instr));
+	}
+
+	auto nliterals = read_binary_length(in);
+	for (std::uint64_t i = 0; i < nliterals; ++i) {
+		double real = read_binary<double>(in);
+		double imag = read_binary<double>(in);
+		tape.add_literal(TapeLiteral{ std::complex<double>(real, imag), read_binary<std::uint8_t>(in) != 0 });
+	}
+
+	auto ntensors = read_binary_length(in);
+	for (std::uint64_t i = 0; i < ntensors; ++i) {
+		tape.m_Tensors.push_back(read_binary_tensor(in));
+		tape.m_IsReal = tape.m_IsReal && !tape.m_Tensors.back().is_complex();
+	}
+
+	auto ncustoms = read_binary_length(in);
+	for (std::uint64_t i = 0; i < ncustoms; ++i) {
+		auto function = CustomFunctionRegistry::instance().get(read_binary_string(in));
+		auto partials = read_binary_vector<std::int32_t>(in);
+		bool valid = partials.size() <= 2 && std::all_of(partials.begin(), partials.end(),
+			[&function](std::int32_t p) { return p >= 0 && p < function->n_inputs; });
+		if (!valid)
+			throw std::runtime_error("serialized tape has an invalid custom function derivative");
+		tape.m_Customs.push_back(TapeCustom{ std::move(function), std::move(partials) });
+	}
+
+	tape.m_Roots = read_binary_vector<std::int32_t>(in);
+	tape.m_RootEnds = read_binary_vector<std::int32_t>(in);
+
+	// Everything the evaluation indexes with is checked once here instead of on every evaluation
+	auto payload_count = [&tape](std::int32_t op) -> std::int64_t {
+		switch (op) {
+		case TapeOp::INPUT: return tape.m_InputNames.size();
+		case TapeOp::LITERAL: return tape.m_Literals.size();
+		case TapeOp::TENSOR: return tape.m_Tensors.size();
+		case TapeOp::CUSTOM: return tape.m_Customs.size();
+		default: return -1;
+		}
+	};
+	for (std::int32_t i = 0; i < tape.m_Instructions.size(); ++i) {
+		auto& instr = tape.m_Instructions[i];
+		if (instr.op < TapeOp::INPUT || instr.op > TapeOp::CONCAT || instr.out != i)
+			throw std::runtime_error("serialized tape has an invalid instruction");
+		std::int64_t npayload = payload_count(instr.op);
+		bool valid_arity;
+		switch (instr.op) {
+		case TapeOp::ADD:
+		case TapeOp::SUB:
+		case TapeOp::MUL:
+		case TapeOp::DIV:
+		case TapeOp::POW:
+			valid_arity = instr.in.size() == 2;
+			break;
+		case TapeOp::FMA:
+			valid_arity = instr.in.size() == 3;
+			break;
+		case TapeOp::CONCAT:
+			valid_arity = instr.in.size() >= 2 && instr.in.size() % 2 == 0;
+			break;
+		default:
+			// NEG, the unary, trig and fused unary ops, payload ops are checked below
+			valid_arity = instr.in.size() == 1;
+		}
+		bool valid = npayload == -1 ? valid_arity : (instr.in.empty() && instr.payload >= 0 && instr.payload < npayload);
+		if (instr.op == TapeOp::CUSTOM) {
+			valid = instr.payload >= 0 && instr.payload < npayload &&
+				instr.in.size() == tape.m_Customs[instr.payload].function->n_inputs;
+		}
+		for (auto in : instr.in) {
+			valid = valid && in >= 0 && in < i;
+		}
+		if (!valid)
+			throw std::runtime_error("serialized tape has an invalid instruction");
+	}
+	if (tape.m_Roots.empty() || tape.m_Roots.size() != tape.m_RootEnds.size())
+		throw std::runtime_error("serialized tape has invalid roots");
+	for (int i = 0; i < tape.m_Roots.size(); ++i) {
+		if (tape.m_RootEnds[i] < 0 || tape.m_RootEnds[i] > tape.m_Instructions.size() || tape.m_Roots[i] < 0 || tape.m_Roots[i] >= tape.m_RootEnds[i])
+			throw std::runtime_error("serialized tape has invalid roots");
+	}
+
+	return tape;
+}
+
+void tc::expression::Tape::eval_instruction(const TapeInstruction& instr, const std::vector<torch::Tensor>& inputs, const std::vector<torch::Tensor>& literals,
+	std::vector<torch::Tensor>& slots, bool presized) const
+{
+	torch::Tensor& out = slots[instr.out];
+
+	// Operation slots are only ever written by their own instruction, so the tensor left there by the
+	// previous evaluation can be written into directly as long as the result shape hasn't changed.
+	// Concatenations don't broadcast their operands and only decide on presized
+	bool reuse = presized;
+	if (!presized && instr.op != TapeOp::CONCAT) {
+		if (instr.in.size() == 1)
+			reuse = out_fits(out, slots[instr.in[0]]);
+		else if (instr.in.size() == 2)
+			reuse = out_fits(out, slots[instr.in[0]], slots[instr.in[1]]);
+		else if (instr.in.size() == 3)
+			reuse = out_fits(out, slots[instr.in[1]], slots[instr.in[2]]) && out_fits(out, out, slots[instr.in[0]]);
+	}
+
+	switch (instr.op) {
+	case TapeOp::INPUT:
+		out = inputs[instr.payload];
+		break;
+	case TapeOp::LITERAL:
+		out = literals[instr.payload];
+		break;
+	case TapeOp::TENSOR:
+		out = m_Tensors[instr.payload];
+		break;
+	// Operators
+	case TapeOp::NEG:
+		if (reuse)
+			torch::neg_out(out, slots[instr.in[0]]);
+		else
+			out = torch::neg(slots[instr.in[0]]);
+		break;
+	case TapeOp::ADD:
+		if (reuse)
+			torch::add_out(out, slots[instr.in[0]], slots[instr.in[1]]);
+		else
+			out = torch::add(slots[instr.in[0]], slots[instr.in[1]]);
+		break;
+	case TapeOp::SUB:
+		if (reuse)
+			torch::sub_out(out, slots[instr.in[0]], slots[instr.in[1]]);
+		else
+			out = torch::sub(slots[instr.in[0]], slots[instr.in[1]]);
+		break;
+	case TapeOp::MUL:
+		if (reuse)
+			torch::mul_out(out, slots[instr.in[0]], slots[instr.in[1]]);
+		else
+			out = torch::mul(slots[instr.in[0]], slots[instr.in[1]]);
+		break;
+	case TapeOp::DIV:
+		if (reuse)
+			torch::div_out(out, slots[instr.in[0]], slots[instr.in[1]]);
+		else
+			out = torch::div(slots[instr.in[0]], slots[instr.in[1]]);
+		break;
+	case TapeOp::POW:
+		if (reuse)
+			torch::pow_out(out, slots[instr.in[0]], slots[instr.in[1]]);
+		else
+			out = torch::pow(slots[instr.in[0]], slots[instr.in[1]]);
+		break;
+	// Unary
+	case TapeOp::SGN:
+		if (reuse)
+			torch::sgn_out(out, slots[instr.in[0]]);
+		else
+			out = torch::sgn(slots[instr.in[0]]);
+		break;
+	case TapeOp::ABS:
+		if (reuse)
+			torch::abs_out(out, slots[instr.in[0]]);
+		else
+			out = torch::abs(slots[instr.in[0]]);
+		break;
+	case TapeOp::SQRT:
+		if (reuse)
+			torch::sqrt_out(out, slots[instr.in[0]]);
+		else
+			out = torch::sqrt(slots[instr.in[0]]);
+		break;
+	case TapeOp::SQUARE:
+		if (reuse)
+			torch::pow_out(out, slots[instr.in[0]], 2);
+		else
+			out = torch::square(slots[instr.in[0]]);
+		break;
+	case TapeOp::EXP:
+		if (reuse)
+			torch::exp_out(out, slots[instr.in[0]]);
+		else
+			out = torch::exp(slots[instr.in[0]]);
+		break;
+	case TapeOp::LOG:
+		if (reuse)
+			torch::log_out(out, slots[instr.in[0]]);
+		else
+			out = torch::log(slots[instr.in[0]]);
+		break;
+	// Trig
+	case TapeOp::SIN:
+		if (reuse)
+			torch::sin_out(out, slots[instr.in[0]]);
+		else
+			out = torch::sin(slots[instr.in[0]]);
+		break;
+	case TapeOp::COS:
+		if (reuse)
+			torch::cos_out(out, slots[instr.in[0]]);
+		else
+			out = torch::cos(slots[instr.in[0]]);
+		break;
+	case TapeOp::TAN:
+		if (reuse)
+			torch::tan_out(out, slots[instr.in[0]]);
+		else
+			out = torch::tan(slots[instr.in[0]]);
+		break;
+	case TapeOp::ASIN:
+		if (reuse)
+			torch::asin_out(out, slots[instr.in[0]]);
+		else
+			out = torch::asin(slots[instr.in[0]]);
+		break;
+	case TapeOp::ACOS:
+		if (reuse)
+			torch::acos_out(out, slots[instr.in[0]]);
+		else
+			out = torch::acos(slots[instr.in[0]]);
+		break;
+	case TapeOp::ATAN:
+		if (reuse)
+			torch::atan_out(out, slots[instr.in[0]]);
+		else
+			out = torch::atan(slots[instr.in[0]]);
+		break;
+	case TapeOp::SINH:
+		if (reuse)
+			torch::sinh_out(out, slots[instr.in[0]]);
+		else
+			out = torch::sinh(slots[instr.in[0]]);
+		break;
+	case TapeOp::COSH:
+		if (reuse)
+			torch::cosh_out(out, slots[instr.in[0]]);
+		else
+			out = torch::cosh(slots[instr.in[0]]);
+		break;
+	case TapeOp::TANH:
+		if (reuse)
+			torch::tanh_out(out, slots[instr.in[0]]);
+		else
+			out = torch::tanh(slots[instr.in[0]]);
+		break;
+	case TapeOp::ASINH:
+		if (reuse)
+			torch::asinh_out(out, slots[instr.in[0]]);
+		else
+			out = torch::asinh(slots[instr.in[0]]);
+		break;
+	case TapeOp::ACOSH:
+		if (reuse)
+			torch::acosh_out(out, slots[instr.in[0]]);
+		else
+			out = torch::acosh(slots[instr.in[0]]);
+		break;
+	case TapeOp::ATANH:
+		if (reuse)
+			torch::atanh_out(out, slots[instr.in[0]]);
+		else
+			out = torch::atanh(slots[instr.in[0]]);
+		break;
+	// Fused
+	case TapeOp::EXPM1:
+		if (reuse)
+			torch::expm1_out(out, slots[instr.in[0]]);
+		else
+			out = torch::expm1(slots[instr.in[0]]);
+		break;
+	case TapeOp::LOG1P:
+		if (reuse)
+			torch::log1p_out(out, slots[instr.in[0]]);
+		else
+			out = torch::log1p(slots[instr.in[0]]);
+		break;
+	case TapeOp::FMA:
+		if (reuse)
+			torch::addcmul_out(out, slots[instr.in[0]], slots[instr.in[1]], slots[instr.in[2]]);
+		else
+			out = torch::addcmul(slots[instr.in[0]], slots[instr.in[1]], slots[instr.in[2]]);
+		break;
+	// Custom
+	case TapeOp::CUSTOM:
+	{
+		// Kernels return a tensor of their own, only planned buffers get a copy of it
+		auto result = eval_custom(m_Customs[instr.payload], -1, instr, slots);
+		if (presized)
+			out.copy_(result);
+		else
+			out = std::move(result);
+	}
+	break;
+	// Outputs
+	case TapeOp::CONCAT:
+	{
+		std::int32_t npieces = instr.in.size() / 2;
+		std::vector<torch::Tensor> pieces;
+		std::vector<torch::Tensor> shapes;
+		for (int j = 0; j < npieces; ++j) {
+			pieces.push_back(slots[instr.in[j]]);
+			shapes.push_back(slots[instr.in[npieces + j]]);
+		}
+		// Only planned buffers are known to have the concatenated size
+		if (presized)
+			torch::cat_out(out, expand_pieces(pieces, shapes), -1);
+		else
+			out = torch::cat(expand_pieces(pieces, shapes), -1);
+	}
+	break;
+	default:
+		throw std::runtime_error("unknown tape op");
+	}
+}
+
+void tc::expression::Tape::lower_roots(const std::vector<tc::refw<const Node>>& roots)
+{
+	m_Roots.reserve(roots.size());
+	m_RootEnds.reserve(roots.size());
+	for (auto& root : roots) {
+		m_Roots.push_back(lower(root.get()));
+		m_RootEnds.push_back(m_Instructions.size());
+	}
+	m_Emitted.clear();
+	m_Lowered.clear();
+}
+
+std::int32_t tc::expression::Tape::lower(const Node& node)
+{
+	auto it = m_Lowered.find(&node);
+	if (it != m_Lowered.end())
+		return it->second;
+
+	auto slot = lower_node(node);
+	m_Lowered.emplace(&node, slot);
+	return slot;
+}
+
+std::int32_t tc::expression::Tape::lower_node(const Node& node)
+{
+	auto child = [this, &node](int i) {
+		return lower(*node.m_Children[i]);
+	};
+
+	switch (node.get_node_type()) {
+	case NodeType::EXPRESSION_NODE:
+		return child(0);
+	case NodeType::TOKEN_NODE:
+		// The sizes of token fetchers are only needed by the token algebra, on the tape
+		// literals are 0-dim tensors and are broadcasted by the consuming op
+	case NodeType::TOKEN_FETCHER_NODE:
+		return emit_literal(*node.m_pToken);
+	case NodeType::TENSOR_NODE:
+		return emit_tensor(static_cast<const TensorNode&>(node).get_tensor());
+	case NodeType::VARIABLE_NODE:
+	{
+		auto& vnode = static_cast<const VariableNode&>(node);
+		return emit_input(vnode.get_variable_token().name, vnode.get_fetcher());
+	}
+	// Operators
+	case NodeType::NEG_NODE:
+		return emit(TapeOp::NEG, { child(0) });
+	case NodeType::MUL_NODE:
+		return emit(TapeOp::MUL, { child(0), child(1) });
+	case NodeType::DIV_NODE:
+		return emit(TapeOp::DIV, { child(0), child(1) });
+	case NodeType::ADD_NODE:
+		return emit(TapeOp::ADD, { child(0), child(1) });
+	case NodeType::SUB_NODE:
+		return emit(TapeOp::SUB, { child(0), child(1) });
+	case NodeType::POW_NODE:
+		return emit(TapeOp::POW, { child(0), child(1) });
+	// Unary
+	case NodeType::SGN_NODE:
+		return emit(TapeOp::SGN, { child(0) });
+	case NodeType::ABS_NODE:
+		return emit(TapeOp::ABS, { child(0) });
+	case NodeType::SQRT_NODE:
+		return emit(TapeOp::SQRT, { child(0) });
+	case NodeType::SQUARE_NODE:
+		return emit(TapeOp::SQUARE, { child(0) });
+	case NodeType::EXP_NODE:
+		return emit(TapeOp::EXP, { child(0) });
+	case NodeType::LOG_NODE:
+		return emit(TapeOp::LOG, { child(0) });
+	// Trig
+	case NodeType::SIN_NODE:
+		return emit(TapeOp::SIN, { child(0) });
+	case NodeType::COS_NODE:
+		return emit(TapeOp::COS, { child(0) });
+	case NodeType::TAN_NODE:
+		return emit(TapeOp::TAN, { child(0) });
+	case NodeType::ASIN_NODE:
+		return emit(TapeOp::ASIN, { child(0) });
+	case NodeType::ACOS_NODE:
+		return emit(TapeOp::ACOS, { child(0) });
+	case NodeType::ATAN_NODE:
+		return emit(TapeOp::ATAN, { child(0) });
+	case NodeType::SINH_NODE:
+		return emit(TapeOp::SINH, { child(0) });
+	case NodeType::COSH_NODE:
+		return emit(TapeOp::COSH, { child(0) });
+	case NodeType::TANH_NODE:
+		return emit(TapeOp::TANH, { child(0) });
+	case NodeType::ASINH_NODE:
+		return emit(TapeOp::ASINH, { child(0) });
+	case NodeType::ACOSH_NODE:
+		return emit(TapeOp::ACOSH, { child(0) });
+	case NodeType::ATANH_NODE:
+		return emit(TapeOp::ATANH, { child(0) });
+	// Fused
+	case NodeType::EXPM1_NODE:
+		return emit(TapeOp::EXPM1, { child(0) });
+	case NodeType::LOG1P_NODE:
+		return emit(TapeOp::LOG1P, { child(0) });
+	case NodeType::FMA_NODE:
+		return emit(TapeOp::FMA, { child(2), child(0), child(1) });
+	// Custom
+	case NodeType::CUSTOM_NODE:
+	{
+		std::vector<std::int32_t> in;
+		for (int i = 0; i < node.m_Children.size(); ++i) {
+			in.push_back(child(i));
+		}
+		return emit_custom(static_cast<const CustomNode&>(node), std::move(in));
+	}
+	// Outputs
+	case NodeType::CONCAT_NODE:
+	{
+		std::vector<std::int32_t> in;
+		for (int i = 0; i < node.m_Children.size(); ++i) {
+			in.push_back(child(i));
+		}
+		return emit(TapeOp::CONCAT, std::move(in));
+	}
+	default:
+		throw std::runtime_error("node type can't be lowered to tape");
+	}
+}
+
+std::int32_t tc::expression::Tape::emit(std::int32_t op, std::vector<std::int32_t> in, std::int32_t payload)
+{
+	// Operand order of commutative ops doesn't matter for equality
+	auto key_in = in;
+	if (op == TapeOp::ADD || op == TapeOp::MUL)
+		std::sort(key_in.begin(), key_in.end());
+	else if (op == TapeOp::FMA)
+		std::sort(key_in.begin() + 1, key_in.end());
+
+	auto key = std::make_tuple(op, std::move(key_in), payload);
+	auto it = m_Emitted.find(key);
+	if (it != m_Emitted.end())
+		return it->second;
+
+	std::int32_t out = m_Instructions.size();
+	m_Instructions.push_back(TapeInstruction{ op, out, std::move(in), payload });
+	m_Emitted.emplace(std::move(key), out);
+	return out;
+}
+
+std::int32_t tc::expression::Tape::emit_literal(const NumberBaseToken& tok)
+{
+	TapeLiteral lit{ std::complex<double>(0.0, 0.0), false };
+
+	switch (tok.get_token_type()) {
+	case TokenType::ZERO_TYPE:
+		break;
+	case TokenType::UNITY_TYPE:
+		lit.num = 1.0f;
+		break;
+	case TokenType::NEG_UNITY_TYPE:
+		lit.num = -1.0f;
+		break;
+	case TokenType::NAN_TYPE:
+		lit.num = std::numeric_limits<float>::quiet_NaN();
+		break;
+	case TokenType::NUMBER_TYPE:
+	{
+		auto& numtok = static_cast<const NumberToken&>(tok);
+		lit.num = std::complex<double>(numtok.num.real(), numtok.num.imag());
+		lit.is_imaginary = numtok.is_imaginary;
+		// Lexed numbers keep their text, parsing it again gives the constant in full double precision.
+		// Names that don't round to the stored number, like the 6 decimals of folded constants, are not used
+		if (!numtok.is_imaginary && !numtok.name.empty()) {
+			char* end;
+			double parsed = std::strtod(numtok.name.c_str(), &end);
+			if (*end == '\0' && static_cast<float>(parsed) == numtok.num.real())
+				lit.num = parsed;
+		}
+	}
+	break;
+	default:
+		throw std::runtime_error("Expected Zero, Unity, NegUnity, Nan and Number");
+	}
+
+	auto same_literal = [&lit](const TapeLiteral& other) {
+		if (lit.is_imaginary != other.is_imaginary)
+			return false;
+		if (std::isnan(lit.num.real()) || std::isnan(other.num.real()))
+			return std::isnan(lit.num.real()) && std::isnan(other.num.real());
+		return lit.num == other.num;
+	};
+	auto it = std::find_if(m_Literals.begin(), m_Literals.end(), same_literal);
+	if (it != m_Literals.end())
+		return emit(TapeOp::LITERAL, {}, std::distance(m_Literals.begin(), it));
+
+	add_literal(lit);
+
+	return emit(TapeOp::LITERAL, {}, m_Literals.size() - 1);
+}
+
+void tc::expression::Tape::add_literal(const TapeLiteral& lit)
+{
+	m_Literals.push_back(lit);
+	m_FloatLiterals.push_back(literal_tensor(lit, torch::kFloat));
+	m_DoubleLiterals.push_back(literal_tensor(lit, torch::kDouble));
+	m_IsReal = m_IsReal && !(lit.is_imaginary && lit.num.imag() != 0.0);
+}
+
+torch::Tensor tc::expression::Tape::literal_tensor(const TapeLiteral& lit, torch::ScalarType dtype)
+{
+	if (lit.is_imaginary && lit.num.imag() != 0.0) {
+		return torch::scalar_tensor(c10::complex<double>(lit.num.real(), lit.num.imag()),
+			torch::TensorOptions().dtype(dtype == torch::kDouble ? torch::kComplexDouble : torch::kComplexFloat));
+	}
+	return torch::scalar_tensor(lit.num.real(), torch::TensorOptions().dtype(dtype));
+}
+
+std::int32_t tc::expression::Tape::emit_tensor(const torch::Tensor& tensor)
+{
+	auto it = std::find_if(m_Tensors.begin(), m_Tensors.end(), [&tensor](const torch::Tensor& other) {
+		return other.is_same(tensor);
+	});
+	if (it != m_Tensors.end())
+		return emit(TapeOp::TENSOR, {}, std::distance(m_Tensors.begin(), it));
+
+	m_Tensors.push_back(tensor);
+	m_IsReal = m_IsReal && !tensor.is_complex();
+	return emit(TapeOp::TENSOR, {}, m_Tensors.size() - 1);
+}
+
+std::int32_t tc::expression::Tape::emit_input(const std::string& name, const FetcherFuncRef& fetcher)
+{
+	std::int32_t index;
+	auto it = std::find(m_InputNames.begin(), m_InputNames.end(), name);
+	if (it != m_InputNames.end()) {
+		index = std::distance(m_InputNames.begin(), it);
+		if (!m_InputFetchers[index].has_value())
+			m_InputFetchers[index] = fetcher;
+	}
+	else if (m_BoundInputs) {
+		throw std::runtime_error("variable " + name + " was not among the bound tape inputs");
+	}
+	else {
+		index = m_InputNames.size();
+		m_InputNames.push_back(name);
+		m_InputFetchers.push_back(fetcher);
+	}
+	return emit(TapeOp::INPUT, {}, index);
+}
+
+std::int32_t tc::expression::Tape::emit_custom(const CustomNode& node, std::vector<std::int32_t> in)
+{
+	// Calls of the same function and derivative share one payload, so they are also common subexpressions
+	auto same_custom = [&node](const TapeCustom& custom) {
+		return custom.function == node.get_function() && custom.partials == node.get_partials();
+	};
+	auto it = std::find_if(m_Customs.begin(), m_Customs.end(), same_custom);
+	if (it != m_Customs.end())
+		return emit(TapeOp::CUSTOM, std::move(in), std::distance(m_Customs.begin(), it));
+
+	m_Customs.push_back(TapeCustom{ node.get_function(), node.get_partials() });
+	return emit(TapeOp::CUSTOM, std::move(in), m_Customs.size() - 1);
+}
@@ -0,0 +1,279 @@
+#pragma once
+
+#include "../../pch.hpp"
+
+#include <algorithm>
+#include <map>
+#include <tuple>
+
+#include "../nodes.hpp"
+
+namespace tc {
+	namespace expression {
+
+		struct TapeOp {
+			enum {
+				INPUT,
+				LITERAL,
+				TENSOR,
+				// Operators
+				NEG,
+				ADD,
+				SUB,
+				MUL,
+				DIV,
+				POW,
+				// Unary
+				SGN,
+				ABS,
+				SQRT,
+				SQUARE,
+				EXP,
+				LOG,
+				// Trig
+				SIN,
+				COS,
+				TAN,
+				ASIN,
+				ACOS,
+				ATAN,
+				SINH,
+				COSH,
+				TANH,
+				ASINH,
+				ACOSH,
+				ATANH,
+				// Fused
+				EXPM1,
+				LOG1P,
+				FMA, // in[0] + in[1] * in[2], the operand order of addcmul
+				// Custom
+				CUSTOM, // payload indexes the custom functions of the tape
+				// Outputs
+				CONCAT, // the pieces then their shapes, see ConcatNode
+			};
+		};
+
+		struct TapeInstruction {
+			std::int32_t op;
+			std::int32_t out;
+			std::vector<std::int32_t> in;
+			std::int32_t payload = -1; // index into inputs, literals, tensors or custom functions depending on op
+		};
+
+		// A registered custom function, or one of its partial derivatives, as called by a CUSTOM instruction.
+		// Saved tapes refer to the function by name
+		struct TapeCustom {
+			std::shared_ptr<const CustomFunction> function;
+			std::vector<std::int32_t> partials;
+		};
+
+		// Literals keep double precision so that double models get their constants exactly
+		struct TapeLiteral {
+			std::complex<double> num;
+			bool is_imaginary;
+		};
+
+		// Bumped whenever the binary tape format changes, older streams are rejected
+		constexpr std::uint32_t TAPE_FORMAT_VERSION = 3;
+
+		// Sizes, dtype, device type and device index of a slot value
+		using TapeShapeKey = std::tuple<std::vector<std::int64_t>, std::int32_t, std::int32_t, std::int32_t>;
+
+		// Operation instructions grouped by their depth in the tape. An instruction only reads inputs, literals,
+		// tensors and slots of earlier levels, so the instructions of one level are independent of each other
+		struct TapeSchedule {
+			std::vector<std::vector<std::int32_t>> levels; // instruction indices, ascending within a level
+			std::vector<bool> parallel; // levels the cost model found worth running concurrently
+		};
+
+		// Assignment of the operation slots of a tape to reusable buffers. Slots share a buffer if their live
+		// ranges don't overlap and their values have the same shape key, roots stay live to the end of the tape
+		struct TapeBufferPlan {
+			std::vector<std::int32_t> slot_buffers; // -1 for inputs, literals and tensors
+			std::vector<TapeShapeKey> buffer_keys;
+			std::vector<TapeShapeKey> input_keys; // the input shapes the plan was made for
+			std::vector<bool> hoisted; // slots that only depend on constant inputs, only evaluated on refresh
+			TapeSchedule schedule; // the levels the buffers were planned for, empty for sequential evaluation
+		};
+
+		// One or more Node trees lowered to a flat list of instructions in evaluation order,
+		// every instruction writes its result to its own slot. Structurally equal subtrees,
+		// also across different roots, are only emitted once.
+		class Tape {
+		public:
+
+			Tape() = default;
+
+			Tape(const Node& root);
+
+			// Roots are lowered in order, so the instructions needed by the first n roots
+			// always form a prefix of the tape
+			Tape(const std::vector<tc::refw<const Node>>& roots);
+
+			// Binds the inputs to the given names in order, so input i of the tape is always input_names[i]
+			// whether or not the trees reference it. Variables not among input_names are an error.
+			Tape(const std::vector<tc::refw<const Node>>& roots, const std::vector<std::string>& input_names);
+
+			// Calls the fetchers of all variables the tape reads, in input order. Bound inputs that aren't
+			// referenced by the tape have no fetcher and are left undefined
+			void fetch_inputs(std::vector<torch::Tensor>& inputs) const;
+
+			// Operation slots that already hold a tensor of the right shape are written in place with the *_out
+			// kernels, so repeated evaluations don't allocate. A slot vector must therefore only be used with one tape,
+			// and results that have to outlive the next evaluation must be copied out of it
+			void eval(const std::vector<torch::Tensor>& inputs, std::vector<torch::Tensor>& slots) const;
+
+			// Only runs the instruction prefix needed by the first nroots roots
+			void eval(const std::vector<torch::Tensor>& inputs, std::vector<torch::Tensor>& slots, std::int32_t nroots) const;
+
+			// Forward mode differentiation, evaluates the values and along with them the gradient of every slot
+			// with respect to the seeded inputs. Input i is seeded with gradient entry seeds[i], or is
+			// constant if seeds[i] is -1. The gradient of a slot has the shape of its value with an extra
+			// trailing dimension of size nseeds and is left undefined if it doesn't depend on any seeded input
+			void eval_forward(const std::vector<torch::Tensor>& inputs, const std::vector<std::int32_t>& seeds, std::int32_t nseeds,
+				std::vector<torch::Tensor>& slots, std::vector<torch::Tensor>& grads, std::int32_t nroots) const;
+
+			// Reverse mode differentiation of root root_index, which must already have been evaluated into slots.
+			// Given the adjoint of the root value, every input with seeds[i] != -1 gets its adjoint in input_adjoints[i]
+			// summed down to the shape of the input, or undefined if the root doesn't depend on it
+			void eval_reverse(const std::vector<torch::Tensor>& slots, const std::vector<std::int32_t>& seeds, std::int32_t root_index,
+				const torch::Tensor& root_adjoint, std::vector<torch::Tensor>& adjoints, std::vector<torch::Tensor>& input_adjoints) const;
+
+			// Evaluates with every operation slot backed by its planned buffer, the inputs must match the plan and
+			// the buffers must come from allocate_buffers. Results are written straight into the buffers without
+			// any shape checks. Afterwards only the root slots are guaranteed to hold their values, other slots may
+			// have been overwritten by later instructions, so this can't be used ahead of eval_reverse.
+			// Hoisted slots keep their values between calls and are only evaluated, over the whole tape, when
+			// refresh is set, which it must be on the first call with a slot vector and whenever a constant changed.
+			// If the plan has a schedule, its parallel levels are spread over the intra-op thread pool
+			void eval(const std::vector<torch::Tensor>& inputs, const TapeBufferPlan& plan, std::vector<torch::Tensor>& buffers,
+				std::vector<torch::Tensor>& slots, std::int32_t nroots, bool refresh) const;
+
+			// Shape key of every slot given the shapes of the inputs, resolved once without evaluating the tape
+			std::vector<TapeShapeKey> infer_shapes(const std::vector<torch::Tensor>& inputs) const;
+
+			// Levels of the tape, and for each whether running its instructions concurrently on the intra-op
+			// thread pool is estimated to beat running them one by one, each with intra-op threading of its own
+			TapeSchedule plan_schedule(const std::vector<torch::Tensor>& inputs) const;
+
+			// Plans the buffers for inputs of these shapes. Slots that only depend on the inputs marked in
+			// constant_inputs, or on no inputs at all, are hoisted and get no buffer. With concurrent the tape is
+			// also scheduled, and if any level is worth running in parallel the plan keeps the schedule and no
+			// two instructions of a level share a buffer
+			TapeBufferPlan plan_buffers(const std::vector<torch::Tensor>& inputs, const std::vector<bool>& constant_inputs = {},
+				bool concurrent = false) const;
+
+			// Allocates every buffer of the plan with its final shape
+			void allocate_buffers(const TapeBufferPlan& plan, std::vector<torch::Tensor>& buffers) const;
+
+			// True if the plan was made for this tape and inputs of these shapes
+			bool plan_matches(const TapeBufferPlan& plan, const std::vector<torch::Tensor>& inputs) const;
+
+			torch::Tensor eval() const;
+
+			// True if no literal has an imaginary part and no tensor is complex, decided when the tape is built.
+			// Literals of real tapes are plain real tensors, so evaluation never touches complex numbers
+			bool is_real() const;
+
+			// True if every op of the tape broadcasts its operands elementwise, so it neither calls custom
+			// functions nor concatenates outputs
+			bool is_elementwise() const;
+
+			// Literals are materialized in double precision if any input is double, otherwise in float,
+			// so they never promote or down cast the values they are combined with
+			static torch::ScalarType literal_dtype(const std::vector<torch::Tensor>& inputs);
+
+			// dtype is kFloat or kDouble, literals with an imaginary part get the matching complex dtype
+			static torch::Tensor literal_tensor(const TapeLiteral& lit, torch::ScalarType dtype);
+
+			std::int32_t root() const;
+
+			const std::vector<std::int32_t>& roots() const;
+
+			std::int32_t num_slots() const;
+
+			const std::vector<TapeInstruction>& instructions() const;
+
+			const std::vector<std::string>& input_names() const;
+
+			const std::vector<TapeLiteral>& literals() const;
+
+			const std::vector<torch::Tensor>& tensors() const;
+
+			const std::vector<TapeCustom>& customs() const;
+
+			// Number of instructions needed to evaluate roots [0, index]
+			std::int32_t root_end(std::int32_t index) const;
+
+			// Writes the instructions, literals, tensors, roots and input names in the binary tape format
+			void save(std::ostream& out) const;
+
+			// Reads a tape written by save. The loaded tape has no fetchers, so its inputs are always passed explicitly.
+			// Custom functions are looked up by name and must be registered before loading
+			static Tape load(std::istream& in);
+
+		private:
+
+			// With presized the output slot is known to already hold a tensor of the result shape
+			void eval_instruction(const TapeInstruction& instr, const std::vector<torch::Tensor>& inputs, const std::vector<torch::Tensor>& literals,
+				std::vector<torch::Tensor>& slots, bool presized = false) const;
+
+			TapeSchedule plan_schedule(const std::vector<TapeShapeKey>& keys) const;
+
+			// Points the slot of an operation at its planned buffer, if it has one, and evaluates it
+			void eval_planned(const TapeInstruction& instr, const std::vector<torch::Tensor>& inputs, const std::vector<torch::Tensor>& literals,
+				const TapeBufferPlan& plan, std::vector<torch::Tensor>& buffers, std::vector<torch::Tensor>& slots) const;
+
+			// The literal tensors in the dtype literal_dtype picks for inputs
+			const std::vector<torch::Tensor>& literal_tensors(const std::vector<torch::Tensor>& inputs) const;
+
+			void add_literal(const TapeLiteral& lit);
+
+			void lower_roots(const std::vector<tc::refw<const Node>>& roots);
+
+			// Nodes shared by several parents or roots are lowered once
+			std::int32_t lower(const Node& node);
+
+			std::int32_t lower_node(const Node& node);
+
+			std::int32_t emit(std::int32_t op, std::vector<std::int32_t> in, std::int32_t payload = -1);
+
+			std::int32_t emit_literal(const NumberBaseToken& tok);
+
+
+			std::int32_t emit_tensor(const torch::Tensor& tensor);
+
+			std::int32_t emit_input(const std::string& name, const FetcherFuncRef& fetcher);
+
+			std::int32_t emit_custom(const CustomNode& node, std::vector<std::int32_t> in);
+
+		private:
+
+			std::vector<TapeInstruction> m_Instructions;
+
+			std::vector<std::string> m_InputNames;
+			std::vector<std::optional<FetcherFuncRef>> m_InputFetchers;
+			bool m_BoundInputs = false;
+
+			std::vector<TapeLiteral> m_Literals;
+			std::vector<torch::Tensor> m_FloatLiterals;
+			std::vector<torch::Tensor> m_DoubleLiterals;
+
+			std::vector<torch::Tensor> m_Tensors;
+
+			std::vector<TapeCustom> m_Customs;
+
+			bool m_IsReal = true;
+
+			std::vector<std::int32_t> m_Roots;
+			std::vector<std::int32_t> m_RootEnds; // number of instructions needed to evaluate roots [0,i]
+
+			// (op, inputs, payload) -> slot, used for common subexpression elimination
+			std::map<std::tuple<std::int32_t, std::vector<std::int32_t>, std::int32_t>, std::int32_t> m_Emitted;
+			// node -> slot, only used while lowering
+			std::unordered_map<const Node*, std::int32_t> m_Lowered;
+		};
+
+	}
+}
@@ -0,0 +1,433 @@
+#include "../../pch.hpp"
+
+#include "scalar.hpp"
+
+namespace tc {
+namespace expression {
+
+namespace {
+
+	using Sizes = ScalarValue::Sizes;
+
+	bool is_exact(const ScalarValue& a)
+	{
+		return a.type == TokenType::ZERO_TYPE || a.type == TokenType::UNITY_TYPE || a.type == TokenType::NEG_UNITY_TYPE;
+	}
+
+	// Results of exact operands keep an exact type when they are exactly 0, 1 or -1,
+	// any other value is a Number and any nan is a Nan
+	ScalarValue classify(std::complex<float> num, bool is_imaginary, bool exact, const Sizes& sizes)
+	{
+		if (std::isnan(num.real()) || std::isnan(num.imag()))
+			return ScalarValue(TokenType::NAN_TYPE, sizes);
+
+		if (exact) {
+			if (!std::isfinite(num.real()) || !std::isfinite(num.imag()))
+				return ScalarValue(TokenType::NAN_TYPE, sizes);
+			if (num.imag() == 0.0f) {
+				if (num.real() == 0.0f)
+					return ScalarValue(TokenType::ZERO_TYPE, sizes);
+				if (num.real() == 1.0f)
+					return ScalarValue(TokenType::UNITY_TYPE, sizes);
+				if (num.real() == -1.0f)
+					return ScalarValue(TokenType::NEG_UNITY_TYPE, sizes);
+			}
+		}
+
+		return ScalarValue(num, is_imaginary, sizes);
+	}
+
+	Sizes broadcast_sizes(const Sizes& a, const Sizes& b)
+	{
+		if (a == b)
+			return a;
+		auto sizes = tc_broadcast_shapes(c10::IntArrayRef(a), c10::IntArrayRef(b));
+		return Sizes(sizes.begin(), sizes.end());
+	}
+
+	// Broadcasts result of an op between a tensor and b to the shape b asks for,
+	// nothing is done in the common case where b already fits in the tensor
+	torch::Tensor broadcast(const torch::Tensor& result, const ScalarValue& b)
+	{
+		auto sizes = result.sizes();
+		bool fits = b.sizes.size() <= sizes.size();
+		for (int i = 1; fits && i <= b.sizes.size(); ++i) {
+			auto bsize = b.sizes[b.sizes.size() - i];
+			fits = bsize == 1 || bsize == sizes[sizes.size() - i];
+		}
+		if (fits)
+			return result;
+		return torch::broadcast_to(result, tc_broadcast_shapes(sizes, c10::IntArrayRef(b.sizes)));
+	}
+
+	// Nan propagates, real operands use real arithmetic like the tensor kernels do
+	template<typename RealFunc, typename ComplexFunc>
+	ScalarValue unary(const ScalarValue& a, RealFunc real_func, ComplexFunc complex_func)
+	{
+		if (a.type == TokenType::NAN_TYPE)
+			return a;
+
+		std::complex<float> num = a.is_imaginary ? complex_func(a.num) : std::complex<float>(real_func(a.num.real()));
+		return classify(num, a.is_imaginary, is_exact(a), a.sizes);
+	}
+
+	template<typename RealFunc, typename ComplexFunc>
+	ScalarValue binary(const ScalarValue& a, const ScalarValue& b, RealFunc real_func, ComplexFunc complex_func)
+	{
+		auto sizes = broadcast_sizes(a.sizes, b.sizes);
+		if (a.type == TokenType::NAN_TYPE || b.type == TokenType::NAN_TYPE)
+			return ScalarValue(TokenType::NAN_TYPE, sizes);
+
+		bool is_imaginary = a.is_imaginary || b.is_imaginary;
+		std::complex<float> num = is_imaginary ? complex_func(a.num, b.num) :
+			std::complex<float>(real_func(a.num.real(), b.num.real()));
+		return classify(num, is_imaginary, is_exact(a) && is_exact(b), sizes);
+	}
+
+}
+
+// <====================================== SCALAR ============================================>
+
+ScalarValue::ScalarValue()
+	: ScalarValue(TokenType::ZERO_TYPE)
+{
+}
+
+ScalarValue::ScalarValue(std::int32_t type, const Sizes& sizes)
+	: type(type), is_imaginary(false), sizes(sizes)
+{
+	switch (type) {
+	case TokenType::ZERO_TYPE:
+		num = 0.0f;
+		break;
+	case TokenType::UNITY_TYPE:
+		num = 1.0f;
+		break;
+	case TokenType::NEG_UNITY_TYPE:
+		num = -1.0f;
+		break;
+	case TokenType::NAN_TYPE:
+		num = std::numeric_limits<float>::quiet_NaN();
+		break;
+	default:
+		throw std::runtime_error("ScalarValue type must be Zero, Unity, NegUnity or Nan when no number is given");
+	}
+}
+
+ScalarValue::ScalarValue(std::complex<float> num, bool is_imaginary, const Sizes& sizes)
+	: type(TokenType::NUMBER_TYPE), num(num), is_imaginary(is_imaginary), sizes(sizes)
+{
+}
+
+ScalarValue::ScalarValue(const Token& tok)
+{
+	std::int32_t toktype = tok.get_token_type();
+	switch (toktype) {
+	case TokenType::ZERO_TYPE:
+	case TokenType::UNITY_TYPE:
+	case TokenType::NEG_UNITY_TYPE:
+	case TokenType::NAN_TYPE:
+	{
+		auto& ntok = static_cast<const NumberBaseToken&>(tok);
+		*this = ScalarValue(toktype, Sizes(ntok.sizes.begin(), ntok.sizes.end()));
+	}
+	break;
+	case TokenType::NUMBER_TYPE:
+	{
+		auto& ntok = static_cast<const NumberToken&>(tok);
+		*this = ScalarValue(ntok.num, ntok.is_imaginary, Sizes(ntok.sizes.begin(), ntok.sizes.end()));
+	}
+	break;
+	default:
+		throw std::runtime_error("ScalarValue can only be constructed from tokens Zero, Unity, NegUnity, Nan and Number");
+	}
+}
+
+std::unique_ptr<NumberBaseToken> ScalarValue::to_token() const
+{
+	std::vector<int64_t> tsizes(sizes.begin(), sizes.end());
+	switch (type) {
+	case TokenType::ZERO_TYPE:
+		return std::make_unique<ZeroToken>(tsizes);
+	case TokenType::UNITY_TYPE:
+		return std::make_unique<UnityToken>(tsizes);
+	case TokenType::NEG_UNITY_TYPE:
+		return std::make_unique<NegUnityToken>(tsizes);
+	case TokenType::NAN_TYPE:
+		return std::make_unique<NanToken>(tsizes);
+	default:
+		return std::make_unique<NumberToken>(num, is_imaginary, tsizes);
+	}
+}
+
+c10::Scalar ScalarValue::to_scalar() const
+{
+	if (is_imaginary)
+		return c10::Scalar(c10::complex<float>(num));
+	return c10::Scalar(num.real());
+}
+
+// <====================================== NEG ============================================>
+
+ScalarValue operator-(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return -x; }, [](std::complex<float> x) { return -x; });
+}
+
+// <====================================== BINARY ============================================>
+
+ScalarValue operator+(const ScalarValue& a, const ScalarValue& b)
+{
+	return binary(a, b, [](float x, float y) { return x + y; },
+		[](std::complex<float> x, std::complex<float> y) { return x + y; });
+}
+
+ScalarValue operator-(const ScalarValue& a, const ScalarValue& b)
+{
+	return binary(a, b, [](float x, float y) { return x - y; },
+		[](std::complex<float> x, std::complex<float> y) { return x - y; });
+}
+
+ScalarValue operator*(const ScalarValue& a, const ScalarValue& b)
+{
+	if ((a.type == TokenType::ZERO_TYPE && b.type != TokenType::NAN_TYPE) ||
+		(b.type == TokenType::ZERO_TYPE && a.type != TokenType::NAN_TYPE))
+	{
+		return ScalarValue(TokenType::ZERO_TYPE, broadcast_sizes(a.sizes, b.sizes));
+	}
+
+	return binary(a, b, [](float x, float y) { return x * y; },
+		[](std::complex<float> x, std::complex<float> y) { return x * y; });
+}
+
+ScalarValue operator/(const ScalarValue& a, const ScalarValue& b)
+{
+	if (b.type == TokenType::ZERO_TYPE)
+		return ScalarValue(TokenType::NAN_TYPE, broadcast_sizes(a.sizes, b.sizes));
+	if (a.type == TokenType::ZERO_TYPE && b.type != TokenType::NAN_TYPE)
+		return ScalarValue(TokenType::ZERO_TYPE, broadcast_sizes(a.sizes, b.sizes));
+
+	return binary(a, b, [](float x, float y) { return x / y; },
+		[](std::complex<float> x, std::complex<float> y) { return x / y; });
+}
+
+ScalarValue pow(const ScalarValue& a, const ScalarValue& b)
+{
+	if (b.type == TokenType::ZERO_TYPE ||
+		(a.type == TokenType::UNITY_TYPE && b.type != TokenType::NAN_TYPE))
+	{
+		return ScalarValue(TokenType::UNITY_TYPE, broadcast_sizes(a.sizes, b.sizes));
+	}
+
+	return binary(a, b, [](float x, float y) { return std::pow(x, y); },
+		[](std::complex<float> x, std::complex<float> y) { return std::pow(x, y); });
+}
+
+// <====================================== TENSOR-SCALAR ============================================>
+
+torch::Tensor operator+(const torch::Tensor& a, const ScalarValue& b)
+{
+	if (b.type == TokenType::ZERO_TYPE)
+		return broadcast(a, b);
+	return broadcast(a + b.to_scalar(), b);
+}
+
+torch::Tensor operator+(const ScalarValue& a, const torch::Tensor& b)
+{
+	return b + a;
+}
+
+torch::Tensor operator-(const torch::Tensor& a, const ScalarValue& b)
+{
+	if (b.type == TokenType::ZERO_TYPE)
+		return broadcast(a, b);
+	return broadcast(a - b.to_scalar(), b);
+}
+
+torch::Tensor operator-(const ScalarValue& a, const torch::Tensor& b)
+{
+	if (a.type == TokenType::ZERO_TYPE)
+		return broadcast(-b, a);
+	return broadcast(a.to_scalar() - b, a);
+}
+
+torch::Tensor operator*(const torch::Tensor& a, const ScalarValue& b)
+{
+	switch (b.type) {
+	case TokenType::ZERO_TYPE:
+		return broadcast(torch::zeros_like(a), b);
+	case TokenType::UNITY_TYPE:
+		return broadcast(a, b);
+	case TokenType::NEG_UNITY_TYPE:
+		return broadcast(-a, b);
+	default:
+		return broadcast(a * b.to_scalar(), b);
+	}
+}
+
+torch::Tensor operator*(const ScalarValue& a, const torch::Tensor& b)
+{
+	return b * a;
+}
+
+torch::Tensor operator/(const torch::Tensor& a, const ScalarValue& b)
+{
+	switch (b.type) {
+	case TokenType::UNITY_TYPE:
+		return broadcast(a, b);
+	case TokenType::NEG_UNITY_TYPE:
+		return broadcast(-a, b);
+	default:
+		return broadcast(a / b.to_scalar(), b);
+	}
+}
+
+torch::Tensor operator/(const ScalarValue& a, const torch::Tensor& b)
+{
+	if (a.type == TokenType::UNITY_TYPE)
+		return broadcast(torch::reciprocal(b), a);
+	return broadcast(a.to_scalar() / b, a);
+}
+
+torch::Tensor pow(const torch::Tensor& a, const ScalarValue& b)
+{
+	switch (b.type) {
+	case TokenType::ZERO_TYPE:
+		return broadcast(torch::ones_like(a), b);
+	case TokenType::UNITY_TYPE:
+		return broadcast(a, b);
+	case TokenType::NEG_UNITY_TYPE:
+		return broadcast(torch::reciprocal(a), b);
+	default:
+		return broadcast(torch::pow(a, b.to_scalar()), b);
+	}
+}
+
+torch::Tensor pow(const ScalarValue& a, const torch::Tensor& b)
+{
+	if (a.type == TokenType::UNITY_TYPE)
+		return broadcast(torch::ones_like(b), a);
+	return broadcast(torch::pow(a.to_scalar(), b), a);
+}
+
+// <====================================== UNARY ============================================>
+
+ScalarValue sgn(const ScalarValue& a)
+{
+	if (a.type == TokenType::NAN_TYPE)
+		return a;
+
+	std::complex<float> num = 0.0f;
+	if (a.is_imaginary) {
+		if (a.num != std::complex<float>(0.0f))
+			num = a.num / std::abs(a.num);
+	}
+	else if (a.num.real() != 0.0f) {
+		num = a.num.real() > 0.0f ? 1.0f : -1.0f;
+	}
+	// The sign of any real number is exact
+	return classify(num, a.is_imaginary, true, a.sizes);
+}
+
+ScalarValue abs(const ScalarValue& a)
+{
+	if (a.type == TokenType::NAN_TYPE)
+		return a;
+
+	return classify(std::abs(a.num), false, is_exact(a), a.sizes);
+}
+
+ScalarValue sqrt(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::sqrt(x); }, [](std::complex<float> x) { return std::sqrt(x); });
+}
+
+ScalarValue square(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return x * x; }, [](std::complex<float> x) { return x * x; });
+}
+
+ScalarValue exp(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::exp(x); }, [](std::complex<float> x) { return std::exp(x); });
+}
+
+ScalarValue log(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::log(x); }, [](std::complex<float> x) { return std::log(x); });
+}
+
+ScalarValue expm1(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::expm1(x); }, [](std::complex<float> x) { return std::exp(x) - 1.0f; });
+}
+
+ScalarValue log1p(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::log1p(x); }, [](std::complex<float> x) { return std::log(1.0f + x); });
+}
+
+// <====================================== TRIG ============================================>
+
+ScalarValue sin(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::sin(x); }, [](std::complex<float> x) { return std::sin(x); });
+}
+
+ScalarValue cos(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::cos(x); }, [](std::complex<float> x) { return std::cos(x); });
+}
+
+ScalarValue tan(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::tan(x); }, [](std::complex<float> x) { return std::tan(x); });
+}
+
+ScalarValue asin(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::asin(x); }, [](std::complex<float> x) { return std::asin(x); });
+}
+
+ScalarValue acos(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::acos(x); }, [](std::complex<float> x) { return std::acos(x); });
+}
+
+ScalarValue atan(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::atan(x); }, [](std::complex<float> x) { return std::atan(x); });
+}
+
+ScalarValue sinh(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::sinh(x); }, [](std::complex<float> x) { return std::sinh(x); });
+}
+
+ScalarValue cosh(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::cosh(x); }, [](std::complex<float> x) { return std::cosh(x); });
+}
+
+ScalarValue tanh(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::tanh(x); }, [](std::complex<float> x) { return std::tanh(x); });
+}
+
+ScalarValue asinh(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::asinh(x); }, [](std::complex<float> x) { return std::asinh(x); });
+}
+
+ScalarValue acosh(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::acosh(x); }, [](std::complex<float> x) { return std::acosh(x); });
+}
+
+ScalarValue atanh(const ScalarValue& a)
+{
+	return unary(a, [](float x) { return std::atanh(x); }, [](std::complex<float> x) { return std::atanh(x); });
+}
+
+}
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "../token.hpp"
+
+namespace tc {
+	namespace expression {
+
+		// A Zero, Unity, NegUnity, Nan or Number token held by value. num holds the value for every type,
+		// shapes of up to four dimensions are stored inline so scalar algebra never touches the heap
+		struct ScalarValue {
+			using Sizes = c10::SmallVector<int64_t, 4>;
+
+			ScalarValue();
+
+			// type must be one of the number token types except NUMBER_TYPE
+			explicit ScalarValue(std::int32_t type, const Sizes& sizes = Sizes({ 1 }));
+
+			ScalarValue(std::complex<float> num, bool is_imaginary, const Sizes& sizes = Sizes({ 1 }));
+
+			explicit ScalarValue(const Token& tok);
+
+			std::unique_ptr<NumberBaseToken> to_token() const;
+
+			c10::Scalar to_scalar() const;
+
+			std::int32_t type;
+			std::complex<float> num;
+			bool is_imaginary;
+			Sizes sizes;
+		};
+
+		ScalarValue operator-(const ScalarValue& a);
+
+		ScalarValue operator+(const ScalarValue& a, const ScalarValue& b);
+		ScalarValue operator-(const ScalarValue& a, const ScalarValue& b);
+		ScalarValue operator*(const ScalarValue& a, const ScalarValue& b);
+		ScalarValue operator/(const ScalarValue& a, const ScalarValue& b);
+		ScalarValue pow(const ScalarValue& a, const ScalarValue& b);
+
+		torch::Tensor operator+(const torch::Tensor& a, const ScalarValue& b);
+		torch::Tensor operator+(const ScalarValue& a, const torch::Tensor& b);
+		torch::Tensor operator-(const torch::Tensor& a, const ScalarValue& b);
+		torch::Tensor operator-(const ScalarValue& a, const torch::Tensor& b);
+		torch::Tensor operator*(const torch::Tensor& a, const ScalarValue& b);
+		torch::Tensor operator*(const ScalarValue& a, const torch::Tensor& b);
+		torch::Tensor operator/(const torch::Tensor& a, const ScalarValue& b);
+		torch::Tensor operator/(const ScalarValue& a, const torch::Tensor& b);
+		torch::Tensor pow(const torch::Tensor& a, const ScalarValue& b);
+		torch::Tensor pow(const ScalarValue& a, const torch::Tensor& b);
+
+		ScalarValue sgn(const ScalarValue& a);
+		ScalarValue abs(const ScalarValue& a);
+		ScalarValue sqrt(const ScalarValue& a);
+		ScalarValue square(const ScalarValue& a);
+		ScalarValue exp(const ScalarValue& a);
+		ScalarValue log(const ScalarValue& a);
+		ScalarValue expm1(const ScalarValue& a);
+		ScalarValue log1p(const ScalarValue& a);
+
+		ScalarValue sin(const ScalarValue& a);
+		ScalarValue cos(const ScalarValue& a);
+		ScalarValue tan(const ScalarValue& a);
+		ScalarValue asin(const ScalarValue& a);
+		ScalarValue acos(const ScalarValue& a);
+		ScalarValue atan(const ScalarValue& a);
+		ScalarValue sinh(const ScalarValue& a);
+		ScalarValue cosh(const ScalarValue& a);
+		ScalarValue tanh(const ScalarValue& a);
+		ScalarValue asinh(const ScalarValue& a);
+		ScalarValue acosh(const ScalarValue& a);
+		ScalarValue atanh(const ScalarValue& a);
+
+	}
+}
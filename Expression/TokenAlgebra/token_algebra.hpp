@@ -12,6 +12,8 @@
 #include "Binary/div.hpp"
 #include "Binary/add.hpp"
 
+#include "scalar.hpp"
+
 namespace tc {
 	namespace expression {
 
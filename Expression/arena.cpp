@@ -0,0 +1,86 @@
+#include "../pch.hpp"
+
+#include "arena.hpp"
+
+#include <cstddef>
+#include <cstdlib>
+
+namespace {
+
+	thread_local tc::expression::Arena* t_CurrentArena = nullptr;
+
+	// Every object is preceded by the arena it came from, or nullptr for the heap, padded to keep the object aligned
+	constexpr std::size_t HEADER_SIZE = alignof(std::max_align_t);
+
+	std::size_t align_up(std::size_t size)
+	{
+		return (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+	}
+
+}
+
+tc::expression::Arena::Arena(std::size_t block_size)
+	: m_BlockSize(block_size)
+{
+}
+
+tc::expression::Arena::~Arena()
+{
+	for (auto block : m_Blocks) {
+		std::free(block);
+	}
+}
+
+void* tc::expression::Arena::allocate(std::size_t size)
+{
+	size = align_up(size);
+	if (size > m_Remaining) {
+		std::size_t block_size = std::max(m_BlockSize, size);
+		char* block = static_cast<char*>(std::malloc(block_size));
+		if (block == nullptr)
+			throw std::bad_alloc();
+		m_Blocks.push_back(block);
+		m_Current = block;
+		m_Remaining = block_size;
+	}
+
+	void* ptr = m_Current;
+	m_Current += size;
+	m_Remaining -= size;
+	m_Allocated += size;
+	return ptr;
+}
+
+std::size_t tc::expression::Arena::bytes_allocated() const
+{
+	return m_Allocated;
+}
+
+void* tc::expression::Arena::allocate_object(std::size_t size)
+{
+	Arena* arena = t_CurrentArena;
+	char* header = static_cast<char*>(arena != nullptr ? arena->allocate(HEADER_SIZE + size) : ::operator new(HEADER_SIZE + size));
+	*reinterpret_cast<Arena**>(header) = arena;
+	return header + HEADER_SIZE;
+}
+
+void tc::expression::Arena::deallocate_object(void* ptr)
+{
+	if (ptr == nullptr)
+		return;
+
+	char* header = static_cast<char*>(ptr) - HEADER_SIZE;
+	if (*reinterpret_cast<Arena**>(header) == nullptr)
+		::operator delete(header);
+}
+
+tc::expression::ArenaScope::ArenaScope(Arena& arena)
+	: m_Previous(t_CurrentArena)
+{
+	t_CurrentArena = &arena;
+}
+
+tc::expression::ArenaScope::~ArenaScope()
+{
+	t_CurrentArena = m_Previous;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "../pch.hpp"
+
+namespace tc {
+	namespace expression {
+
+		// Bump allocator for the tokens and nodes of expression trees. While an ArenaScope is alive on a thread,
+		// every Token and Node created on that thread is placed in its arena. Deleting them runs their destructors
+		// but gives no memory back, the arena releases everything at once when it is destroyed, so it must
+		// outlive all tokens and nodes allocated in it. Not thread safe, an arena is filled by one thread at a time
+		class Arena {
+		public:
+
+			Arena(std::size_t block_size = 64 * 1024);
+
+			Arena(const Arena&) = delete;
+			Arena& operator=(const Arena&) = delete;
+
+			~Arena();
+
+			void* allocate(std::size_t size);
+
+			// Bytes handed out, including those of objects already deleted
+			std::size_t bytes_allocated() const;
+
+			// Used by the operator new and delete of Token and Node, allocates from the arena of the
+			// current ArenaScope or from the heap if there is none
+			static void* allocate_object(std::size_t size);
+
+			static void deallocate_object(void* ptr);
+
+		private:
+
+			std::size_t m_BlockSize;
+			std::vector<char*> m_Blocks;
+			char* m_Current = nullptr;
+			std::size_t m_Remaining = 0;
+			std::size_t m_Allocated = 0;
+		};
+
+		// Makes arena the current arena of this thread until the scope ends, scopes nest
+		class ArenaScope {
+		public:
+
+			ArenaScope(Arena& arena);
+
+			ArenaScope(const ArenaScope&) = delete;
+			ArenaScope& operator=(const ArenaScope&) = delete;
+
+			~ArenaScope();
+
+		private:
+
+			Arena* m_Previous;
+		};
+
+	}
+}
@@ -0,0 +1,110 @@
+#include "../pch.hpp"
+
+#include "custom.hpp"
+#include "Parser/lexer.hpp"
+
+const tc::expression::CustomKernel& tc::expression::CustomFunction::kernel(const std::vector<std::int32_t>& partials) const
+{
+	for (auto p : partials) {
+		if (p < 0 || p >= n_inputs)
+			throw std::runtime_error("custom function " + name + " has no argument " + std::to_string(p));
+	}
+
+	const CustomKernel* ret = nullptr;
+	switch (partials.size()) {
+	case 0:
+		ret = &eval;
+		break;
+	case 1:
+		if (partials[0] < derivatives.size())
+			ret = &derivatives[partials[0]];
+		break;
+	case 2:
+	{
+		std::int32_t i = std::max(partials[0], partials[1]);
+		std::int32_t j = std::min(partials[0], partials[1]);
+		std::int32_t index = i * (i + 1) / 2 + j;
+		if (index < second_derivatives.size())
+			ret = &second_derivatives[index];
+	}
+	break;
+	default:
+		throw std::runtime_error("custom function " + name + " can only be differentiated twice");
+	}
+
+	if (ret == nullptr || !*ret)
+		throw std::runtime_error("custom function " + name + " has no kernel for derivative order " + std::to_string(partials.size()));
+	return *ret;
+}
+
+tc::expression::CustomFunctionRegistry& tc::expression::CustomFunctionRegistry::instance()
+{
+	static CustomFunctionRegistry registry;
+	return registry;
+}
+
+std::int32_t tc::expression::CustomFunctionRegistry::add(CustomFunction function)
+{
+	if (function.name.empty() || !std::all_of(function.name.begin(), function.name.end(), [](char c) { return std::isalnum(c) || c == '_'; }) ||
+		std::isdigit(function.name[0]))
+		throw std::runtime_error("custom function name " + function.name + " is not an identifier");
+
+	for (auto& p : DEFAULT_FUNCTION_MAPS) {
+		if (p.second == function.name)
+			throw std::runtime_error("custom function " + function.name + " would shadow a default function");
+	}
+
+	if (function.n_inputs < 1)
+		throw std::runtime_error("custom function " + function.name + " must take at least one argument");
+
+	if (!function.eval)
+		throw std::runtime_error("custom function " + function.name + " has no eval kernel");
+
+	std::int32_t n = function.n_inputs;
+	if (function.derivatives.size() > n || function.second_derivatives.size() > n * (n + 1) / 2)
+		throw std::runtime_error("custom function " + function.name + " has more derivative kernels than arguments");
+
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	++m_Generation;
+	auto it = m_Ids.find(function.name);
+	if (it != m_Ids.end()) {
+		m_Functions[it->second - CUSTOM_FUNCTION_ID_START] = std::make_shared<const CustomFunction>(std::move(function));
+		return it->second;
+	}
+
+	std::int32_t id = CUSTOM_FUNCTION_ID_START + m_Functions.size();
+	m_Ids.emplace(function.name, id);
+	m_Functions.push_back(std::make_shared<const CustomFunction>(std::move(function)));
+	return id;
+}
+
+bool tc::expression::CustomFunctionRegistry::contains(const std::string& name) const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	return m_Ids.find(name) != m_Ids.end();
+}
+
+std::shared_ptr<const tc::expression::CustomFunction> tc::expression::CustomFunctionRegistry::get(const std::string& name) const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	auto it = m_Ids.find(name);
+	if (it == m_Ids.end())
+		throw std::runtime_error("no custom function named " + name + " is registered");
+	return m_Functions[it->second - CUSTOM_FUNCTION_ID_START];
+}
+
+std::vector<std::pair<std::int32_t, std::shared_ptr<const tc::expression::CustomFunction>>> tc::expression::CustomFunctionRegistry::functions() const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	std::vector<std::pair<std::int32_t, std::shared_ptr<const CustomFunction>>> ret;
+	for (int i = 0; i < m_Functions.size(); ++i) {
+		ret.emplace_back(CUSTOM_FUNCTION_ID_START + i, m_Functions[i]);
+	}
+	return ret;
+}
+
+std::uint64_t tc::expression::CustomFunctionRegistry::generation() const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	return m_Generation;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "../pch.hpp"
+
+#include <map>
+#include <mutex>
+
+namespace tc {
+	namespace expression {
+
+		// Computes a value from the argument tensors of a custom function. Kernels must broadcast their arguments
+		// like the elementwise torch ops do, must also accept the empty tensors shapes are inferred with, and may be
+		// called from several threads at once
+		using CustomKernel = std::function<torch::Tensor(const std::vector<torch::Tensor>&)>;
+
+		// A function of n_inputs arguments, evaluated by its own kernel and differentiated by its own analytic
+		// derivative kernels. derivatives[i] is the partial derivative with respect to argument i and
+		// second_derivatives[i * (i + 1) / 2 + j], j <= i, the one with respect to arguments i and j.
+		// Derivatives left empty are an error when they are needed
+		struct CustomFunction {
+			std::string name;
+			std::int32_t n_inputs;
+			CustomKernel eval;
+			std::vector<CustomKernel> derivatives;
+			std::vector<CustomKernel> second_derivatives;
+
+			// The kernel of the partial derivative with respect to the arguments in partials, of at most two arguments.
+			// An empty partials gives eval
+			const CustomKernel& kernel(const std::vector<std::int32_t>& partials) const;
+		};
+
+		// Function token ids of custom functions start here, far above the default functions
+		constexpr std::int32_t CUSTOM_FUNCTION_ID_START = 1 << 16;
+
+		// Process wide set of custom functions. Every LexContext and creation map made after a function was added
+		// knows it by name, so it can be used in expression strings like the default functions
+		class CustomFunctionRegistry {
+		public:
+
+			static CustomFunctionRegistry& instance();
+
+			// Returns the function token id of the function. Adding a name again replaces the function under the
+			// same id, trees and tapes already built keep evaluating the function they were built with
+			std::int32_t add(CustomFunction function);
+
+			bool contains(const std::string& name) const;
+
+			std::shared_ptr<const CustomFunction> get(const std::string& name) const;
+
+			// Every function with its function token id
+			std::vector<std::pair<std::int32_t, std::shared_ptr<const CustomFunction>>> functions() const;
+
+			// Counts the functions added so far, so caches of compiled trees can tell if a function was replaced since
+			std::uint64_t generation() const;
+
+		private:
+
+			CustomFunctionRegistry() = default;
+
+		private:
+
+			mutable std::mutex m_Mutex;
+			std::vector<std::shared_ptr<const CustomFunction>> m_Functions; // indexed by id - CUSTOM_FUNCTION_ID_START
+			std::map<std::string, std::int32_t> m_Ids;
+			std::uint64_t m_Generation = 0;
+		};
+
+	}
+}
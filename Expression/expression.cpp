@@ -4,7 +4,7 @@
 #include "Parser/lexer.hpp"
 #include "nodes.hpp"
 
-tc::expression::Expression::Expression(std::unique_ptr<Node> root_child, const FetcherMap& fetchers)
+tc::expression::Expression::Expression(std::shared_ptr<Node> root_child, const FetcherMap& fetchers)
 	: m_VariableFetchers(fetchers)
 {
 	m_Children.push_back(std::move(root_child));
@@ -32,6 +32,11 @@ tc::expression::tentok tc::expression::Expression::eval()
 	return m_Children[0]->eval();
 }
 
+void tc::expression::Expression::eval_into(torch::Tensor& out)
+{
+	m_Children[0]->eval_into(out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::Expression::evalnode()
 {
 	return std::make_unique<Expression>(std::move(m_Children[0]->evalnode()), m_VariableFetchers);
@@ -47,19 +52,30 @@ tc::expression::tentok tc::expression::Expression::diff(const VariableToken& var
 	return m_Children[0]->diff(var);
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::Expression::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::Expression::diffnode(const VariableToken& var, DiffMemo& memo)
 {
-	return std::unique_ptr<Node>();
+	return exprdiffnode(var, memo);
 }
 
 std::unique_ptr<tc::expression::Expression> tc::expression::Expression::exprdiffnode(const VariableToken& var)
 {
-	return std::make_unique<Expression>(std::move(m_Children[0]->diffnode(var)), m_VariableFetchers);
+	DiffMemo memo;
+	return exprdiffnode(var, memo);
+}
+
+std::unique_ptr<tc::expression::Expression> tc::expression::Expression::exprdiffnode(const VariableToken& var, DiffMemo& memo)
+{
+	return std::make_unique<Expression>(derivative(m_Children[0], var, memo), m_VariableFetchers);
+}
+
+std::int32_t tc::expression::Expression::get_node_type() const
+{
+	return NodeType::EXPRESSION_NODE;
 }
 
 tc::expression::ExpressionCreationMap tc::expression::Expression::default_expression_creation_map()
 {
-	return ExpressionCreationMap{
+	ExpressionCreationMap creation_map{
 		// Fixed Tokens
 		{FixedIDs::UNITY_ID,
 		[](const Token& tok, const FetcherMap& fetcher_map, std::vector<std::unique_ptr<Node>>& nodes)
@@ -316,4 +332,20 @@ tc::expression::ExpressionCreationMap tc::expression::Expression::default_expres
 		},
 
 	};
+
+	// Custom functions registered so far, the nodes keep the function they were created with
+	for (auto& [id, function] : CustomFunctionRegistry::instance().functions()) {
+		creation_map.emplace(id,
+			[function = function](const Token& tok, const FetcherMap& fetcher_map, std::vector<std::unique_ptr<Node>>& nodes)
+			{
+				std::vector<std::shared_ptr<Node>> children(function->n_inputs);
+				for (int i = function->n_inputs - 1; i >= 0; --i) {
+					children[i] = std::move(nodes.back());
+					nodes.pop_back();
+				}
+				nodes.push_back(std::make_unique<CustomNode>(function, std::vector<std::int32_t>(), std::move(children)));
+			});
+	}
+
+	return creation_map;
 }
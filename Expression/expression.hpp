@@ -15,23 +15,31 @@ namespace tc {
 		class Expression : public Node {
 		public:
 
-			Expression(std::unique_ptr<Node> root_child, const FetcherMap& fetchers);
+			Expression(std::shared_ptr<Node> root_child, const FetcherMap& fetchers);
 
 			Expression(const std::deque<std::unique_ptr<Token>>& tokens, const ExpressionCreationMap& creation_map,
 				const FetcherMap& fetchers);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			std::unique_ptr<Expression> exprevalnode();
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
 
 			std::unique_ptr<Expression> exprdiffnode(const VariableToken& var);
 
+			// Derivatives built with the same memo share their common subterms, also with the derivatives of
+			// other expressions that share nodes with this one
+			std::unique_ptr<Expression> exprdiffnode(const VariableToken& var, DiffMemo& memo);
+
+			std::int32_t get_node_type() const override;
+
 			static ExpressionCreationMap default_expression_creation_map();
 
 		private:
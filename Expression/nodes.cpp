@@ -1,79 +1,101 @@
 #include "../pch.hpp"
 
 #include "nodes.hpp"
+#include "arena.hpp"
+
+void* tc::expression::Node::operator new(std::size_t size)
+{
+	return Arena::allocate_object(size);
+}
+
+void tc::expression::Node::operator delete(void* ptr)
+{
+	Arena::deallocate_object(ptr);
+}
+
+tc::expression::tentok::tentok(const torch::Tensor& tensor)
+	: m_Value(tensor)
+{
+}
+
+tc::expression::tentok::tentok(torch::Tensor&& tensor)
+	: m_Value(std::move(tensor))
+{
+}
+
+tc::expression::tentok::tentok(const ScalarValue& scalar)
+	: m_Value(scalar)
+{
+}
+
+bool tc::expression::tentok::is_tensor() const
+{
+	return m_Value.index() == 0;
+}
+
+bool tc::expression::tentok::is_scalar() const
+{
+	return m_Value.index() == 1;
+}
+
+const torch::Tensor& tc::expression::tentok::tensor() const
+{
+	return std::get<torch::Tensor>(m_Value);
+}
+
+const tc::expression::ScalarValue& tc::expression::tentok::scalar() const
+{
+	return std::get<ScalarValue>(m_Value);
+}
 
 std::string tc::expression::tentok_to_string(const tentok& in)
 {
-	if (in.first.has_value()) {
+	if (in.is_tensor()) {
 		std::stringstream stream;
-		stream << in.first.value();
+		stream << in.tensor();
 		return stream.str();
 	}
-	else if (in.second.has_value()) {
-		auto& tok = *in.second.value();
-		
-		switch (tok.get_token_type()) {
-		case TokenType::ZERO_TYPE:
-		{
-			const ZeroToken& ttok = static_cast<const ZeroToken&>(tok);
-			return "ZERO";
-		}
-		case TokenType::UNITY_TYPE:
-		{
-			const UnityToken& ttok = static_cast<const UnityToken&>(tok);
-			return "UNITY";
-		}
-		case TokenType::NEG_UNITY_TYPE:
-		{
-			const NegUnityToken& ttok = static_cast<const NegUnityToken&>(tok);
-			return "NEG_UNITY";
-		}
-		case TokenType::NAN_TYPE:
-		{
-			const NanToken& ttok = static_cast<const NanToken&>(tok);
-			return "NAN";
-		}
-		case TokenType::NUMBER_TYPE:
-		{
-			const NumberToken& ttok = static_cast<const NumberToken&>(tok);
-			return "NUM: " + std::to_string(ttok.num.real()) + "+" + std::to_string(ttok.num.imag()) + "i";
-		}
-		default:
-			throw std::runtime_error("Expected Zero, Unity, NegUnity, Nan and Number");
-		}
+
+	auto& scalar = in.scalar();
+	switch (scalar.type) {
+	case TokenType::ZERO_TYPE:
+		return "ZERO";
+	case TokenType::UNITY_TYPE:
+		return "UNITY";
+	case TokenType::NEG_UNITY_TYPE:
+		return "NEG_UNITY";
+	case TokenType::NAN_TYPE:
+		return "NAN";
+	default:
+		return "NUM: " + std::to_string(scalar.num.real()) + "+" + std::to_string(scalar.num.imag()) + "i";
 	}
-	return "tentok had no value";
 }
 
 tc::expression::tentok tc::expression::tentok_from_number(float a)
 {
-	return std::make_pair(std::nullopt, std::make_unique<NumberToken>(a, false));
+	return ScalarValue(a, false);
 }
 
 tc::expression::tentok tc::expression::tentok_from_zero()
 {
-	return std::make_pair(std::nullopt, std::make_unique<ZeroToken>());
+	return ScalarValue(TokenType::ZERO_TYPE);
 }
 
 tc::expression::tentok tc::expression::tentok_from_unity()
 {
-	return std::make_pair(std::nullopt, std::make_unique<UnityToken>());
+	return ScalarValue(TokenType::UNITY_TYPE);
 }
 
 tc::expression::tentok tc::expression::tentok_from_negunity()
 {
-	return std::make_pair(std::nullopt, std::make_unique<NegUnityToken>());
+	return ScalarValue(TokenType::NEG_UNITY_TYPE);
 }
 
 tc::expression::tentok tc::expression::tentok_from_nan()
 {
-	return std::make_pair(std::nullopt, std::make_unique<NanToken>());
+	return ScalarValue(TokenType::NAN_TYPE);
 }
 
-
-
-
-
 std::unique_ptr<tc::expression::NumberBaseToken> tc::expression::copy_token(const Token& tok)
 {
 	std::int32_t type = tok.get_token_type();
@@ -116,39 +138,99 @@ std::unique_ptr<tc::expression::NumberBaseToken> tc::expression::copy_token(cons
 
 torch::Tensor tc::expression::tensor_from_tentok(const tentok& in, torch::Device& device)
 {
-	torch::TensorOptions tops;
-	tops = tops.device(device);
-
-	if (in.first.has_value()) {
-		return in.first.value();
-	}
-	else if (in.second.has_value()) {
-		auto& tok = in.second.value();
-		switch (tok->get_token_type()) {
-		case TokenType::NUMBER_TYPE:
-		{
-			const NumberToken& numtok = static_cast<const NumberToken&>(*tok);
-			if (numtok.is_imaginary)
-				return torch::full(numtok.sizes, c10::complex<float>(numtok.num), tops);
-			return torch::full(numtok.sizes, numtok.num.real(), tops);
-		}
-		case TokenType::UNITY_TYPE:
-		{
-			return torch::ones(tok->sizes, tops);
-		}
-		case TokenType::NEG_UNITY_TYPE:
-		{
-			return -torch::ones(tok->sizes, tops);
-		}
-		case TokenType::ZERO_TYPE:
-		{
-			return -torch::zeros(tok->sizes, tops);
-		}
-		case TokenType::NAN_TYPE:
-			return torch::full(tok->sizes, std::numeric_limits<float>::quiet_NaN(), tops);
-		}
+	if (in.is_tensor()) {
+		return in.tensor();
+	}
+
+	auto& scalar = in.scalar();
+	return torch::full(c10::IntArrayRef(scalar.sizes), scalar.to_scalar(), torch::TensorOptions().device(device));
+}
+
+std::vector<std::vector<int64_t>> tc::expression::concat_sizes(const std::vector<std::vector<int64_t>>& pieces,
+	const std::vector<std::vector<int64_t>>& shapes)
+{
+	std::vector<std::vector<int64_t>> sizes;
+	std::vector<int64_t> leading;
+	for (int i = 0; i < pieces.size(); ++i) {
+		auto inferred = at::infer_size(pieces[i], shapes[i]);
+		std::vector<int64_t> piece(inferred.begin(), inferred.end());
+		if (piece.empty())
+			piece.push_back(1);
+
+		auto inferred_leading = at::infer_size(leading, std::vector<int64_t>(piece.begin(), piece.end() - 1));
+		leading.assign(inferred_leading.begin(), inferred_leading.end());
+		sizes.push_back(std::move(piece));
+	}
+
+	for (auto& piece : sizes) {
+		int64_t width = piece.back();
+		piece = leading;
+		piece.push_back(width);
+	}
+	return sizes;
+}
+
+std::vector<torch::Tensor> tc::expression::expand_pieces(const std::vector<torch::Tensor>& pieces, const std::vector<torch::Tensor>& shapes)
+{
+	std::vector<std::vector<int64_t>> piece_sizes;
+	std::vector<std::vector<int64_t>> shape_sizes;
+	for (int i = 0; i < pieces.size(); ++i) {
+		piece_sizes.push_back(pieces[i].sizes().vec());
+		shape_sizes.push_back(shapes[i].sizes().vec());
+	}
+
+	auto sizes = concat_sizes(piece_sizes, shape_sizes);
+	std::vector<torch::Tensor> ret;
+	for (int i = 0; i < pieces.size(); ++i) {
+		// 0-dim literals live on the cpu whatever device their shape is on
+		if (pieces[i].dim() == 0 && pieces[i].device() != shapes[i].device())
+			ret.push_back(pieces[i].to(shapes[i].device()).expand(sizes[i]));
+		else
+			ret.push_back(pieces[i].expand(sizes[i]));
+	}
+	return ret;
+}
+
+bool tc::expression::out_fits(const torch::Tensor& out, const torch::Tensor& a)
+{
+	return out.defined() && out.sizes() == a.sizes() && out.scalar_type() == a.scalar_type() && out.device() == a.device();
+}
+
+bool tc::expression::out_fits(const torch::Tensor& out, const torch::Tensor& a, const torch::Tensor& b)
+{
+	if (!out.defined())
+		return false;
+	// 0-dim literals live on the cpu whatever device the other operand is on
+	const torch::Tensor& dev = (a.dim() == 0 && a.device().is_cpu()) ? b : a;
+	return out.scalar_type() == torch::result_type(a, b) && out.device() == dev.device() &&
+		out.sizes() == at::IntArrayRef(at::infer_size(a.sizes(), b.sizes()));
+}
+
+void tc::expression::tensor_into(const torch::Tensor& in, torch::Tensor& out)
+{
+	if (out_fits(out, in))
+		out.copy_(in);
+	else
+		out = in.clone();
+}
+
+void tc::expression::tentok_into(const tentok& in, torch::Tensor& out)
+{
+	if (in.is_tensor()) {
+		tensor_into(in.tensor(), out);
+		return;
+	}
+
+	auto& scalar = in.scalar();
+	if (!out.defined() || out.sizes() != c10::IntArrayRef(scalar.sizes)) {
+		torch::Device device = out.defined() ? out.device() : torch::Device(torch::kCPU);
+		out = tensor_from_tentok(in, device);
+		return;
 	}
-	throw std::runtime_error("tentok contained two nullopt");
+	if (scalar.type == TokenType::ZERO_TYPE)
+		out.zero_();
+	else
+		out.fill_(scalar.to_scalar());
 }
 
 // <================================== NODE ===================================>
@@ -158,6 +240,35 @@ tc::expression::Node::Node(std::unique_ptr<NumberBaseToken> base_token)
 {
 }
 
+void tc::expression::Node::eval_into(torch::Tensor& out)
+{
+	tentok_into(eval(), out);
+}
+
+std::shared_ptr<tc::expression::Node> tc::expression::Node::derivative(const std::shared_ptr<Node>& node, const VariableToken& var, DiffMemo& memo)
+{
+	auto found = memo.find(*node, var);
+	if (found)
+		return found;
+
+	auto diffed = node->diffnode(var, memo);
+	memo.insert(node, var, diffed);
+	return diffed;
+}
+
+std::shared_ptr<tc::expression::Node> tc::expression::DiffMemo::find(const Node& node, const VariableToken& var) const
+{
+	auto it = m_Derivatives.find(std::make_pair(&node, var.name));
+	if (it != m_Derivatives.end())
+		return it->second.second;
+	return nullptr;
+}
+
+void tc::expression::DiffMemo::insert(const std::shared_ptr<Node>& node, const VariableToken& var, std::shared_ptr<Node> derivative)
+{
+	m_Derivatives.emplace(std::make_pair(node.get(), var.name), std::make_pair(node, std::move(derivative)));
+}
+
 
 std::unique_ptr<tc::expression::Node> tc::expression::node_from_token(const Token& tok)
 {
@@ -167,13 +278,10 @@ std::unique_ptr<tc::expression::Node> tc::expression::node_from_token(const Toke
 
 std::unique_ptr<tc::expression::Node> tc::expression::node_from_pair(const tentok& pair)
 {
-	if (pair.first.has_value()) {
-		return std::make_unique<TensorNode>(pair.first.value());
+	if (pair.is_tensor()) {
+		return std::make_unique<TensorNode>(pair.tensor());
 	}
-	else if (pair.second.has_value()) {
-		return std::make_unique<TokenNode>(*pair.second.value());
-	}
-	throw std::runtime_error("node_from_pair() received a pair with only nullopt content");
+	return std::make_unique<TokenNode>(*pair.scalar().to_token());
 }
 
 
@@ -186,7 +294,7 @@ tc::expression::TokenNode::TokenNode(const Token& tok)
 
 tc::expression::tentok tc::expression::TokenNode::eval()
 {
-	return std::make_pair(std::nullopt, copy_token(*m_pToken));
+	return ScalarValue(*m_pToken);
 }
 
 std::unique_ptr<tc::expression::Node> tc::expression::TokenNode::evalnode()
@@ -196,14 +304,19 @@ std::unique_ptr<tc::expression::Node> tc::expression::TokenNode::evalnode()
 
 tc::expression::tentok tc::expression::TokenNode::diff(const VariableToken& var)
 {
-	return std::make_pair(std::nullopt, std::make_unique<ZeroToken>(m_pToken->sizes)); // derivative of number is always zero
+	return ScalarValue(TokenType::ZERO_TYPE, ScalarValue::Sizes(m_pToken->sizes.begin(), m_pToken->sizes.end())); // derivative of number is always zero
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::TokenNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::TokenNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
 	return std::make_unique<TokenNode>(ZeroToken(m_pToken->sizes));
 }
 
+std::int32_t tc::expression::TokenNode::get_node_type() const
+{
+	return NodeType::TOKEN_NODE;
+}
+
 // <================================== TOKEN-FETCHER ===================================>
 
 tc::expression::TokenFetcherNode::TokenFetcherNode(const Token& tok, const FetcherFuncRef& fetcher)
@@ -213,8 +326,10 @@ tc::expression::TokenFetcherNode::TokenFetcherNode(const Token& tok, const Fetch
 
 tc::expression::tentok tc::expression::TokenFetcherNode::eval()
 {
-	m_pToken->sizes = m_VariableFetcher().sizes().vec();
-	return std::make_pair(std::nullopt, copy_token(*m_pToken));
+	auto sizes = m_VariableFetcher().sizes();
+	if (c10::IntArrayRef(m_pToken->sizes) != sizes)
+		m_pToken->sizes = sizes.vec();
+	return ScalarValue(*m_pToken);
 }
 
 std::unique_ptr<tc::expression::Node> tc::expression::TokenFetcherNode::evalnode()
@@ -224,15 +339,25 @@ std::unique_ptr<tc::expression::Node> tc::expression::TokenFetcherNode::evalnode
 
 tc::expression::tentok tc::expression::TokenFetcherNode::diff(const VariableToken& var)
 {
-	m_pToken->sizes = m_VariableFetcher().sizes().vec();
-	return std::make_pair(std::nullopt, std::make_unique<ZeroToken>(m_pToken->sizes)); // derivative of number is always zero
+	auto sizes = m_VariableFetcher().sizes();
+	return ScalarValue(TokenType::ZERO_TYPE, ScalarValue::Sizes(sizes.begin(), sizes.end())); // derivative of number is always zero
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::TokenFetcherNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::TokenFetcherNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
 	return std::make_unique<TokenFetcherNode>(ZeroToken(), m_VariableFetcher);
 }
 
+std::int32_t tc::expression::TokenFetcherNode::get_node_type() const
+{
+	return NodeType::TOKEN_FETCHER_NODE;
+}
+
+const tc::expression::FetcherFuncRef& tc::expression::TokenFetcherNode::get_fetcher() const
+{
+	return m_VariableFetcher;
+}
+
 // <================================== TENSOR-NODE ===================================>
 
 tc::expression::TensorNode::TensorNode(const torch::Tensor& tensor)
@@ -242,7 +367,7 @@ tc::expression::TensorNode::TensorNode(const torch::Tensor& tensor)
 
 tc::expression::tentok tc::expression::TensorNode::eval()
 {
-	return std::make_pair(m_Tensor, std::nullopt);
+	return m_Tensor;
 }
 
 std::unique_ptr<tc::expression::Node> tc::expression::TensorNode::evalnode()
@@ -252,14 +377,25 @@ std::unique_ptr<tc::expression::Node> tc::expression::TensorNode::evalnode()
 
 tc::expression::tentok tc::expression::TensorNode::diff(const VariableToken& var)
 {
-	return std::make_pair(std::nullopt, std::make_unique<ZeroToken>(m_Tensor.sizes().vec()));
+	auto sizes = m_Tensor.sizes();
+	return ScalarValue(TokenType::ZERO_TYPE, ScalarValue::Sizes(sizes.begin(), sizes.end()));
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::TensorNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::TensorNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
 	return std::make_unique<TokenNode>(ZeroToken(m_Tensor.sizes().vec()));
 }
 
+std::int32_t tc::expression::TensorNode::get_node_type() const
+{
+	return NodeType::TENSOR_NODE;
+}
+
+const torch::Tensor& tc::expression::TensorNode::get_tensor() const
+{
+	return m_Tensor;
+}
+
 // <================================== VARIABLE ===================================>
 
 tc::expression::VariableNode::VariableNode(const VariableToken& token, FetcherFuncRef variable_fetcher)
@@ -269,7 +405,7 @@ tc::expression::VariableNode::VariableNode(const VariableToken& token, FetcherFu
 
 tc::expression::tentok tc::expression::VariableNode::eval()
 {
-	return std::make_pair(m_VariableFetcher(), std::nullopt);
+	return m_VariableFetcher();
 }
 
 std::unique_ptr<tc::expression::Node> tc::expression::VariableNode::evalnode()
@@ -279,15 +415,15 @@ std::unique_ptr<tc::expression::Node> tc::expression::VariableNode::evalnode()
 
 tc::expression::tentok tc::expression::VariableNode::diff(const VariableToken& var)
 {
-	auto sizes = m_VariableFetcher.get()().sizes().vec();
+	auto sizes = m_VariableFetcher.get()().sizes();
 
 	if (var.name == m_VarToken.name) {
-		return std::make_pair(std::nullopt, std::make_unique<UnityToken>(sizes));
+		return ScalarValue(TokenType::UNITY_TYPE, ScalarValue::Sizes(sizes.begin(), sizes.end()));
 	}
-	return std::make_pair(std::nullopt, std::make_unique<ZeroToken>(sizes));
+	return ScalarValue(TokenType::ZERO_TYPE, ScalarValue::Sizes(sizes.begin(), sizes.end()));
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::VariableNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::VariableNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
 	if (var.name == m_VarToken.name) {
 		return std::make_unique<TokenFetcherNode>(UnityToken(), m_VariableFetcher);
@@ -295,22 +431,32 @@ std::unique_ptr<tc::expression::Node> tc::expression::VariableNode::diffnode(con
 	return std::make_unique<TokenFetcherNode>(ZeroToken(), m_VariableFetcher);
 }
 
+std::int32_t tc::expression::VariableNode::get_node_type() const
+{
+	return NodeType::VARIABLE_NODE;
+}
+
+const tc::expression::VariableToken& tc::expression::VariableNode::get_variable_token() const
+{
+	return m_VarToken;
+}
+
+const tc::expression::FetcherFuncRef& tc::expression::VariableNode::get_fetcher() const
+{
+	return m_VariableFetcher;
+}
+
 // <================================== NEG ===================================>
 
 tc::expression::tentok tc::expression::operator-(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(-a.first.value(), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, -(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return -a.tensor();
 	}
+	return -(a.scalar());
 }
 
-tc::expression::NegNode::NegNode(std::unique_ptr<Node> child)
+tc::expression::NegNode::NegNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -320,6 +466,17 @@ tc::expression::tentok tc::expression::NegNode::eval()
 	return -m_Children[0]->eval();
 }
 
+void tc::expression::NegNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::neg_out(out, in.tensor());
+		return;
+	}
+	tentok_into(-in, out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::NegNode::evalnode()
 {
 	return std::make_unique<NegNode>(m_Children[0]->evalnode());
@@ -330,33 +487,33 @@ tc::expression::tentok tc::expression::NegNode::diff(const VariableToken& var)
 	return -m_Children[0]->diff(var);
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::NegNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::NegNode::diffnode(const VariableToken& var, DiffMemo& memo)
+{
+	return std::make_unique<NegNode>(derivative(m_Children[0], var, memo));
+}
+
+std::int32_t tc::expression::NegNode::get_node_type() const
 {
-	return std::make_unique<NegNode>(m_Children[0]->diffnode(var));
+	return NodeType::NEG_NODE;
 }
 
 // <================================== MUL ===================================>
 
 tc::expression::tentok tc::expression::operator*(const tentok& a, const tentok& b)
 {
-	if (a.first.has_value() && b.first.has_value()) {
-		return std::make_pair(a.first.value() * b.first.value(), std::nullopt);
-	}
-	else if (a.first.has_value() && b.second.has_value()) {
-		return std::make_pair(a.first.value() * *b.second.value(), std::nullopt);
-	}
-	else if (a.second.has_value() && b.first.has_value()) {
-		return std::make_pair(*a.second.value() * b.first.value(), std::nullopt);
+	if (a.is_tensor() && b.is_tensor()) {
+		return a.tensor() * b.tensor();
 	}
-	else if (a.second.has_value() && b.second.has_value()) {
-		return std::make_pair(std::nullopt, *a.second.value() * *b.second.value());
+	else if (a.is_tensor() && b.is_scalar()) {
+		return a.tensor() * b.scalar();
 	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	else if (a.is_scalar() && b.is_tensor()) {
+		return a.scalar() * b.tensor();
 	}
+	return a.scalar() * b.scalar();
 }
 
-tc::expression::MulNode::MulNode(std::unique_ptr<Node> left_child, std::unique_ptr<Node> right_child)
+tc::expression::MulNode::MulNode(std::shared_ptr<Node> left_child, std::shared_ptr<Node> right_child)
 {
 	m_Children.resize(2);
 	m_Children.at(0) = std::move(left_child);
@@ -371,6 +528,18 @@ tc::expression::tentok tc::expression::MulNode::eval()
 	return l * r;
 }
 
+void tc::expression::MulNode::eval_into(torch::Tensor& out)
+{
+	auto l = m_Children[0]->eval();
+	auto r = m_Children[1]->eval();
+
+	if (l.is_tensor() && r.is_tensor() && out_fits(out, l.tensor(), r.tensor())) {
+		torch::mul_out(out, l.tensor(), r.tensor());
+		return;
+	}
+	tentok_into(l * r, out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::MulNode::evalnode()
 {
 	auto l = m_Children[0]->evalnode();
@@ -390,42 +559,39 @@ tc::expression::tentok tc::expression::MulNode::diff(const VariableToken& var)
 	return (dl * r + l * dr);
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::MulNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::MulNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
-	auto l = m_Children[0]->evalnode();
-	auto r = m_Children[1]->evalnode();
-
-	auto dl = m_Children[0]->diffnode(var);
-	auto dr = m_Children[1]->diffnode(var);
+	auto& l = m_Children[0];
+	auto& r = m_Children[1];
 
-	auto dlr = std::make_unique<MulNode>(std::move(dl), std::move(r));
-	auto ldr = std::make_unique<MulNode>(std::move(l), std::move(dr));
+	auto dlr = std::make_unique<MulNode>(derivative(l, var, memo), r);
+	auto ldr = std::make_unique<MulNode>(l, derivative(r, var, memo));
 
 	return std::make_unique<AddNode>(std::move(dlr), std::move(ldr));
 }
 
+std::int32_t tc::expression::MulNode::get_node_type() const
+{
+	return NodeType::MUL_NODE;
+}
+
 // <================================== DIV ===================================>
 
 tc::expression::tentok tc::expression::operator/(const tentok& a, const tentok& b)
 {
-	if (a.first.has_value() && b.first.has_value()) {
-		return std::make_pair(a.first.value() / b.first.value(), std::nullopt);
-	}
-	else if (a.first.has_value() && b.second.has_value()) {
-		return std::make_pair(a.first.value() / *b.second.value(), std::nullopt);
+	if (a.is_tensor() && b.is_tensor()) {
+		return a.tensor() / b.tensor();
 	}
-	else if (a.second.has_value() && b.first.has_value()) {
-		return std::make_pair(*a.second.value() / b.first.value(), std::nullopt);
+	else if (a.is_tensor() && b.is_scalar()) {
+		return a.tensor() / b.scalar();
 	}
-	else if (a.second.has_value() && b.second.has_value()) {
-		return std::make_pair(std::nullopt, *a.second.value() / *b.second.value());
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	else if (a.is_scalar() && b.is_tensor()) {
+		return a.scalar() / b.tensor();
 	}
+	return a.scalar() / b.scalar();
 }
 
-tc::expression::DivNode::DivNode(std::unique_ptr<Node> left_child, std::unique_ptr<Node> right_child)
+tc::expression::DivNode::DivNode(std::shared_ptr<Node> left_child, std::shared_ptr<Node> right_child)
 {
 	m_Children.resize(2);
 	m_Children[0] = std::move(left_child);
@@ -440,6 +606,18 @@ tc::expression::tentok tc::expression::DivNode::eval()
 	return l / r;
 }
 
+void tc::expression::DivNode::eval_into(torch::Tensor& out)
+{
+	auto l = m_Children[0]->eval();
+	auto r = m_Children[1]->eval();
+
+	if (l.is_tensor() && r.is_tensor() && out_fits(out, l.tensor(), r.tensor())) {
+		torch::div_out(out, l.tensor(), r.tensor());
+		return;
+	}
+	tentok_into(l / r, out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::DivNode::evalnode()
 {
 	auto l = m_Children[0]->evalnode();
@@ -459,44 +637,40 @@ tc::expression::tentok tc::expression::DivNode::diff(const VariableToken& var)
 	return (dl * r - l * dr) / square(r);
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::DivNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::DivNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
-	auto l = m_Children[0]->evalnode();
-	auto dl = m_Children[0]->diffnode(var);
-
-	auto r = m_Children[1]->evalnode();
-	auto r2 = m_Children[1]->evalnode();
-	auto dr = m_Children[1]->diffnode(var);
+	auto& l = m_Children[0];
+	auto& r = m_Children[1];
 
-	auto dlr = std::make_unique<MulNode>(std::move(dl), std::move(r));
-	auto ldr = std::make_unique<MulNode>(std::move(l), std::move(dr));
+	auto dlr = std::make_unique<MulNode>(derivative(l, var, memo), r);
+	auto ldr = std::make_unique<MulNode>(l, derivative(r, var, memo));
 	auto dife = std::make_unique<SubNode>(std::move(dlr), std::move(ldr));
 
-	return std::make_unique<DivNode>(std::move(dife), std::make_unique<SquareNode>(std::move(r2)));
+	return std::make_unique<DivNode>(std::move(dife), std::make_unique<SquareNode>(r));
+}
+
+std::int32_t tc::expression::DivNode::get_node_type() const
+{
+	return NodeType::DIV_NODE;
 }
 
 // <================================== ADD ===================================>
 
 tc::expression::tentok tc::expression::operator+(const tentok& a, const tentok& b)
 {
-	if (a.first.has_value() && b.first.has_value()) {
-		return std::make_pair(a.first.value() + b.first.value(), std::nullopt);
+	if (a.is_tensor() && b.is_tensor()) {
+		return a.tensor() + b.tensor();
 	}
-	else if (a.first.has_value() && b.second.has_value()) {
-		return std::make_pair(a.first.value() + *b.second.value(), std::nullopt);
+	else if (a.is_tensor() && b.is_scalar()) {
+		return a.tensor() + b.scalar();
 	}
-	else if (a.second.has_value() && b.first.has_value()) {
-		return std::make_pair(*a.second.value() + b.first.value(), std::nullopt);
-	}
-	else if (a.second.has_value() && b.second.has_value()) {
-		return std::make_pair(std::nullopt, *a.second.value() + *b.second.value());
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	else if (a.is_scalar() && b.is_tensor()) {
+		return a.scalar() + b.tensor();
 	}
+	return a.scalar() + b.scalar();
 }
 
-tc::expression::AddNode::AddNode(std::unique_ptr<Node> left_child, std::unique_ptr<Node> right_child)
+tc::expression::AddNode::AddNode(std::shared_ptr<Node> left_child, std::shared_ptr<Node> right_child)
 {
 	m_Children.resize(2);
 	m_Children[0] = std::move(left_child);
@@ -511,6 +685,18 @@ tc::expression::tentok tc::expression::AddNode::eval()
 	return l + r;
 }
 
+void tc::expression::AddNode::eval_into(torch::Tensor& out)
+{
+	auto l = m_Children[0]->eval();
+	auto r = m_Children[1]->eval();
+
+	if (l.is_tensor() && r.is_tensor() && out_fits(out, l.tensor(), r.tensor())) {
+		torch::add_out(out, l.tensor(), r.tensor());
+		return;
+	}
+	tentok_into(l + r, out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::AddNode::evalnode()
 {
 	return std::make_unique<AddNode>(m_Children[0]->evalnode(), m_Children[1]->evalnode());
@@ -524,33 +710,33 @@ tc::expression::tentok tc::expression::AddNode::diff(const VariableToken& var)
 	return l + r;
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::AddNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::AddNode::diffnode(const VariableToken& var, DiffMemo& memo)
+{
+	return std::make_unique<AddNode>(derivative(m_Children[0], var, memo), derivative(m_Children[1], var, memo));
+}
+
+std::int32_t tc::expression::AddNode::get_node_type() const
 {
-	return std::make_unique<AddNode>(m_Children[0]->diffnode(var), m_Children[1]->diffnode(var));
+	return NodeType::ADD_NODE;
 }
 
 // <================================== SUB ===================================>
 
 tc::expression::tentok tc::expression::operator-(const tentok& a, const tentok& b)
 {
-	if (a.first.has_value() && b.first.has_value()) {
-		return std::make_pair(a.first.value() - b.first.value(), std::nullopt);
+	if (a.is_tensor() && b.is_tensor()) {
+		return a.tensor() - b.tensor();
 	}
-	else if (a.first.has_value() && b.second.has_value()) {
-		return std::make_pair(a.first.value() - *b.second.value(), std::nullopt);
+	else if (a.is_tensor() && b.is_scalar()) {
+		return a.tensor() - b.scalar();
 	}
-	else if (a.second.has_value() && b.first.has_value()) {
-		return std::make_pair(*a.second.value() - b.first.value(), std::nullopt);
-	}
-	else if (a.second.has_value() && b.second.has_value()) {
-		return std::make_pair(std::nullopt, *a.second.value() - *b.second.value());
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	else if (a.is_scalar() && b.is_tensor()) {
+		return a.scalar() - b.tensor();
 	}
+	return a.scalar() - b.scalar();
 }
 
-tc::expression::SubNode::SubNode(std::unique_ptr<Node> left_child, std::unique_ptr<Node> right_child)
+tc::expression::SubNode::SubNode(std::shared_ptr<Node> left_child, std::shared_ptr<Node> right_child)
 {
 	m_Children.resize(2);
 	m_Children[0] = std::move(left_child);
@@ -565,6 +751,18 @@ tc::expression::tentok tc::expression::SubNode::eval()
 	return l - r;
 }
 
+void tc::expression::SubNode::eval_into(torch::Tensor& out)
+{
+	auto l = m_Children[0]->eval();
+	auto r = m_Children[1]->eval();
+
+	if (l.is_tensor() && r.is_tensor() && out_fits(out, l.tensor(), r.tensor())) {
+		torch::sub_out(out, l.tensor(), r.tensor());
+		return;
+	}
+	tentok_into(l - r, out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::SubNode::evalnode()
 {
 	return std::make_unique<SubNode>(m_Children[0]->evalnode(), m_Children[1]->evalnode());
@@ -578,33 +776,33 @@ tc::expression::tentok tc::expression::SubNode::diff(const VariableToken& var)
 	return l - r;
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::SubNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::SubNode::diffnode(const VariableToken& var, DiffMemo& memo)
+{
+	return std::make_unique<SubNode>(derivative(m_Children[0], var, memo), derivative(m_Children[1], var, memo));
+}
+
+std::int32_t tc::expression::SubNode::get_node_type() const
 {
-	return std::make_unique<SubNode>(m_Children[0]->diffnode(var), m_Children[1]->diffnode(var));
+	return NodeType::SUB_NODE;
 }
 
 // <================================== POW ===================================>
 
 tc::expression::tentok tc::expression::pow(const tentok& a, const tentok& b)
 {
-	if (a.first.has_value() && b.first.has_value()) {
-		return std::make_pair(pow(a.first.value(), b.first.value()), std::nullopt);
+	if (a.is_tensor() && b.is_tensor()) {
+		return pow(a.tensor(), b.tensor());
 	}
-	else if (a.first.has_value() && b.second.has_value()) {
-		return std::make_pair(pow(a.first.value(), *b.second.value()), std::nullopt);
+	else if (a.is_tensor() && b.is_scalar()) {
+		return pow(a.tensor(), b.scalar());
 	}
-	else if (a.second.has_value() && b.first.has_value()) {
-		return std::make_pair(pow(*a.second.value(), b.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value() && b.second.has_value()) {
-		return std::make_pair(std::nullopt, pow(*a.second.value(), *b.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	else if (a.is_scalar() && b.is_tensor()) {
+		return pow(a.scalar(), b.tensor());
 	}
+	return pow(a.scalar(), b.scalar());
 }
 
-tc::expression::PowNode::PowNode(std::unique_ptr<Node> left_child, std::unique_ptr<Node> right_child)
+tc::expression::PowNode::PowNode(std::shared_ptr<Node> left_child, std::shared_ptr<Node> right_child)
 {
 	m_Children.resize(2);
 	m_Children[0] = std::move(left_child);
@@ -619,6 +817,18 @@ tc::expression::tentok tc::expression::PowNode::eval()
 	return pow(l,r);
 }
 
+void tc::expression::PowNode::eval_into(torch::Tensor& out)
+{
+	auto l = m_Children[0]->eval();
+	auto r = m_Children[1]->eval();
+
+	if (l.is_tensor() && r.is_tensor() && out_fits(out, l.tensor(), r.tensor())) {
+		torch::pow_out(out, l.tensor(), r.tensor());
+		return;
+	}
+	tentok_into(pow(l, r), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::PowNode::evalnode()
 {
 	return std::make_unique<PowNode>(m_Children[0]->evalnode(), m_Children[1]->evalnode());
@@ -638,42 +848,35 @@ tc::expression::tentok tc::expression::PowNode::diff(const VariableToken& var)
 	return pow(l, r) * (dr * log(l) + r * dl / l);
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::PowNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::PowNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
-	auto l1 = m_Children[0]->evalnode();
-	auto l2 = m_Children[0]->evalnode();
-	auto l3 = m_Children[0]->evalnode();
-
-	auto dl = m_Children[0]->diffnode(var);
+	auto& l = m_Children[0];
+	auto& r = m_Children[1];
 
-	auto r1 = m_Children[1]->evalnode();
-	auto r2 = m_Children[1]->evalnode();
-	auto dr = m_Children[1]->diffnode(var);
-
-	auto pow = std::make_unique<PowNode>(std::move(l1), std::move(r1));
-	auto left = std::make_unique<MulNode>(std::move(dr), std::make_unique<LogNode>(std::move(l2)));
-	auto right = std::make_unique<MulNode>(std::move(r2), std::make_unique<DivNode>(std::move(dl), std::move(l3)));
+	auto pow = std::make_unique<PowNode>(l, r);
+	auto left = std::make_unique<MulNode>(derivative(r, var, memo), std::make_unique<LogNode>(l));
+	auto right = std::make_unique<MulNode>(r, std::make_unique<DivNode>(derivative(l, var, memo), l));
 	auto add = std::make_unique<AddNode>(std::move(left), std::move(right));
 	return std::make_unique<MulNode>(std::move(pow), std::move(add));
 }
 
+std::int32_t tc::expression::PowNode::get_node_type() const
+{
+	return NodeType::POW_NODE;
+}
+
 
 // <================================== SIGN ===================================>
 
 tc::expression::tentok tc::expression::sgn(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::sgn(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, abs(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::sgn(a.tensor());
 	}
+	return sgn(a.scalar());
 }
 
-tc::expression::SgnNode::SgnNode(std::unique_ptr<Node> child)
+tc::expression::SgnNode::SgnNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -683,6 +886,17 @@ tc::expression::tentok tc::expression::SgnNode::eval()
 	return sgn(m_Children[0]->eval());
 }
 
+void tc::expression::SgnNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::sgn_out(out, in.tensor());
+		return;
+	}
+	tentok_into(sgn(in), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::SgnNode::evalnode()
 {
 	return std::make_unique<SgnNode>(m_Children[0]->evalnode());
@@ -693,27 +907,27 @@ tc::expression::tentok tc::expression::SgnNode::diff(const VariableToken& var)
 	return tentok_from_zero() / m_Children[0]->eval();
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::SgnNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::SgnNode::diffnode(const VariableToken& var, DiffMemo& memo)
+{
+	return std::make_unique<DivNode>(std::make_unique<TokenNode>(ZeroToken()), m_Children[0]);
+}
+
+std::int32_t tc::expression::SgnNode::get_node_type() const
 {
-	return std::make_unique<tc::expression::DivNode>(std::make_unique<TokenNode>(ZeroToken()), evalnode());
+	return NodeType::SGN_NODE;
 }
 
 // <================================== ABS ===================================>
 
 tc::expression::tentok tc::expression::abs(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::abs(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, abs(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::abs(a.tensor());
 	}
+	return abs(a.scalar());
 }
 
-tc::expression::AbsNode::AbsNode(std::unique_ptr<Node> child)
+tc::expression::AbsNode::AbsNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -723,6 +937,17 @@ tc::expression::tentok tc::expression::AbsNode::eval()
 	return abs(m_Children[0]->eval());
 }
 
+void tc::expression::AbsNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::abs_out(out, in.tensor());
+		return;
+	}
+	tentok_into(abs(in), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::AbsNode::evalnode()
 {
 	return std::make_unique<AbsNode>(m_Children[0]->evalnode());
@@ -736,28 +961,28 @@ tc::expression::tentok tc::expression::AbsNode::diff(const VariableToken& var)
 	return din * sgn(in);
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::AbsNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::AbsNode::diffnode(const VariableToken& var, DiffMemo& memo)
+{
+	return std::make_unique<MulNode>(derivative(m_Children[0], var, memo),
+		std::make_unique<SgnNode>(m_Children[0]));
+}
+
+std::int32_t tc::expression::AbsNode::get_node_type() const
 {
-	return std::make_unique<MulNode>(m_Children[0]->diffnode(var),
-		std::make_unique<SgnNode>(m_Children[0]->evalnode()));
+	return NodeType::ABS_NODE;
 }
 
 // <================================== SQRT ===================================>
 
 tc::expression::tentok tc::expression::sqrt(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::sqrt(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, sqrt(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::sqrt(a.tensor());
 	}
+	return sqrt(a.scalar());
 }
 
-tc::expression::SqrtNode::SqrtNode(std::unique_ptr<Node> child)
+tc::expression::SqrtNode::SqrtNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -767,6 +992,17 @@ tc::expression::tentok tc::expression::SqrtNode::eval()
 	return sqrt(m_Children[0]->eval());
 }
 
+void tc::expression::SqrtNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::sqrt_out(out, in.tensor());
+		return;
+	}
+	tentok_into(sqrt(in), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::SqrtNode::evalnode()
 {
 	return std::make_unique<SqrtNode>(m_Children[0]->evalnode());
@@ -780,29 +1016,29 @@ tc::expression::tentok tc::expression::SqrtNode::diff(const VariableToken& var)
 	return tentok_from_number(0.5f) * din / sqrt(in);
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::SqrtNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::SqrtNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
-	auto mul = std::make_unique<MulNode>(std::make_unique<TokenNode>(from_number(0.5f)), m_Children[0]->diffnode(var));
-	return std::make_unique<DivNode>(std::move(mul), m_Children[0]->evalnode());
+	auto mul = std::make_unique<MulNode>(std::make_unique<TokenNode>(from_number(0.5f)), derivative(m_Children[0], var, memo));
+	return std::make_unique<DivNode>(std::move(mul), std::make_unique<SqrtNode>(m_Children[0]));
+}
+
+std::int32_t tc::expression::SqrtNode::get_node_type() const
+{
+	return NodeType::SQRT_NODE;
 }
 
 // <================================== SQUARE ===================================>
 
 tc::expression::tentok tc::expression::square(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::square(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, square(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::square(a.tensor());
 	}
+	return square(a.scalar());
 }
 
 
-tc::expression::SquareNode::SquareNode(std::unique_ptr<Node> child)
+tc::expression::SquareNode::SquareNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -812,6 +1048,17 @@ tc::expression::tentok tc::expression::SquareNode::eval()
 	return square(m_Children[0]->eval());
 }
 
+void tc::expression::SquareNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::pow_out(out, in.tensor(), 2);
+		return;
+	}
+	tentok_into(square(in), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::SquareNode::evalnode()
 {
 	return std::make_unique<SquareNode>(m_Children[0]->evalnode());
@@ -822,30 +1069,30 @@ tc::expression::tentok tc::expression::SquareNode::diff(const VariableToken& var
 	return tentok_from_number(2.0f) * m_Children[0]->eval() * m_Children[0]->diff(var);
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::SquareNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::SquareNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
 	auto two = std::make_unique<TokenNode>(from_number(2.0f));
-	auto two_child = std::make_unique<MulNode>(std::move(two), std::move(m_Children[0]->evalnode()));
+	auto two_child = std::make_unique<MulNode>(std::move(two), m_Children[0]);
+
+	return std::make_unique<MulNode>(std::move(two_child), derivative(m_Children[0], var, memo));
+}
 
-	return std::make_unique<MulNode>(std::move(two_child), std::move(m_Children[0]->diffnode(var)));
+std::int32_t tc::expression::SquareNode::get_node_type() const
+{
+	return NodeType::SQUARE_NODE;
 }
 
 // <================================== EXP ===================================>
 
 tc::expression::tentok tc::expression::exp(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::exp(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, exp(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::exp(a.tensor());
 	}
+	return exp(a.scalar());
 }
 
-tc::expression::ExpNode::ExpNode(std::unique_ptr<Node> child)
+tc::expression::ExpNode::ExpNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -855,6 +1102,17 @@ tc::expression::tentok tc::expression::ExpNode::eval()
 	return exp(m_Children[0]->eval());
 }
 
+void tc::expression::ExpNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::exp_out(out, in.tensor());
+		return;
+	}
+	tentok_into(exp(in), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::ExpNode::evalnode()
 {
 	return std::make_unique<ExpNode>(m_Children[0]->evalnode());
@@ -865,28 +1123,28 @@ tc::expression::tentok tc::expression::ExpNode::diff(const VariableToken& var)
 	return exp(m_Children[0]->eval()) * m_Children[0]->diff(var);
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::ExpNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::ExpNode::diffnode(const VariableToken& var, DiffMemo& memo)
+{
+	auto exp = std::make_unique<ExpNode>(m_Children[0]);
+	return std::make_unique<MulNode>(std::move(exp), derivative(m_Children[0], var, memo));
+}
+
+std::int32_t tc::expression::ExpNode::get_node_type() const
 {
-	auto exp = std::make_unique<ExpNode>(m_Children[0]->evalnode());
-	return std::make_unique<MulNode>(std::move(exp), m_Children[0]->diffnode(var));
+	return NodeType::EXP_NODE;
 }
 
 // <================================== LOG ===================================>
 
 tc::expression::tentok tc::expression::log(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::log(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, log(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::log(a.tensor());
 	}
+	return log(a.scalar());
 }
 
-tc::expression::LogNode::LogNode(std::unique_ptr<Node> child)
+tc::expression::LogNode::LogNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -896,9 +1154,20 @@ tc::expression::tentok tc::expression::LogNode::eval()
 	return log(m_Children[0]->eval());
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::LogNode::evalnode()
+void tc::expression::LogNode::eval_into(torch::Tensor& out)
 {
-	return std::make_unique<LogNode>(m_Children[0]->evalnode());
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::log_out(out, in.tensor());
+		return;
+	}
+	tentok_into(log(in), out);
+}
+
+std::unique_ptr<tc::expression::Node> tc::expression::LogNode::evalnode()
+{
+	return std::make_unique<LogNode>(m_Children[0]->evalnode());
 }
 
 tc::expression::tentok tc::expression::LogNode::diff(const VariableToken& var)
@@ -906,27 +1175,27 @@ tc::expression::tentok tc::expression::LogNode::diff(const VariableToken& var)
 	return m_Children[0]->diff(var) / m_Children[0]->eval();
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::LogNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::LogNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
-	return std::make_unique<DivNode>(m_Children[0]->evalnode(), m_Children[0]->diffnode(var));
+	return std::make_unique<DivNode>(derivative(m_Children[0], var, memo), m_Children[0]);
+}
+
+std::int32_t tc::expression::LogNode::get_node_type() const
+{
+	return NodeType::LOG_NODE;
 }
 
 // <================================== SIN ===================================>
 
 tc::expression::tentok tc::expression::sin(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::sin(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, sin(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::sin(a.tensor());
 	}
+	return sin(a.scalar());
 }
 
-tc::expression::SinNode::SinNode(std::unique_ptr<Node> child)
+tc::expression::SinNode::SinNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -936,6 +1205,17 @@ tc::expression::tentok tc::expression::SinNode::eval()
 	return sin(m_Children[0]->eval());
 }
 
+void tc::expression::SinNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::sin_out(out, in.tensor());
+		return;
+	}
+	tentok_into(sin(in), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::SinNode::evalnode()
 {
 	return std::make_unique<SinNode>(m_Children[0]->evalnode());
@@ -946,27 +1226,27 @@ tc::expression::tentok tc::expression::SinNode::diff(const VariableToken& var)
 	return m_Children[0]->diff(var) * cos(m_Children[0]->eval());
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::SinNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::SinNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
-	return std::make_unique<MulNode>(m_Children[0]->diffnode(var), std::make_unique<CosNode>(m_Children[0]->evalnode()));
+	return std::make_unique<MulNode>(derivative(m_Children[0], var, memo), std::make_unique<CosNode>(m_Children[0]));
+}
+
+std::int32_t tc::expression::SinNode::get_node_type() const
+{
+	return NodeType::SIN_NODE;
 }
 
 // <================================== COS ===================================>
 
 tc::expression::tentok tc::expression::cos(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::cos(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, cos(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::cos(a.tensor());
 	}
+	return cos(a.scalar());
 }
 
-tc::expression::CosNode::CosNode(std::unique_ptr<Node> child)
+tc::expression::CosNode::CosNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -976,6 +1256,17 @@ tc::expression::tentok tc::expression::CosNode::eval()
 	return cos(m_Children[0]->eval());
 }
 
+void tc::expression::CosNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::cos_out(out, in.tensor());
+		return;
+	}
+	tentok_into(cos(in), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::CosNode::evalnode()
 {
 	return std::make_unique<CosNode>(m_Children[0]->evalnode());
@@ -986,29 +1277,29 @@ tc::expression::tentok tc::expression::CosNode::diff(const VariableToken& var)
 	return -m_Children[0]->diff(var) * sin(m_Children[0]->eval());
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::CosNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::CosNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
-	auto l = std::make_unique<NegNode>(m_Children[0]->diffnode(var));
-	auto sinc = std::make_unique<SinNode>(m_Children[0]->evalnode());
+	auto l = std::make_unique<NegNode>(derivative(m_Children[0], var, memo));
+	auto sinc = std::make_unique<SinNode>(m_Children[0]);
 	return std::make_unique<MulNode>(std::move(l), std::move(sinc));
 }
 
+std::int32_t tc::expression::CosNode::get_node_type() const
+{
+	return NodeType::COS_NODE;
+}
+
 // <================================== TAN ===================================>
 
 tc::expression::tentok tc::expression::tan(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::tan(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, tan(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::tan(a.tensor());
 	}
+	return tan(a.scalar());
 }
 
-tc::expression::TanNode::TanNode(std::unique_ptr<Node> child)
+tc::expression::TanNode::TanNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -1018,6 +1309,17 @@ tc::expression::tentok tc::expression::TanNode::eval()
 	return tan(m_Children[0]->eval());
 }
 
+void tc::expression::TanNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::tan_out(out, in.tensor());
+		return;
+	}
+	tentok_into(tan(in), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::TanNode::evalnode()
 {
 	return std::make_unique<TanNode>(m_Children[0]->evalnode());
@@ -1031,29 +1333,29 @@ tc::expression::tentok tc::expression::TanNode::diff(const VariableToken& var)
 	return din / square(cos(in));
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::TanNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::TanNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
-	auto cin = std::make_unique<CosNode>(m_Children[0]->evalnode());
+	auto cin = std::make_unique<CosNode>(m_Children[0]);
 	auto scin = std::make_unique<SquareNode>(std::move(cin));
-	return std::make_unique<DivNode>(m_Children[0]->diffnode(var), std::move(scin));
+	return std::make_unique<DivNode>(derivative(m_Children[0], var, memo), std::move(scin));
+}
+
+std::int32_t tc::expression::TanNode::get_node_type() const
+{
+	return NodeType::TAN_NODE;
 }
 
 // <================================== ASIN ===================================>
 
 tc::expression::tentok tc::expression::asin(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::asin(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, asin(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::asin(a.tensor());
 	}
+	return asin(a.scalar());
 }
 
-tc::expression::AsinNode::AsinNode(std::unique_ptr<Node> child)
+tc::expression::AsinNode::AsinNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -1063,6 +1365,17 @@ tc::expression::tentok tc::expression::AsinNode::eval()
 	return asin(m_Children[0]->eval());
 }
 
+void tc::expression::AsinNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::asin_out(out, in.tensor());
+		return;
+	}
+	tentok_into(asin(in), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::AsinNode::evalnode()
 {
 	return std::make_unique<AsinNode>(m_Children[0]->evalnode());
@@ -1076,32 +1389,32 @@ tc::expression::tentok tc::expression::AsinNode::diff(const VariableToken& var)
 	return din / sqrt(tentok_from_unity() - square(in));
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::AsinNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::AsinNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
 	auto unity = std::make_unique<TokenNode>(UnityToken());
-	auto square = std::make_unique<SquareNode>(m_Children[0]->evalnode());
+	auto square = std::make_unique<SquareNode>(m_Children[0]);
 	auto dife = std::make_unique<SubNode>(std::move(unity), std::move(square));
 	auto sqrt = std::make_unique<SqrtNode>(std::move(dife));
 
-	return std::make_unique<DivNode>(m_Children[0]->diffnode(var), std::move(sqrt));
+	return std::make_unique<DivNode>(derivative(m_Children[0], var, memo), std::move(sqrt));
+}
+
+std::int32_t tc::expression::AsinNode::get_node_type() const
+{
+	return NodeType::ASIN_NODE;
 }
 
 // <================================== ACOS ===================================>
 
 tc::expression::tentok tc::expression::acos(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::acos(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, acos(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::acos(a.tensor());
 	}
+	return acos(a.scalar());
 }
 
-tc::expression::AcosNode::AcosNode(std::unique_ptr<Node> child)
+tc::expression::AcosNode::AcosNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -1111,6 +1424,17 @@ tc::expression::tentok tc::expression::AcosNode::eval()
 	return acos(m_Children[0]->eval());
 }
 
+void tc::expression::AcosNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::acos_out(out, in.tensor());
+		return;
+	}
+	tentok_into(acos(in), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::AcosNode::evalnode()
 {
 	return std::make_unique<AcosNode>(m_Children[0]->evalnode());
@@ -1124,28 +1448,32 @@ tc::expression::tentok tc::expression::AcosNode::diff(const VariableToken& var)
 	return -din / sqrt(tentok_from_unity() - square(in));
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::AcosNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::AcosNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
-	auto acos = evalnode();
-	return std::make_unique<NegNode>(std::move(acos));
+	auto unity = std::make_unique<TokenNode>(UnityToken());
+	auto square = std::make_unique<SquareNode>(m_Children[0]);
+	auto dife = std::make_unique<SubNode>(std::move(unity), std::move(square));
+	auto sqrt = std::make_unique<SqrtNode>(std::move(dife));
+
+	return std::make_unique<NegNode>(std::make_unique<DivNode>(derivative(m_Children[0], var, memo), std::move(sqrt)));
+}
+
+std::int32_t tc::expression::AcosNode::get_node_type() const
+{
+	return NodeType::ACOS_NODE;
 }
 
 // <================================== ATAN ===================================>
 
 tc::expression::tentok tc::expression::atan(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::atan(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, atan(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::atan(a.tensor());
 	}
+	return atan(a.scalar());
 }
 
-tc::expression::AtanNode::AtanNode(std::unique_ptr<Node> child)
+tc::expression::AtanNode::AtanNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -1155,6 +1483,17 @@ tc::expression::tentok tc::expression::AtanNode::eval()
 	return atan(m_Children[0]->eval());
 }
 
+void tc::expression::AtanNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::atan_out(out, in.tensor());
+		return;
+	}
+	tentok_into(atan(in), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::AtanNode::evalnode()
 {
 	return std::make_unique<AtanNode>(m_Children[0]->evalnode());
@@ -1168,38 +1507,49 @@ tc::expression::tentok tc::expression::AtanNode::diff(const VariableToken& var)
 	return din / (tentok_from_unity() + square(in));
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::AtanNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::AtanNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
 	auto unity = std::make_unique<TokenNode>(UnityToken());
-	auto square = std::make_unique<SquareNode>(m_Children[0]->evalnode());
+	auto square = std::make_unique<SquareNode>(m_Children[0]);
 	auto dife = std::make_unique<AddNode>(std::move(unity), std::move(square));
 
-	return std::make_unique<DivNode>(std::move(m_Children[0]->diffnode(var)), std::move(dife));
+	return std::make_unique<DivNode>(derivative(m_Children[0], var, memo), std::move(dife));
+}
+
+std::int32_t tc::expression::AtanNode::get_node_type() const
+{
+	return NodeType::ATAN_NODE;
 }
 
 // <================================== SINH ===================================>
 
 tc::expression::tentok tc::expression::sinh(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::sinh(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, sinh(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::sinh(a.tensor());
 	}
+	return sinh(a.scalar());
 }
 
-tc::expression::SinhNode::SinhNode(std::unique_ptr<Node> child)
+tc::expression::SinhNode::SinhNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
 
 tc::expression::tentok tc::expression::SinhNode::eval()
 {
-	return asin(m_Children[0]->eval());
+	return sinh(m_Children[0]->eval());
+}
+
+void tc::expression::SinhNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::sinh_out(out, in.tensor());
+		return;
+	}
+	tentok_into(sinh(in), out);
 }
 
 std::unique_ptr<tc::expression::Node> tc::expression::SinhNode::evalnode()
@@ -1215,28 +1565,28 @@ tc::expression::tentok tc::expression::SinhNode::diff(const VariableToken& var)
 	return din * cosh(in);
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::SinhNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::SinhNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
-	return std::make_unique<MulNode>(std::move(m_Children[0]->diffnode(var)),
-		std::make_unique<CoshNode>(std::move(m_Children[0]->evalnode())));
+	return std::make_unique<MulNode>(derivative(m_Children[0], var, memo),
+		std::make_unique<CoshNode>(m_Children[0]));
+}
+
+std::int32_t tc::expression::SinhNode::get_node_type() const
+{
+	return NodeType::SINH_NODE;
 }
 
 // <================================== COSH ===================================>
 
 tc::expression::tentok tc::expression::cosh(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::cosh(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, cosh(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::cosh(a.tensor());
 	}
+	return cosh(a.scalar());
 }
 
-tc::expression::CoshNode::CoshNode(std::unique_ptr<Node> child)
+tc::expression::CoshNode::CoshNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -1246,6 +1596,17 @@ tc::expression::tentok tc::expression::CoshNode::eval()
 	return cosh(m_Children[0]->eval());
 }
 
+void tc::expression::CoshNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::cosh_out(out, in.tensor());
+		return;
+	}
+	tentok_into(cosh(in), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::CoshNode::evalnode()
 {
 	return std::make_unique<CoshNode>(std::move(m_Children[0]->evalnode()));
@@ -1259,28 +1620,28 @@ tc::expression::tentok tc::expression::CoshNode::diff(const VariableToken& var)
 	return din * sinh(in);
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::CoshNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::CoshNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
-	return std::make_unique<MulNode>(std::move(m_Children[0]->diffnode(var)),
-		std::make_unique<SinhNode>(std::move(m_Children[0]->evalnode())));
+	return std::make_unique<MulNode>(derivative(m_Children[0], var, memo),
+		std::make_unique<SinhNode>(m_Children[0]));
+}
+
+std::int32_t tc::expression::CoshNode::get_node_type() const
+{
+	return NodeType::COSH_NODE;
 }
 
 // <================================== TANH ===================================>
 
 tc::expression::tentok tc::expression::tanh(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::tanh(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, tanh(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::tanh(a.tensor());
 	}
+	return tanh(a.scalar());
 }
 
-tc::expression::TanhNode::TanhNode(std::unique_ptr<Node> child)
+tc::expression::TanhNode::TanhNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -1290,6 +1651,17 @@ tc::expression::tentok tc::expression::TanhNode::eval()
 	return tanh(m_Children[0]->eval());
 }
 
+void tc::expression::TanhNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::tanh_out(out, in.tensor());
+		return;
+	}
+	tentok_into(tanh(in), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::TanhNode::evalnode()
 {
 	return std::make_unique<TanhNode>(std::move(m_Children[0]->evalnode()));
@@ -1303,28 +1675,28 @@ tc::expression::tentok tc::expression::TanhNode::diff(const VariableToken& var)
 	return din / square(cosh(in));
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::TanhNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::TanhNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
-	auto square = std::make_unique<SquareNode>(std::make_unique<CoshNode>(std::move(m_Children[0]->evalnode())));
-	return std::make_unique<DivNode>(std::move(m_Children[0]->diffnode(var)), std::move(square));
+	auto square = std::make_unique<SquareNode>(std::make_unique<CoshNode>(m_Children[0]));
+	return std::make_unique<DivNode>(derivative(m_Children[0], var, memo), std::move(square));
+}
+
+std::int32_t tc::expression::TanhNode::get_node_type() const
+{
+	return NodeType::TANH_NODE;
 }
 
 // <================================== ASINH ===================================>
 
 tc::expression::tentok tc::expression::asinh(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::asinh(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, asinh(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::asinh(a.tensor());
 	}
+	return asinh(a.scalar());
 }
 
-tc::expression::AsinhNode::AsinhNode(std::unique_ptr<Node> child)
+tc::expression::AsinhNode::AsinhNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -1334,6 +1706,17 @@ tc::expression::tentok tc::expression::AsinhNode::eval()
 	return asinh(m_Children[0]->eval());
 }
 
+void tc::expression::AsinhNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::asinh_out(out, in.tensor());
+		return;
+	}
+	tentok_into(asinh(in), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::AsinhNode::evalnode()
 {
 	return std::make_unique<AsinhNode>(std::move(m_Children[0]->evalnode()));
@@ -1347,30 +1730,30 @@ tc::expression::tentok tc::expression::AsinhNode::diff(const VariableToken& var)
 	return din / sqrt(square(in)+tentok_from_unity());
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::AsinhNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::AsinhNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
-	auto square = std::make_unique<SquareNode>(m_Children[0]->evalnode());
+	auto square = std::make_unique<SquareNode>(m_Children[0]);
 	auto add = std::make_unique<AddNode>(std::move(square), std::make_unique<TokenNode>(UnityToken()));
 	auto sqrt = std::make_unique<SqrtNode>(std::move(add));
-	return std::make_unique<DivNode>(std::move(m_Children[0]->diffnode(var)), std::move(sqrt));
+	return std::make_unique<DivNode>(derivative(m_Children[0], var, memo), std::move(sqrt));
+}
+
+std::int32_t tc::expression::AsinhNode::get_node_type() const
+{
+	return NodeType::ASINH_NODE;
 }
 
 // <================================== ACOSH ===================================>
 
 tc::expression::tentok tc::expression::acosh(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::acosh(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, acosh(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::acosh(a.tensor());
 	}
+	return acosh(a.scalar());
 }
 
-tc::expression::AcoshNode::AcoshNode(std::unique_ptr<Node> child)
+tc::expression::AcoshNode::AcoshNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -1380,6 +1763,17 @@ tc::expression::tentok tc::expression::AcoshNode::eval()
 	return acosh(m_Children[0]->eval());
 }
 
+void tc::expression::AcoshNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::acosh_out(out, in.tensor());
+		return;
+	}
+	tentok_into(acosh(in), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::AcoshNode::evalnode()
 {
 	return std::make_unique<AcoshNode>(std::move(m_Children[0]->evalnode()));
@@ -1393,30 +1787,30 @@ tc::expression::tentok tc::expression::AcoshNode::diff(const VariableToken& var)
 	return din / sqrt(square(in) - tentok_from_unity());
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::AcoshNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::AcoshNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
-	auto square = std::make_unique<SquareNode>(m_Children[0]->evalnode());
+	auto square = std::make_unique<SquareNode>(m_Children[0]);
 	auto sub = std::make_unique<SubNode>(std::move(square), std::make_unique<TokenNode>(UnityToken()));
 	auto sqrt = std::make_unique<SqrtNode>(std::move(sub));
-	return std::make_unique<DivNode>(m_Children[0]->diffnode(var), std::move(sqrt));
+	return std::make_unique<DivNode>(derivative(m_Children[0], var, memo), std::move(sqrt));
+}
+
+std::int32_t tc::expression::AcoshNode::get_node_type() const
+{
+	return NodeType::ACOSH_NODE;
 }
 
 // <================================== ATANH ===================================>
 
 tc::expression::tentok tc::expression::atanh(const tentok& a)
 {
-	if (a.first.has_value()) {
-		return std::make_pair(torch::atanh(a.first.value()), std::nullopt);
-	}
-	else if (a.second.has_value()) {
-		return std::make_pair(std::nullopt, atanh(*a.second.value()));
-	}
-	else {
-		throw std::runtime_error("more than two eval() optionals was nullopt");
+	if (a.is_tensor()) {
+		return torch::atanh(a.tensor());
 	}
+	return atanh(a.scalar());
 }
 
-tc::expression::AtanhNode::AtanhNode(std::unique_ptr<Node> child)
+tc::expression::AtanhNode::AtanhNode(std::shared_ptr<Node> child)
 {
 	m_Children.push_back(std::move(child));
 }
@@ -1426,6 +1820,17 @@ tc::expression::tentok tc::expression::AtanhNode::eval()
 	return atanh(m_Children[0]->eval());
 }
 
+void tc::expression::AtanhNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::atanh_out(out, in.tensor());
+		return;
+	}
+	tentok_into(atanh(in), out);
+}
+
 std::unique_ptr<tc::expression::Node> tc::expression::AtanhNode::evalnode()
 {
 	return std::make_unique<AtanhNode>(m_Children[0]->evalnode());
@@ -1439,9 +1844,383 @@ tc::expression::tentok tc::expression::AtanhNode::diff(const VariableToken& var)
 	return din / (tentok_from_unity() - square(in));
 }
 
-std::unique_ptr<tc::expression::Node> tc::expression::AtanhNode::diffnode(const VariableToken& var)
+std::shared_ptr<tc::expression::Node> tc::expression::AtanhNode::diffnode(const VariableToken& var, DiffMemo& memo)
 {
-	auto square = std::make_unique<SquareNode>(m_Children[0]->evalnode());
+	auto square = std::make_unique<SquareNode>(m_Children[0]);
 	auto sub = std::make_unique<SubNode>(std::make_unique<TokenNode>(UnityToken()), std::move(square));
-	return std::make_unique<DivNode>(m_Children[0]->diffnode(var), std::move(sub));
+	return std::make_unique<DivNode>(derivative(m_Children[0], var, memo), std::move(sub));
+}
+
+std::int32_t tc::expression::AtanhNode::get_node_type() const
+{
+	return NodeType::ATANH_NODE;
+}
+
+// <================================== EXPM1 ===================================>
+
+tc::expression::tentok tc::expression::expm1(const tentok& a)
+{
+	if (a.is_tensor()) {
+		return torch::expm1(a.tensor());
+	}
+	return expm1(a.scalar());
+}
+
+tc::expression::Expm1Node::Expm1Node(std::shared_ptr<Node> child)
+{
+	m_Children.push_back(std::move(child));
+}
+
+tc::expression::tentok tc::expression::Expm1Node::eval()
+{
+	return expm1(m_Children[0]->eval());
+}
+
+void tc::expression::Expm1Node::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::expm1_out(out, in.tensor());
+		return;
+	}
+	tentok_into(expm1(in), out);
+}
+
+std::unique_ptr<tc::expression::Node> tc::expression::Expm1Node::evalnode()
+{
+	return std::make_unique<Expm1Node>(m_Children[0]->evalnode());
+}
+
+tc::expression::tentok tc::expression::Expm1Node::diff(const VariableToken& var)
+{
+	return exp(m_Children[0]->eval()) * m_Children[0]->diff(var);
+}
+
+std::shared_ptr<tc::expression::Node> tc::expression::Expm1Node::diffnode(const VariableToken& var, DiffMemo& memo)
+{
+	auto exp = std::make_unique<ExpNode>(m_Children[0]);
+	return std::make_unique<MulNode>(std::move(exp), derivative(m_Children[0], var, memo));
+}
+
+std::int32_t tc::expression::Expm1Node::get_node_type() const
+{
+	return NodeType::EXPM1_NODE;
+}
+
+// <================================== LOG1P ===================================>
+
+tc::expression::tentok tc::expression::log1p(const tentok& a)
+{
+	if (a.is_tensor()) {
+		return torch::log1p(a.tensor());
+	}
+	return log1p(a.scalar());
+}
+
+tc::expression::Log1pNode::Log1pNode(std::shared_ptr<Node> child)
+{
+	m_Children.push_back(std::move(child));
+}
+
+tc::expression::tentok tc::expression::Log1pNode::eval()
+{
+	return log1p(m_Children[0]->eval());
+}
+
+void tc::expression::Log1pNode::eval_into(torch::Tensor& out)
+{
+	auto in = m_Children[0]->eval();
+
+	if (in.is_tensor() && out_fits(out, in.tensor())) {
+		torch::log1p_out(out, in.tensor());
+		return;
+	}
+	tentok_into(log1p(in), out);
+}
+
+std::unique_ptr<tc::expression::Node> tc::expression::Log1pNode::evalnode()
+{
+	return std::make_unique<Log1pNode>(m_Children[0]->evalnode());
+}
+
+tc::expression::tentok tc::expression::Log1pNode::diff(const VariableToken& var)
+{
+	return m_Children[0]->diff(var) / (tentok_from_unity() + m_Children[0]->eval());
+}
+
+std::shared_ptr<tc::expression::Node> tc::expression::Log1pNode::diffnode(const VariableToken& var, DiffMemo& memo)
+{
+	auto add = std::make_unique<AddNode>(std::make_unique<TokenNode>(UnityToken()), m_Children[0]);
+	return std::make_unique<DivNode>(derivative(m_Children[0], var, memo), std::move(add));
+}
+
+std::int32_t tc::expression::Log1pNode::get_node_type() const
+{
+	return NodeType::LOG1P_NODE;
+}
+
+// <================================== FMA ===================================>
+
+tc::expression::tentok tc::expression::fma(const tentok& a, const tentok& b, const tentok& c)
+{
+	if (a.is_tensor() && b.is_tensor() && c.is_tensor()) {
+		return torch::addcmul(c.tensor(), a.tensor(), b.tensor());
+	}
+	return a * b + c;
+}
+
+tc::expression::FmaNode::FmaNode(std::shared_ptr<Node> left_child, std::shared_ptr<Node> right_child, std::shared_ptr<Node> addend_child)
+{
+	m_Children.resize(3);
+	m_Children.at(0) = std::move(left_child);
+	m_Children.at(1) = std::move(right_child);
+	m_Children.at(2) = std::move(addend_child);
+}
+
+tc::expression::tentok tc::expression::FmaNode::eval()
+{
+	auto l = m_Children[0]->eval();
+	auto r = m_Children[1]->eval();
+	auto c = m_Children[2]->eval();
+
+	return fma(l, r, c);
+}
+
+void tc::expression::FmaNode::eval_into(torch::Tensor& out)
+{
+	auto l = m_Children[0]->eval();
+	auto r = m_Children[1]->eval();
+	auto c = m_Children[2]->eval();
+
+	// out fits the product and c broadcasts into it
+	if (l.is_tensor() && r.is_tensor() && c.is_tensor() && out_fits(out, l.tensor(), r.tensor()) && out_fits(out, out, c.tensor())) {
+		torch::addcmul_out(out, c.tensor(), l.tensor(), r.tensor());
+		return;
+	}
+	tentok_into(fma(l, r, c), out);
+}
+
+std::unique_ptr<tc::expression::Node> tc::expression::FmaNode::evalnode()
+{
+	auto l = m_Children[0]->evalnode();
+	auto r = m_Children[1]->evalnode();
+	auto c = m_Children[2]->evalnode();
+
+	return std::make_unique<FmaNode>(std::move(l), std::move(r), std::move(c));
+}
+
+tc::expression::tentok tc::expression::FmaNode::diff(const VariableToken& var)
+{
+	auto l = m_Children[0]->eval();
+	auto r = m_Children[1]->eval();
+
+	auto dl = m_Children[0]->diff(var);
+	auto dr = m_Children[1]->diff(var);
+	auto dc = m_Children[2]->diff(var);
+
+	return (dl * r + l * dr + dc);
+}
+
+std::shared_ptr<tc::expression::Node> tc::expression::FmaNode::diffnode(const VariableToken& var, DiffMemo& memo)
+{
+	auto& l = m_Children[0];
+	auto& r = m_Children[1];
+
+	// dl*r + (l*dr + dc)
+	auto ldrdc = std::make_unique<FmaNode>(l, derivative(r, var, memo), derivative(m_Children[2], var, memo));
+	return std::make_unique<FmaNode>(derivative(l, var, memo), r, std::move(ldrdc));
+}
+
+std::int32_t tc::expression::FmaNode::get_node_type() const
+{
+	return NodeType::FMA_NODE;
+}
+
+// <================================= CUSTOM ==================================>
+
+tc::expression::CustomNode::CustomNode(std::shared_ptr<const CustomFunction> function, std::vector<std::int32_t> partials,
+	std::vector<std::shared_ptr<Node>> children)
+	: m_pFunction(std::move(function)), m_Partials(std::move(partials))
+{
+	if (children.size() != m_pFunction->n_inputs)
+		throw std::runtime_error("custom function " + m_pFunction->name + " takes " + std::to_string(m_pFunction->n_inputs) + " arguments");
+	m_Children = std::move(children);
+}
+
+tc::expression::tentok tc::expression::CustomNode::eval()
+{
+	std::vector<tentok> values;
+	values.reserve(m_Children.size());
+	for (auto& child : m_Children) {
+		values.push_back(child->eval());
+	}
+
+	// Kernels only take tensors, scalar arguments are materialized on the device of the tensor arguments
+	torch::Device device(torch::kCPU);
+	for (auto& value : values) {
+		if (value.is_tensor()) {
+			device = value.tensor().device();
+			break;
+		}
+	}
+
+	std::vector<torch::Tensor> args;
+	args.reserve(values.size());
+	for (auto& value : values) {
+		args.push_back(tensor_from_tentok(value, device));
+	}
+	return m_pFunction->kernel(m_Partials)(args);
+}
+
+std::unique_ptr<tc::expression::Node> tc::expression::CustomNode::evalnode()
+{
+	std::vector<std::shared_ptr<Node>> children;
+	for (auto& child : m_Children) {
+		children.push_back(child->evalnode());
+	}
+	return std::make_unique<CustomNode>(m_pFunction, m_Partials, std::move(children));
+}
+
+tc::expression::tentok tc::expression::CustomNode::diff(const VariableToken& var)
+{
+	std::optional<tentok> ret;
+	for (int i = 0; i < m_Children.size(); ++i) {
+		auto partials = m_Partials;
+		partials.push_back(i);
+		auto term = CustomNode(m_pFunction, std::move(partials), m_Children).eval() * m_Children[i]->diff(var);
+		ret = ret.has_value() ? ret.value() + term : term;
+	}
+	return ret.value();
+}
+
+std::shared_ptr<tc::expression::Node> tc::expression::CustomNode::diffnode(const VariableToken& var, DiffMemo& memo)
+{
+	if (m_Partials.size() >= 2)
+		throw std::runtime_error("custom function " + m_pFunction->name + " can only be differentiated twice");
+
+	// sum_i df/dx_i * dx_i, terms of arguments that don't depend on var are removed by simplify
+	std::shared_ptr<Node> ret;
+	for (int i = 0; i < m_Children.size(); ++i) {
+		auto partials = m_Partials;
+		partials.push_back(i);
+		auto partial = std::make_unique<CustomNode>(m_pFunction, std::move(partials), m_Children);
+		std::shared_ptr<Node> term = std::make_unique<MulNode>(std::move(partial), derivative(m_Children[i], var, memo));
+		if (ret)
+			ret = std::make_unique<AddNode>(std::move(ret), std::move(term));
+		else
+			ret = std::move(term);
+	}
+	return ret;
+}
+
+std::int32_t tc::expression::CustomNode::get_node_type() const
+{
+	return NodeType::CUSTOM_NODE;
+}
+
+const std::shared_ptr<const tc::expression::CustomFunction>& tc::expression::CustomNode::get_function() const
+{
+	return m_pFunction;
+}
+
+const std::vector<std::int32_t>& tc::expression::CustomNode::get_partials() const
+{
+	return m_Partials;
+}
+
+// <================================= CONCAT ==================================>
+
+namespace {
+
+	// Scalar values are materialized on the device of the first tensor among them
+	std::vector<torch::Tensor> tensors_from_tentoks(const std::vector<tc::expression::tentok>& values)
+	{
+		torch::Device device(torch::kCPU);
+		for (auto& value : values) {
+			if (value.is_tensor()) {
+				device = value.tensor().device();
+				break;
+			}
+		}
+
+		std::vector<torch::Tensor> ret;
+		for (auto& value : values) {
+			ret.push_back(tc::expression::tensor_from_tentok(value, device));
+		}
+		return ret;
+	}
+
+}
+
+tc::expression::ConcatNode::ConcatNode(std::vector<std::shared_ptr<Node>> pieces, std::vector<std::shared_ptr<Node>> shapes)
+{
+	if (pieces.empty() || pieces.size() != shapes.size())
+		throw std::runtime_error("a concatenation needs one shape per piece and at least one piece");
+
+	m_Children = std::move(pieces);
+	for (auto& shape : shapes) {
+		m_Children.push_back(std::move(shape));
+	}
+}
+
+tc::expression::tentok tc::expression::ConcatNode::eval()
+{
+	std::vector<tentok> values;
+	for (auto& child : m_Children) {
+		values.push_back(child->eval());
+	}
+
+	auto tensors = tensors_from_tentoks(values);
+	std::vector<torch::Tensor> pieces(tensors.begin(), tensors.begin() + num_pieces());
+	std::vector<torch::Tensor> shapes(tensors.begin() + num_pieces(), tensors.end());
+	return torch::cat(expand_pieces(pieces, shapes), -1);
+}
+
+std::unique_ptr<tc::expression::Node> tc::expression::ConcatNode::evalnode()
+{
+	std::vector<std::shared_ptr<Node>> pieces;
+	std::vector<std::shared_ptr<Node>> shapes;
+	for (int i = 0; i < num_pieces(); ++i) {
+		pieces.push_back(m_Children[i]->evalnode());
+		shapes.push_back(m_Children[num_pieces() + i]->evalnode());
+	}
+	return std::make_unique<ConcatNode>(std::move(pieces), std::move(shapes));
+}
+
+tc::expression::tentok tc::expression::ConcatNode::diff(const VariableToken& var)
+{
+	std::vector<tentok> values;
+	for (int i = 0; i < num_pieces(); ++i) {
+		values.push_back(m_Children[i]->diff(var));
+	}
+	for (int i = 0; i < num_pieces(); ++i) {
+		values.push_back(m_Children[num_pieces() + i]->eval());
+	}
+
+	auto tensors = tensors_from_tentoks(values);
+	std::vector<torch::Tensor> pieces(tensors.begin(), tensors.begin() + num_pieces());
+	std::vector<torch::Tensor> shapes(tensors.begin() + num_pieces(), tensors.end());
+	return torch::cat(expand_pieces(pieces, shapes), -1);
+}
+
+std::shared_ptr<tc::expression::Node> tc::expression::ConcatNode::diffnode(const VariableToken& var, DiffMemo& memo)
+{
+	std::vector<std::shared_ptr<Node>> pieces;
+	std::vector<std::shared_ptr<Node>> shapes;
+	for (int i = 0; i < num_pieces(); ++i) {
+		pieces.push_back(derivative(m_Children[i], var, memo));
+		shapes.push_back(m_Children[num_pieces() + i]);
+	}
+	return std::make_unique<ConcatNode>(std::move(pieces), std::move(shapes));
+}
+
+std::int32_t tc::expression::ConcatNode::get_node_type() const
+{
+	return NodeType::CONCAT_NODE;
+}
+
+std::int32_t tc::expression::ConcatNode::num_pieces() const
+{
+	return m_Children.size() / 2;
 }
@@ -1,7 +1,11 @@
 #pragma once
 
 #include "../pch.hpp"
+
+#include <map>
+
 #include "TokenAlgebra/token_algebra.hpp"
+#include "custom.hpp"
 
 namespace tc {
 	namespace expression {
@@ -10,7 +14,28 @@ namespace tc {
 		using FetcherFunc = std::function<torch::Tensor()>;
 		using FetcherFuncRef = tc::refw<const std::function<torch::Tensor()>>;
 
-		using tentok = std::pair<std::optional<torch::Tensor>, tc::OptUPtr<NumberBaseToken>>;
+		// The value of an evaluated node, either a tensor or a number token held inline by value,
+		// so that evaluating the scalar parts of a tree allocates nothing
+		class tentok {
+		public:
+
+			tentok(const torch::Tensor& tensor);
+
+			tentok(torch::Tensor&& tensor);
+
+			tentok(const ScalarValue& scalar);
+
+			bool is_tensor() const;
+
+			bool is_scalar() const;
+
+			const torch::Tensor& tensor() const;
+
+			const ScalarValue& scalar() const;
+
+		private:
+			std::variant<torch::Tensor, ScalarValue> m_Value;
+		};
 
 		std::string tentok_to_string(const tentok& in);
 
@@ -24,6 +49,85 @@ namespace tc {
 
 		torch::Tensor tensor_from_tentok(const tentok& in, torch::Device& device);
 
+		// True if out already has the shape, dtype and device of an elementwise op on a, or on a and b,
+		// so that the result can be written into it with the *_out kernels
+		bool out_fits(const torch::Tensor& out, const torch::Tensor& a);
+		bool out_fits(const torch::Tensor& out, const torch::Tensor& a, const torch::Tensor& b);
+
+		// Writes in into the storage of out if out already has its shape and dtype,
+		// otherwise out is replaced by a tensor of its own, never one aliasing in
+		void tensor_into(const torch::Tensor& in, torch::Tensor& out);
+		void tentok_into(const tentok& in, torch::Tensor& out);
+
+		// The sizes the pieces of a ConcatNode are expanded to before they are concatenated, given the sizes
+		// of the pieces and of the values that give them their shape
+		std::vector<std::vector<int64_t>> concat_sizes(const std::vector<std::vector<int64_t>>& pieces,
+			const std::vector<std::vector<int64_t>>& shapes);
+
+		// The pieces expanded to their concat_sizes, ready to be concatenated along the last dimension
+		std::vector<torch::Tensor> expand_pieces(const std::vector<torch::Tensor>& pieces, const std::vector<torch::Tensor>& shapes);
+
+		struct NodeType {
+			enum {
+				TOKEN_NODE,
+				TOKEN_FETCHER_NODE,
+				TENSOR_NODE,
+				VARIABLE_NODE,
+				EXPRESSION_NODE,
+				// Operators
+				NEG_NODE,
+				MUL_NODE,
+				DIV_NODE,
+				ADD_NODE,
+				SUB_NODE,
+				POW_NODE,
+				// Unary
+				SGN_NODE,
+				ABS_NODE,
+				SQRT_NODE,
+				SQUARE_NODE,
+				EXP_NODE,
+				LOG_NODE,
+				// Trig
+				SIN_NODE,
+				COS_NODE,
+				TAN_NODE,
+				ASIN_NODE,
+				ACOS_NODE,
+				ATAN_NODE,
+				SINH_NODE,
+				COSH_NODE,
+				TANH_NODE,
+				ASINH_NODE,
+				ACOSH_NODE,
+				ATANH_NODE,
+				// Fused
+				EXPM1_NODE,
+				LOG1P_NODE,
+				FMA_NODE,
+				// Custom
+				CUSTOM_NODE,
+				// Outputs
+				CONCAT_NODE,
+			};
+		};
+
+		class Node;
+
+		// Derivatives already built while differentiating, by node and variable name. Sharing one memo between
+		// the derivatives of an expression turns them into a DAG where every derivative subterm is built once
+		class DiffMemo {
+		public:
+
+			std::shared_ptr<Node> find(const Node& node, const VariableToken& var) const;
+
+			void insert(const std::shared_ptr<Node>& node, const VariableToken& var, std::shared_ptr<Node> derivative);
+
+		private:
+			// The differentiated node is kept alive so its address can't be reused by another node
+			std::map<std::pair<const Node*, std::string>, std::pair<std::shared_ptr<Node>, std::shared_ptr<Node>>> m_Derivatives;
+		};
+
 		class Node {
 		public:
 
@@ -31,16 +135,33 @@ namespace tc {
 
 			Node(std::unique_ptr<NumberBaseToken> base_token);
 
+			virtual ~Node() = default;
+
+			// Placed in the arena of the current ArenaScope if there is one
+			static void* operator new(std::size_t size);
+			static void operator delete(void* ptr);
+
 			virtual tentok eval() = 0;
 
+			// Evaluates into out, reusing its storage when it already holds a tensor of the result shape
+			virtual void eval_into(torch::Tensor& out);
+
 			virtual std::unique_ptr<Node> evalnode() = 0;
 
 			virtual tentok diff(const VariableToken& var) = 0;
 
-			virtual std::unique_ptr<Node> diffnode(const VariableToken& var) = 0;
+			// The derivative of this node, it shares the subtrees it has in common with this node and, through
+			// memo, with every other derivative built with the same memo. Called through derivative
+			virtual std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) = 0;
+
+			// The memoized derivative of node
+			static std::shared_ptr<Node> derivative(const std::shared_ptr<Node>& node, const VariableToken& var, DiffMemo& memo);
+
+			virtual std::int32_t get_node_type() const = 0;
 
 		public:
-			std::vector<std::unique_ptr<Node>> m_Children;
+			// Children may be shared between several parents, the structure of a node is never changed once it has a parent
+			std::vector<std::shared_ptr<Node>> m_Children;
 
 			std::unique_ptr<NumberBaseToken> m_pToken;
 		};
@@ -60,7 +181,9 @@ namespace tc {
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -75,7 +198,11 @@ namespace tc {
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
+
+			const FetcherFuncRef& get_fetcher() const;
 
 		private:
 			FetcherFuncRef m_VariableFetcher; // fetches the tensor
@@ -92,7 +219,11 @@ namespace tc {
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
+
+			const torch::Tensor& get_tensor() const;
 
 		private:
 			torch::Tensor m_Tensor;
@@ -109,10 +240,16 @@ namespace tc {
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
+
+			const VariableToken& get_variable_token() const;
+
+			const FetcherFuncRef& get_fetcher() const;
 
 		private:
-			const VariableToken& m_VarToken;
+			VariableToken m_VarToken;
 			FetcherFuncRef m_VariableFetcher; // fetches the tensor
 		};
 
@@ -123,15 +260,19 @@ namespace tc {
 		class NegNode : public Node {
 		public:
 
-			NegNode(std::unique_ptr<Node> child);
+			NegNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -140,15 +281,19 @@ namespace tc {
 		class MulNode : public Node {
 		public:
 
-			MulNode(std::unique_ptr<Node> left_child, std::unique_ptr<Node> right_child);
+			MulNode(std::shared_ptr<Node> left_child, std::shared_ptr<Node> right_child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -157,15 +302,19 @@ namespace tc {
 		class DivNode : public Node {
 		public:
 
-			DivNode(std::unique_ptr<Node> left_child, std::unique_ptr<Node> right_child);
+			DivNode(std::shared_ptr<Node> left_child, std::shared_ptr<Node> right_child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 		};
 
 		tentok operator+(const tentok& a, const tentok& b);
@@ -173,15 +322,19 @@ namespace tc {
 		class AddNode : public Node {
 		public:
 
-			AddNode(std::unique_ptr<Node> left_child, std::unique_ptr<Node> right_child);
+			AddNode(std::shared_ptr<Node> left_child, std::shared_ptr<Node> right_child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -190,15 +343,19 @@ namespace tc {
 		class SubNode : public Node {
 		public:
 
-			SubNode(std::unique_ptr<Node> left_child, std::unique_ptr<Node> right_child);
+			SubNode(std::shared_ptr<Node> left_child, std::shared_ptr<Node> right_child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -207,15 +364,19 @@ namespace tc {
 		class PowNode : public Node {
 		public:
 
-			PowNode(std::unique_ptr<Node> left_child, std::unique_ptr<Node> right_child);
+			PowNode(std::shared_ptr<Node> left_child, std::shared_ptr<Node> right_child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 		
@@ -227,15 +388,19 @@ namespace tc {
 		class SgnNode : public Node {
 		public:
 
-			SgnNode(std::unique_ptr<Node> child);
+			SgnNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -244,15 +409,19 @@ namespace tc {
 		class AbsNode : public Node {
 		public:
 
-			AbsNode(std::unique_ptr<Node> child);
+			AbsNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -261,15 +430,19 @@ namespace tc {
 		class SqrtNode : public Node {
 		public:
 
-			SqrtNode(std::unique_ptr<Node> child);
+			SqrtNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -278,15 +451,19 @@ namespace tc {
 		class SquareNode : public Node {
 		public:
 
-			SquareNode(std::unique_ptr<Node> child);
+			SquareNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -295,15 +472,19 @@ namespace tc {
 		class ExpNode : public Node {
 		public:
 
-			ExpNode(std::unique_ptr<Node> child);
+			ExpNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -312,15 +493,19 @@ namespace tc {
 		class LogNode : public Node {
 		public:
 
-			LogNode(std::unique_ptr<Node> child);
+			LogNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -331,15 +516,19 @@ namespace tc {
 		class SinNode : public Node {
 		public:
 
-			SinNode(std::unique_ptr<Node> child);
+			SinNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 		
@@ -348,15 +537,19 @@ namespace tc {
 		class CosNode : public Node {
 		public:
 
-			CosNode(std::unique_ptr<Node> child);
+			CosNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -365,15 +558,19 @@ namespace tc {
 		class TanNode : public Node {
 		public:
 
-			TanNode(std::unique_ptr<Node> child);
+			TanNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -382,15 +579,19 @@ namespace tc {
 		class AsinNode : public Node {
 		public:
 
-			AsinNode(std::unique_ptr<Node> child);
+			AsinNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -399,15 +600,19 @@ namespace tc {
 		class AcosNode : public Node {
 		public:
 
-			AcosNode(std::unique_ptr<Node> child);
+			AcosNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -416,15 +621,19 @@ namespace tc {
 		class AtanNode : public Node {
 		public:
 
-			AtanNode(std::unique_ptr<Node> child);
+			AtanNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -433,15 +642,19 @@ namespace tc {
 		class SinhNode : public Node {
 		public:
 
-			SinhNode(std::unique_ptr<Node> child);
+			SinhNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -450,15 +663,19 @@ namespace tc {
 		class CoshNode : public Node {
 		public:
 
-			CoshNode(std::unique_ptr<Node> child);
+			CoshNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -467,15 +684,19 @@ namespace tc {
 		class TanhNode : public Node {
 		public:
 
-			TanhNode(std::unique_ptr<Node> child);
+			TanhNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -484,15 +705,19 @@ namespace tc {
 		class AsinhNode : public Node {
 		public:
 
-			AsinhNode(std::unique_ptr<Node> child);
+			AsinhNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -501,15 +726,19 @@ namespace tc {
 		class AcoshNode : public Node {
 		public:
 
-			AcoshNode(std::unique_ptr<Node> child);
+			AcoshNode(std::shared_ptr<Node> child);
 
 			tentok eval() override;
 
+			void eval_into(torch::Tensor& out) override;
+
 			std::unique_ptr<Node> evalnode() override;
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
 		};
 
@@ -518,7 +747,127 @@ namespace tc {
 		class AtanhNode : public Node {
 		public:
 
-			AtanhNode(std::unique_ptr<Node> child);
+			AtanhNode(std::shared_ptr<Node> child);
+
+			tentok eval() override;
+
+			void eval_into(torch::Tensor& out) override;
+
+			std::unique_ptr<Node> evalnode() override;
+
+			tentok diff(const VariableToken& var) override;
+
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
+
+		};
+
+
+		// Fused, created by simplify from the patterns they replace
+
+		// exp(a) - 1
+		tentok expm1(const tentok& a);
+
+		class Expm1Node : public Node {
+		public:
+
+			Expm1Node(std::shared_ptr<Node> child);
+
+			tentok eval() override;
+
+			void eval_into(torch::Tensor& out) override;
+
+			std::unique_ptr<Node> evalnode() override;
+
+			tentok diff(const VariableToken& var) override;
+
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
+
+		};
+
+		// log(1 + a)
+		tentok log1p(const tentok& a);
+
+		class Log1pNode : public Node {
+		public:
+
+			Log1pNode(std::shared_ptr<Node> child);
+
+			tentok eval() override;
+
+			void eval_into(torch::Tensor& out) override;
+
+			std::unique_ptr<Node> evalnode() override;
+
+			tentok diff(const VariableToken& var) override;
+
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
+
+		};
+
+		// a * b + c
+		tentok fma(const tentok& a, const tentok& b, const tentok& c);
+
+		class FmaNode : public Node {
+		public:
+
+			FmaNode(std::shared_ptr<Node> left_child, std::shared_ptr<Node> right_child, std::shared_ptr<Node> addend_child);
+
+			tentok eval() override;
+
+			void eval_into(torch::Tensor& out) override;
+
+			std::unique_ptr<Node> evalnode() override;
+
+			tentok diff(const VariableToken& var) override;
+
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
+
+		};
+
+		// A registered custom function of its children, or with partials the partial derivative of it with
+		// respect to the children at those indices. Derivatives are built from the derivative kernels by the chain rule
+		class CustomNode : public Node {
+		public:
+
+			CustomNode(std::shared_ptr<const CustomFunction> function, std::vector<std::int32_t> partials,
+				std::vector<std::shared_ptr<Node>> children);
+
+			tentok eval() override;
+
+			std::unique_ptr<Node> evalnode() override;
+
+			tentok diff(const VariableToken& var) override;
+
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
+
+			const std::shared_ptr<const CustomFunction>& get_function() const;
+
+			const std::vector<std::int32_t>& get_partials() const;
+
+		private:
+
+			std::shared_ptr<const CustomFunction> m_pFunction;
+			std::vector<std::int32_t> m_Partials;
+		};
+
+		// The outputs of a multi output model side by side along the last dimension. The children are the pieces
+		// followed by one shape per piece, the output value the piece belongs to. Each piece is broadcast against its
+		// shape and then all of them to common leading dimensions, so derivative pieces that vanished or don't vary
+		// along every dimension still take the width of their output. Derivatives keep the shapes
+		class ConcatNode : public Node {
+		public:
+
+			ConcatNode(std::vector<std::shared_ptr<Node>> pieces, std::vector<std::shared_ptr<Node>> shapes);
 
 			tentok eval() override;
 
@@ -526,8 +875,11 @@ namespace tc {
 
 			tentok diff(const VariableToken& var) override;
 
-			std::unique_ptr<Node> diffnode(const VariableToken& var) override;
+			std::shared_ptr<Node> diffnode(const VariableToken& var, DiffMemo& memo) override;
+
+			std::int32_t get_node_type() const override;
 
+			std::int32_t num_pieces() const;
 		};
 
 	}
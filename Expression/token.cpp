@@ -2,6 +2,17 @@
 
 #include "token.hpp"
 #include "Parser/lexer.hpp"
+#include "arena.hpp"
+
+void* tc::expression::Token::operator new(std::size_t size)
+{
+	return Arena::allocate_object(size);
+}
+
+void tc::expression::Token::operator delete(void* ptr)
+{
+	Arena::deallocate_object(ptr);
+}
 
 // <=========================== NO_TOKEN ============================>
 
@@ -38,6 +38,12 @@ namespace tc {
 			Token() = default;
 			Token(const Token&) = default;
 
+			virtual ~Token() = default;
+
+			// Placed in the arena of the current ArenaScope if there is one
+			static void* operator new(std::size_t size);
+			static void operator delete(void* ptr);
+
 			virtual std::int32_t get_id() const = 0;
 
 			virtual std::int32_t get_token_type() const = 0;
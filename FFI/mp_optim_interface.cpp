@@ -3,6 +3,29 @@
 #include "mp_optim_interface.h"
 
 #include "../Models/mp_models.hpp"
+#include "../Expression/custom.hpp"
+
+#include <fstream>
+
+namespace {
+
+	tc::expression::CustomKernel wrap_kernel(ffi::CustomKernelFunc func)
+	{
+		if (func == nullptr)
+			return tc::expression::CustomKernel();
+
+		return [func](const std::vector<torch::Tensor>& inputs) {
+			std::vector<const torch::Tensor*> ptrs;
+			for (auto& input : inputs) {
+				ptrs.push_back(&input);
+			}
+			torch::Tensor out;
+			func(&out, ptrs.data(), ptrs.size());
+			return out;
+		};
+	}
+
+}
 
 
 
@@ -120,11 +143,98 @@ void ffi::model_create_from_expr(ffi::ModelHandle** model_handle, const char* ex
 
 }
 
+void ffi::model_create_from_exprs(ffi::ModelHandle** model_handle, const char** expressions, int num_expressions, const char** parameters, int num_parameters, const char** constants, int num_constants)
+{
+	auto& mh = *model_handle;
+
+	std::vector<std::string> exprs;
+	exprs.reserve(num_expressions);
+	std::vector<std::string> params;
+	params.reserve(num_parameters);
+	std::vector<std::string> consts;
+	consts.reserve(num_constants);
+
+	if (expressions != nullptr && num_expressions > 0) {
+		for (int i = 0; i < num_expressions; ++i) {
+			exprs.emplace_back(expressions[i]);
+		}
+	}
+	else {
+		throw std::runtime_error("Cannot create a model without expressions");
+	}
+
+	if (parameters != nullptr && num_parameters > 0) {
+		for (int i = 0; i < num_parameters; ++i) {
+			params.emplace_back(parameters[i]);
+		}
+	}
+	else {
+		throw std::runtime_error("Cannot create a model without parameters");
+	}
+
+	mh = new ffi::ModelHandle;
+
+	if (constants != nullptr && num_constants > 0) {
+		for (int i = 0; i < num_constants; ++i) {
+			consts.emplace_back(constants[i]);
+		}
+		mh->p_model = std::make_unique<tc::optim::MP_Model>(exprs, params, consts);
+	}
+	else {
+		mh->p_model = std::make_unique<tc::optim::MP_Model>(exprs, params, std::nullopt);
+	}
+
+}
+
+void ffi::model_create_from_file(ffi::ModelHandle** model_handle, const char* path)
+{
+	auto& mh = *model_handle;
+
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		throw std::runtime_error(std::string("could not open model file ") + path);
+
+	auto model = std::make_unique<tc::optim::MP_Model>(file);
+
+	mh = new ffi::ModelHandle;
+	mh->p_model = std::move(model);
+}
+
+void ffi::model_save(ffi::ModelHandle* model_handle, const char* path)
+{
+	std::ofstream file(path, std::ios::binary);
+	if (!file)
+		throw std::runtime_error(std::string("could not open model file ") + path);
+
+	model_handle->p_model->save(file);
+}
+
 void ffi::model_free(ffi::ModelHandle* model_handle)
 {
 	delete model_handle;
 }
 
+void ffi::register_custom_function(const char* name, int num_inputs, CustomKernelFunc eval,
+	const CustomKernelFunc* derivatives, const CustomKernelFunc* second_derivatives)
+{
+	tc::expression::CustomFunction function;
+	function.name = name;
+	function.n_inputs = num_inputs;
+	function.eval = wrap_kernel(eval);
+	if (derivatives != nullptr) {
+		for (int i = 0; i < num_inputs; ++i) {
+			function.derivatives.push_back(wrap_kernel(derivatives[i]));
+		}
+	}
+	if (second_derivatives != nullptr) {
+		for (int i = 0; i < num_inputs * (num_inputs + 1) / 2; ++i) {
+			function.second_derivatives.push_back(wrap_kernel(second_derivatives[i]));
+		}
+	}
+
+	tc::expression::CustomFunctionRegistry::instance().add(std::move(function));
+}
+
 void ffi::model_set_parameters(ffi::ModelHandle* model_handle, torch::Tensor* parameters)
 {
 	model_handle->p_model->parameters() = *parameters;
@@ -41,6 +41,16 @@ namespace ffi {
 		const char** parameters, int num_parameters,
 		const char** constants, int num_constants);
 
+	// One model of several outputs, evaluated to the outputs concatenated along the data dimension
+	void model_create_from_exprs(ModelHandle** model_handle, const char** expressions, int num_expressions,
+		const char** parameters, int num_parameters,
+		const char** constants, int num_constants);
+
+	// Loads a model saved by model_save
+	void model_create_from_file(ModelHandle** model_handle, const char* path);
+
+	void model_save(ModelHandle* model_handle, const char* path);
+
 	void model_free(ModelHandle* model_handle);
 
 	void model_set_parameters(ModelHandle* model_handle, torch::Tensor* parameters);
@@ -60,6 +70,18 @@ namespace ffi {
 	void model_diff(ModelHandle* model_handle, torch::Tensor* value, std::uint32_t index);
 
 
+	// Writes the value of a custom function, or of one of its derivatives, computed from its num_inputs arguments to out.
+	// Kernels must broadcast their arguments like the elementwise torch ops and may be called from several threads
+	// at once, independent tape instructions run on the torch thread pool
+	typedef void (*CustomKernelFunc)(torch::Tensor* out, const torch::Tensor** inputs, int num_inputs);
+
+	// Registers a function that the expressions of models created afterwards can call by name. derivatives holds
+	// num_inputs and second_derivatives num_inputs * (num_inputs + 1) / 2 kernels, in the order of
+	// tc::expression::CustomFunction. Either array and any kernel in them may be null if it is never needed
+	void register_custom_function(const char* name, int num_inputs, CustomKernelFunc eval,
+		const CustomKernelFunc* derivatives, const CustomKernelFunc* second_derivatives);
+
+
 	void optim_free(OptimHandle* optim_handle);
 
 	void optim_run(OptimRunHandle** model_run_handle, OptimHandle* optim_handle, uint32_t iter);
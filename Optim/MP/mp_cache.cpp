@@ -0,0 +1,216 @@
+#include "../../pch.hpp"
+
+#include "mp_cache.hpp"
+#include "../../Expression/custom.hpp"
+#include "../../Expression/token.hpp"
+#include "../../Expression/Parser/lexer.hpp"
+#include "../../Expression/Parser/shunter.hpp"
+
+#include <iomanip>
+#include <limits>
+#include <sstream>
+
+namespace {
+
+	// Postfix order needs no parentheses, numbers are written by value
+	std::string canonical_expression(const std::string& expression, tc::expression::LexContext& context)
+	{
+		auto lexcontext = context;
+		tc::expression::Lexer lexer(std::move(lexcontext));
+		tc::expression::Shunter shunter;
+		auto toks = shunter.shunt(lexer.lex(expression));
+
+		std::ostringstream canonical;
+		canonical << std::setprecision(std::numeric_limits<float>::max_digits10);
+		for (auto& tok : toks) {
+			switch (tok->get_token_type()) {
+			case tc::expression::TokenType::VARIABLE_TYPE:
+				canonical << static_cast<const tc::expression::VariableToken&>(*tok).name;
+				break;
+			case tc::expression::TokenType::NUMBER_TYPE:
+			{
+				auto& num = static_cast<const tc::expression::NumberToken&>(*tok).num;
+				canonical << '#' << num.real() << ',' << num.imag();
+				break;
+			}
+			default:
+				canonical << '@' << tok->get_token_type() << ':' << tok->get_id();
+			}
+			canonical << ' ';
+		}
+		return canonical.str();
+	}
+
+	// The fetcher map has to stay at the address the expression trees reference, so it lives next to the expression
+	struct CompiledExpr {
+		tc::expression::FetcherMap fetcher_map;
+		std::unique_ptr<tc::optim::MP_Expr> expr;
+	};
+
+}
+
+tc::optim::MP_ExprCache& tc::optim::MP_ExprCache::instance()
+{
+	static MP_ExprCache cache;
+	return cache;
+}
+
+std::shared_ptr<const tc::optim::MP_Expr> tc::optim::MP_ExprCache::get(const std::string& expression,
+	const std::vector<std::string>& parameters, tc::OptRef<const std::vector<std::string>> constants)
+{
+	return get(Key(expression, {}, {}, {}, parameters,
+		constants.has_value() ? std::make_optional(constants.value().get()) : std::nullopt,
+		tc::expression::CustomFunctionRegistry::instance().generation()));
+}
+
+std::shared_ptr<const tc::optim::MP_Expr> tc::optim::MP_ExprCache::get(const std::string& expression,
+	const std::vector<std::string>& diffexpressions,
+	const std::vector<std::string>& parameters, tc::OptRef<const std::vector<std::string>> constants)
+{
+	if (diffexpressions.empty())
+		throw std::runtime_error("number of diffexpressions was not equal to number of parameters");
+
+	return get(Key(expression, {}, diffexpressions, {}, parameters,
+		constants.has_value() ? std::make_optional(constants.value().get()) : std::nullopt,
+		tc::expression::CustomFunctionRegistry::instance().generation()));
+}
+
+std::shared_ptr<const tc::optim::MP_Expr> tc::optim::MP_ExprCache::get(const std::string& expression,
+	const std::vector<std::string>& diffexpressions, const std::vector<std::string>& seconddiffexpressions,
+	const std::vector<std::string>& parameters, tc::OptRef<const std::vector<std::string>> constants)
+{
+	if (diffexpressions.empty())
+		throw std::runtime_error("number of diffexpressions was not equal to number of parameters");
+
+	if (seconddiffexpressions.empty())
+		throw std::runtime_error("number of seconddiffexpressions was not equal to number of hessian entries");
+
+	return get(Key(expression, {}, diffexpressions, seconddiffexpressions, parameters,
+		constants.has_value() ? std::make_optional(constants.value().get()) : std::nullopt,
+		tc::expression::CustomFunctionRegistry::instance().generation()));
+}
+
+std::shared_ptr<const tc::optim::MP_Expr> tc::optim::MP_ExprCache::get(const std::vector<std::string>& expressions,
+	const std::vector<std::string>& parameters, tc::OptRef<const std::vector<std::string>> constants)
+{
+	if (expressions.empty())
+		throw std::runtime_error("a multi output model needs at least one output expression");
+
+	return get(Key("", expressions, {}, {}, parameters,
+		constants.has_value() ? std::make_optional(constants.value().get()) : std::nullopt,
+		tc::expression::CustomFunctionRegistry::instance().generation()));
+}
+
+std::size_t tc::optim::MP_ExprCache::size() const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	return m_Exprs.size();
+}
+
+void tc::optim::MP_ExprCache::clear()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_Exprs.clear();
+}
+
+tc::optim::MP_ExprCache::Key tc::optim::MP_ExprCache::canonical(const Key& source)
+{
+	auto [expression, expressions, diffexpressions, seconddiffexpressions, parameters, constants, generation] = source;
+
+	tc::expression::LexContext context;
+	for (auto& var : parameters) {
+		context.variables.emplace_back(var);
+	}
+	if (constants.has_value()) {
+		for (auto& var : constants.value()) {
+			context.variables.emplace_back(var);
+		}
+	}
+
+	if (expressions.empty())
+		expression = canonical_expression(expression, context);
+	for (auto* exprs : { &expressions, &diffexpressions, &seconddiffexpressions }) {
+		for (auto& expr : *exprs) {
+			expr = canonical_expression(expr, context);
+		}
+	}
+
+	return Key(expression, expressions, diffexpressions, seconddiffexpressions, parameters, constants, generation);
+}
+
+std::shared_ptr<const tc::optim::MP_Expr> tc::optim::MP_ExprCache::get(const Key& source)
+{
+	auto key = canonical(source);
+
+	std::promise<std::shared_ptr<const MP_Expr>> promise;
+	std::shared_future<std::shared_ptr<const MP_Expr>> compiled;
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+
+		// Entries compiled before a custom function was replaced are dropped, models created before keep them
+		if (std::get<6>(key) > m_Generation) {
+			m_Generation = std::get<6>(key);
+			for (auto it = m_Exprs.begin(); it != m_Exprs.end();) {
+				if (std::get<6>(it->first) < m_Generation)
+					it = m_Exprs.erase(it);
+				else
+					++it;
+			}
+		}
+
+		auto it = m_Exprs.find(key);
+		if (it != m_Exprs.end())
+			compiled = it->second;
+		else
+			m_Exprs.emplace(key, promise.get_future().share());
+	}
+
+	if (compiled.valid())
+		return compiled.get();
+
+	try {
+		auto expr = compile(source);
+		promise.set_value(expr);
+		return expr;
+	}
+	catch (...) {
+		// Waiting threads get the error, later calls try again
+		promise.set_exception(std::current_exception());
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Exprs.erase(key);
+		throw;
+	}
+}
+
+std::shared_ptr<const tc::optim::MP_Expr> tc::optim::MP_ExprCache::compile(const Key& key)
+{
+	auto& [expression, expressions, diffexpressions, seconddiffexpressions, parameters, constants, generation] = key;
+
+	auto compiled = std::make_shared<CompiledExpr>();
+	for (auto& p : parameters) {
+		compiled->fetcher_map.emplace(p, []() { return torch::Tensor(); });
+	}
+	tc::OptRef<const std::vector<std::string>> consts = std::nullopt;
+	if (constants.has_value()) {
+		for (auto& c : constants.value()) {
+			compiled->fetcher_map.emplace(c, []() { return torch::Tensor(); });
+		}
+		consts = constants.value();
+	}
+
+	if (!expressions.empty()) {
+		compiled->expr = std::make_unique<MP_Expr>(expressions, compiled->fetcher_map, parameters, consts);
+	}
+	else if (!seconddiffexpressions.empty()) {
+		compiled->expr = std::make_unique<MP_Expr>(expression, diffexpressions, seconddiffexpressions,
+			compiled->fetcher_map, parameters, consts);
+	}
+	else if (!diffexpressions.empty()) {
+		compiled->expr = std::make_unique<MP_Expr>(expression, diffexpressions, compiled->fetcher_map, parameters, consts);
+	}
+	else {
+		compiled->expr = std::make_unique<MP_Expr>(expression, compiled->fetcher_map, parameters, consts);
+	}
+
+	return std::shared_ptr<const MP_Expr>(compiled, compiled->expr.get());
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "../../pch.hpp"
+
+#include <future>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#include "mp_expr.hpp"
+
+namespace tc {
+	namespace optim {
+
+		// Process wide cache of compiled expression models. Lexing, shunting, symbolic differentiation and tape
+		// lowering run once per distinct expressions, parameter names and constant names, every model created
+		// with the same key shares the compiled MP_Expr. Expressions are keyed by their shunted token sequence,
+		// so spellings that only differ in parentheses or whitespace share the model compiled from the first one.
+		// Compiled trees hold the custom functions they call, so replacing a custom function starts a new
+		// generation of the cache. The cached expressions are immutable, their variable fetchers return undefined
+		// tensors, so they are only evaluated through their tape with explicit inputs. The cache is unbounded,
+		// entries live until clear() or the next generation
+		class MP_ExprCache {
+		public:
+
+			static MP_ExprCache& instance();
+
+			std::shared_ptr<const MP_Expr> get(const std::string& expression,
+				const std::vector<std::string>& parameters,
+				tc::OptRef<const std::vector<std::string>> constants);
+
+			std::shared_ptr<const MP_Expr> get(const std::string& expression,
+				const std::vector<std::string>& diffexpressions,
+				const std::vector<std::string>& parameters,
+				tc::OptRef<const std::vector<std::string>> constants);
+
+			std::shared_ptr<const MP_Expr> get(const std::string& expression,
+				const std::vector<std::string>& diffexpressions,
+				const std::vector<std::string>& seconddiffexpressions,
+				const std::vector<std::string>& parameters,
+				tc::OptRef<const std::vector<std::string>> constants);
+
+			// Multi output models, see the matching MP_Expr constructor
+			std::shared_ptr<const MP_Expr> get(const std::vector<std::string>& expressions,
+				const std::vector<std::string>& parameters,
+				tc::OptRef<const std::vector<std::string>> constants);
+
+			std::size_t size() const;
+
+			// Models created before keep the expressions they share
+			void clear();
+
+		private:
+
+			// expression, expressions, diffexpressions, seconddiffexpressions, parameters, constants, custom function generation
+			using Key = std::tuple<std::string, std::vector<std::string>, std::vector<std::string>, std::vector<std::string>,
+				std::vector<std::string>, std::optional<std::vector<std::string>>, std::uint64_t>;
+
+			MP_ExprCache() = default;
+
+			std::shared_ptr<const MP_Expr> get(const Key& source);
+
+			// The source key with every expression replaced by its shunted token sequence
+			static Key canonical(const Key& source);
+
+			static std::shared_ptr<const MP_Expr> compile(const Key& key);
+
+		private:
+
+			mutable std::mutex m_Mutex;
+			// Compiled outside the lock, threads asking for an expression that is being compiled wait on its future
+			std::map<Key, std::shared_future<std::shared_ptr<const MP_Expr>>> m_Exprs;
+			std::uint64_t m_Generation = 0; // entries of older generations are dropped on the next get
+		};
+
+	}
+}
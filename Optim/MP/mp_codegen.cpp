@@ -0,0 +1,282 @@
+#include "../../pch.hpp"
+
+#include <sstream>
+#include <cstdio>
+#include <iomanip>
+
+#include "mp_codegen.hpp"
+#include "mp_cache.hpp"
+
+namespace {
+
+	const char* op_function(std::int32_t op)
+	{
+		using namespace tc::expression;
+
+		switch (op) {
+		// Operators
+		case TapeOp::NEG:
+			return "torch::neg";
+		case TapeOp::ADD:
+			return "torch::add";
+		case TapeOp::SUB:
+			return "torch::sub";
+		case TapeOp::MUL:
+			return "torch::mul";
+		case TapeOp::DIV:
+			return "torch::div";
+		case TapeOp::POW:
+			return "torch::pow";
+		// Unary
+		case TapeOp::SGN:
+			return "torch::sgn";
+		case TapeOp::ABS:
+			return "torch::abs";
+		case TapeOp::SQRT:
+			return "torch::sqrt";
+		case TapeOp::SQUARE:
+			return "torch::square";
+		case TapeOp::EXP:
+			return "torch::exp";
+		case TapeOp::LOG:
+			return "torch::log";
+		// Trig
+		case TapeOp::SIN:
+			return "torch::sin";
+		case TapeOp::COS:
+			return "torch::cos";
+		case TapeOp::TAN:
+			return "torch::tan";
+		case TapeOp::ASIN:
+			return "torch::asin";
+		case TapeOp::ACOS:
+			return "torch::acos";
+		case TapeOp::ATAN:
+			return "torch::atan";
+		case TapeOp::SINH:
+			return "torch::sinh";
+		case TapeOp::COSH:
+			return "torch::cosh";
+		case TapeOp::TANH:
+			return "torch::tanh";
+		case TapeOp::ASINH:
+			return "torch::asinh";
+		case TapeOp::ACOSH:
+			return "torch::acosh";
+		case TapeOp::ATANH:
+			return "torch::atanh";
+		// Fused
+		case TapeOp::EXPM1:
+			return "torch::expm1";
+		case TapeOp::LOG1P:
+			return "torch::log1p";
+		case TapeOp::FMA:
+			return "torch::addcmul";
+		default:
+			throw std::runtime_error("tape op has no libtorch function");
+		}
+	}
+
+	std::string double_literal(double d)
+	{
+		if (std::isnan(d))
+			return "std::numeric_limits<double>::quiet_NaN()";
+		if (std::isinf(d))
+			return d > 0 ? "std::numeric_limits<double>::infinity()" : "-std::numeric_limits<double>::infinity()";
+
+		std::ostringstream ss;
+		ss << std::setprecision(std::numeric_limits<double>::max_digits10) << std::showpoint << d;
+		return ss.str();
+	}
+
+	// Control characters are written as octal escapes, so no character of s can end the literal or its line
+	std::string string_literal(const std::string& s)
+	{
+		std::string ret = "\"";
+		for (char c : s) {
+			auto u = static_cast<unsigned char>(c);
+			if (u < 0x20 || u == 0x7f) {
+				char escape[5];
+				std::snprintf(escape, sizeof(escape), "\\%03o", u);
+				ret += escape;
+				continue;
+			}
+			if (c == '"' || c == '\\')
+				ret += '\\';
+			ret += c;
+		}
+		return ret + "\"";
+	}
+
+	std::string string_list(const std::vector<std::string>& list)
+	{
+		std::string ret = "{ ";
+		for (int i = 0; i < list.size(); ++i) {
+			ret += string_literal(list[i]) + (i + 1 < list.size() ? ", " : " ");
+		}
+		return ret + "}";
+	}
+
+	std::string int_list(const std::vector<std::int32_t>& list)
+	{
+		std::string ret = "{ ";
+		for (int i = 0; i < list.size(); ++i) {
+			ret += std::to_string(list[i]) + (i + 1 < list.size() ? ", " : " ");
+		}
+		return ret + "}";
+	}
+
+}
+
+std::string tc::optim::mp_generate_plugin_source(const std::string& name, const MP_Expr& expr)
+{
+	using namespace tc::expression;
+
+	auto& tape = expr.tape;
+	auto& instrs = tape.instructions();
+	std::int32_t npar = expr.parameters.size();
+	std::int32_t nroots = tape.roots().size();
+
+	std::vector<std::int32_t> diff_slots;
+	for (int i = 0; i < expr.num_diffs(); ++i) {
+		diff_slots.push_back(expr.diff_slot(i));
+	}
+	std::vector<std::int32_t> seconddiff_slots;
+	for (int i = 0; i < expr.num_seconddiffs(); ++i) {
+		seconddiff_slots.push_back(expr.seconddiff_slot(i));
+	}
+
+	std::ostringstream src;
+
+	src << "// Generated model plugin " << name << ", do not edit\n";
+	src << "// " << string_literal(expr.expression) << "\n\n";
+	src << "#include \"Optim/MP/mp_plugin.hpp\"\n\n";
+	src << "namespace {\n\n";
+
+	src << "\tconstexpr std::int32_t NUM_SLOTS = " << tape.num_slots() << ";\n";
+	src << "\tconstexpr std::int32_t NUM_ROOTS = " << nroots << ";\n";
+	src << "\tconstexpr std::int32_t NUM_PARAMETERS = " << npar << ";\n";
+	src << "\tconstexpr std::int32_t EVAL_SLOT = " << expr.eval_slot() << ";\n";
+	src << "\tconst std::vector<std::int32_t> DIFF_SLOTS = " << int_list(diff_slots) << ";\n";
+	src << "\tconst std::vector<std::int32_t> SECONDDIFF_SLOTS = " << int_list(seconddiff_slots) << ";\n\n";
+
+	// Literals are created once in double precision, a 0-dim double never promotes a float tensor
+	auto& literals = tape.literals();
+	bool complex_literals = false;
+	for (int i = 0; i < literals.size(); ++i) {
+		auto& lit = literals[i];
+		src << "\tconst torch::Tensor LITERAL_" << i << " = torch::scalar_tensor(";
+		if (lit.is_imaginary && lit.num.imag() != 0.0) {
+			src << "c10::complex<double>(" << double_literal(lit.num.real()) << ", " << double_literal(lit.num.imag()) << "), torch::kComplexDouble";
+			complex_literals = true;
+		}
+		else {
+			src << double_literal(lit.num.real()) << ", torch::kDouble";
+		}
+		src << ");\n";
+	}
+	src << "\n";
+
+	// Straight line evaluation of the first nroots roots
+	src << "\tvoid eval_slots(const std::vector<torch::Tensor>& constants, const torch::Tensor& parameters, std::int32_t nroots, std::vector<torch::Tensor>& s)\n";
+	src << "\t{\n";
+	src << "\t\ts.resize(NUM_SLOTS);\n";
+	if (complex_literals) {
+		// Complex literals do promote float tensors, so like on the tape they follow the precision of the inputs
+		src << "\t\tbool double_inputs = parameters.scalar_type() == torch::kDouble;\n";
+		src << "\t\tfor (auto& c : constants)\n";
+		src << "\t\t\tdouble_inputs = double_inputs || c.scalar_type() == torch::kDouble || c.scalar_type() == torch::kComplexDouble;\n";
+	}
+	std::int32_t root = 0;
+	for (int i = 0; i < instrs.size(); ++i) {
+		auto& instr = instrs[i];
+		src << "\t\ts[" << instr.out << "] = ";
+		switch (instr.op) {
+		case TapeOp::INPUT:
+			if (instr.payload < npar)
+				src << "parameters.select(1, " << instr.payload << ").unsqueeze(-1)";
+			else
+				src << "constants[" << instr.payload - npar << "]";
+			break;
+		case TapeOp::LITERAL:
+		{
+			auto& lit = literals[instr.payload];
+			if (lit.is_imaginary && lit.num.imag() != 0.0)
+				src << "double_inputs ? LITERAL_" << instr.payload << " : LITERAL_" << instr.payload << ".to(torch::kComplexFloat)";
+			else
+				src << "LITERAL_" << instr.payload;
+		}
+		break;
+		case TapeOp::TENSOR:
+			throw std::runtime_error("tapes holding tensors can't be generated as source");
+		case TapeOp::CUSTOM:
+			throw std::runtime_error("tapes calling custom functions can't be generated as source");
+		case TapeOp::CONCAT:
+			throw std::runtime_error("multi output tapes can't be generated as source");
+		default:
+			src << op_function(instr.op) << "(";
+			for (int j = 0; j < instr.in.size(); ++j) {
+				src << "s[" << instr.in[j] << "]" << (j + 1 < instr.in.size() ? ", " : "");
+			}
+			src << ")";
+		}
+		src << ";\n";
+
+		while (root < nroots - 1 && tape.root_end(root) == i + 1) {
+			src << "\t\tif (nroots == " << root + 1 << ")\n\t\t\treturn;\n";
+			++root;
+		}
+	}
+	src << "\t}\n\n";
+
+	src << "\tvoid func(const std::vector<torch::Tensor>& constants, const torch::Tensor& parameters,\n";
+	src << "\t\ttorch::Tensor& values, tc::OptOutRef<torch::Tensor> jacobian, tc::OptOutRef<torch::Tensor> hessian, tc::OptRef<const torch::Tensor> data)\n";
+	src << "\t{\n";
+	src << "\t\tstd::vector<torch::Tensor> s;\n";
+	src << "\t\teval_slots(constants, parameters, hessian.has_value() ? NUM_ROOTS : (jacobian.has_value() ? 1 + NUM_PARAMETERS : 1), s);\n";
+	src << "\t\ttc::optim::mp_plugin_assemble(s, EVAL_SLOT, DIFF_SLOTS, SECONDDIFF_SLOTS, values, jacobian, hessian, data);\n";
+	src << "\t}\n\n";
+
+	src << "\tvoid firstdiff(const std::vector<torch::Tensor>& constants, const torch::Tensor& parameters, int32_t index, torch::Tensor& derivative)\n";
+	src << "\t{\n";
+	src << "\t\tstd::vector<torch::Tensor> s;\n";
+	src << "\t\teval_slots(constants, parameters, 2 + index, s);\n";
+	src << "\t\ttc::optim::mp_plugin_write(s[DIFF_SLOTS[index]], derivative);\n";
+	src << "\t}\n\n";
+
+	src << "\tvoid seconddiff(const std::vector<torch::Tensor>& constants, const torch::Tensor& parameters, const std::pair<int32_t, int32_t>& indices, torch::Tensor& secondderivative)\n";
+	src << "\t{\n";
+	src << "\t\tstd::int32_t index = tc::optim::mp_plugin_seconddiff_index(indices);\n";
+	src << "\t\tstd::vector<torch::Tensor> s;\n";
+	src << "\t\teval_slots(constants, parameters, 2 + NUM_PARAMETERS + index, s);\n";
+	src << "\t\ttc::optim::mp_plugin_write(s[SECONDDIFF_SLOTS[index]], secondderivative);\n";
+	src << "\t}\n\n";
+
+	src << "}\n\n";
+
+	std::vector<std::string> constants = expr.constants.has_value() ? expr.constants.value() : std::vector<std::string>();
+
+	src << "TC_PLUGIN_EXPORT const tc::optim::MP_ModelPlugin* tc_mp_model_plugin()\n";
+	src << "{\n";
+	src << "\tstatic const tc::optim::MP_ModelPlugin plugin{\n";
+	src << "\t\ttc::optim::MP_PLUGIN_ABI_VERSION,\n";
+	src << "\t\t" << string_literal(name) << ",\n";
+	src << "\t\t" << string_literal(expr.expression) << ",\n";
+	src << "\t\t" << string_list(expr.parameters) << ",\n";
+	src << "\t\t" << string_list(constants) << ",\n";
+	src << "\t\t&func,\n";
+	src << "\t\t&firstdiff,\n";
+	src << "\t\t&seconddiff\n";
+	src << "\t};\n";
+	src << "\treturn &plugin;\n";
+	src << "}\n";
+
+	return src.str();
+}
+
+std::string tc::optim::mp_generate_plugin_source(const std::string& name, const std::string& expression,
+	const std::vector<std::string>& parameters, tc::OptRef<const std::vector<std::string>> constants)
+{
+	auto expr = MP_ExprCache::instance().get(expression, parameters, constants);
+	return mp_generate_plugin_source(name, *expr);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "../../pch.hpp"
+
+#include "mp_expr.hpp"
+
+namespace tc {
+	namespace optim {
+
+		// C++ source of a model plugin evaluating expr with straight line libtorch calls, one per tape instruction.
+		// The source includes Optim/MP/mp_plugin.hpp, exports MP_PLUGIN_ENTRY and links against ComputeLib
+		std::string mp_generate_plugin_source(const std::string& name, const MP_Expr& expr);
+
+		// As above, with the derivatives of expression found symbolically
+		std::string mp_generate_plugin_source(const std::string& name, const std::string& expression,
+			const std::vector<std::string>& parameters, tc::OptRef<const std::vector<std::string>> constants);
+
+	}
+}
@@ -3,6 +3,19 @@
 #include "mp_expr.hpp"
 #include "../../Expression/Parser/lexer.hpp"
 #include "../../Expression/Parser/shunter.hpp"
+#include "../../Expression/Simplify/simplify.hpp"
+#include "../../Expression/Tape/serialize.hpp"
+
+namespace {
+
+	// Loaded models have no trees, so nothing ever fetches through this
+	const tc::expression::FetcherMap& empty_fetcher_map()
+	{
+		static const tc::expression::FetcherMap fetcher_map;
+		return fetcher_map;
+	}
+
+}
 
 
 
@@ -10,8 +23,9 @@ tc::optim::MP_Expr::MP_Expr(const std::string& expression,
 	const tc::expression::FetcherMap& fetcher_map,
 	const std::vector<std::string>& parameters,
 	tc::OptRef<const std::vector<std::string>> constants)
-	: fetcher_map(fetcher_map)
+	: m_pArena(std::make_unique<tc::expression::Arena>()), fetcher_map(fetcher_map)
 {
+	tc::expression::ArenaScope arena_scope(*m_pArena);
 
 	tc::expression::LexContext context;
 	this->parameters = parameters;
@@ -28,7 +42,8 @@ tc::optim::MP_Expr::MP_Expr(const std::string& expression,
 		}
 	}
 
-	tc::expression::Lexer lexer(std::move(context));
+	auto lexcontext = context;
+	tc::expression::Lexer lexer(std::move(lexcontext));
 
 	auto toks = lexer.lex(expression);
 
@@ -37,22 +52,64 @@ tc::optim::MP_Expr::MP_Expr(const std::string& expression,
 
 	eval = std::make_unique<tc::expression::Expression>(shunter_toks,
 		tc::expression::Expression::default_expression_creation_map(), this->fetcher_map);
+	tc::expression::simplify(*eval, context);
 
-	// Create diff expressions
-	for (auto& p : this->parameters) {
-		diff.emplace_back(eval->exprdiffnode(tc::expression::VariableToken(p)));
-	}
-	// Get back diff expressions // TODO
+	differentiate(context);
 
+	compile_tapes();
+}
 
-	// Create seconddiff expressions
-	for (int i = 0; i < diff.size(); ++i) {
-		for (int j = 0; j < i + 1; ++j) {
-			seconddiff.emplace_back(diff[i]->exprdiffnode(tc::expression::VariableToken(parameters[j])));
+tc::optim::MP_Expr::MP_Expr(const std::vector<std::string>& expressions,
+	const tc::expression::FetcherMap& fetcher_map,
+	const std::vector<std::string>& parameters,
+	tc::OptRef<const std::vector<std::string>> constants)
+	: m_pArena(std::make_unique<tc::expression::Arena>()), fetcher_map(fetcher_map)
+{
+	tc::expression::ArenaScope arena_scope(*m_pArena);
+
+	if (expressions.empty())
+		throw std::runtime_error("a multi output model needs at least one output expression");
+
+	this->expressions = expressions;
+	this->parameters = parameters;
+	if (constants.has_value())
+		this->constants = constants;
+
+	tc::expression::LexContext basecontext;
+	for (auto& var : this->parameters) {
+		basecontext.variables.emplace_back(var);
+	}
+	if (constants.has_value()) {
+		for (auto& var : this->constants.value()) {
+			basecontext.variables.emplace_back(var);
 		}
 	}
-	// Get back seconddiff expressions // TODO
 
+	// Every output is its own piece and gives its own shape
+	std::vector<std::shared_ptr<tc::expression::Node>> outputs;
+	for (auto& expr : expressions) {
+		auto context = basecontext;
+		tc::expression::Lexer lexer(std::move(context));
+
+		auto toks = lexer.lex(expr);
+
+		tc::expression::Shunter shunter;
+		auto shunter_toks = shunter.shunt(std::move(toks));
+
+		tc::expression::Expression output(shunter_toks, tc::expression::Expression::default_expression_creation_map(), this->fetcher_map);
+		outputs.push_back(output.m_Children[0]);
+	}
+
+	// A single output is its own value, there is nothing to concatenate
+	if (outputs.size() == 1)
+		eval = std::make_unique<tc::expression::Expression>(outputs[0], this->fetcher_map);
+	else
+		eval = std::make_unique<tc::expression::Expression>(std::make_shared<tc::expression::ConcatNode>(outputs, outputs), this->fetcher_map);
+	tc::expression::simplify(*eval, basecontext);
+
+	differentiate(basecontext);
+
+	compile_tapes();
 }
 
 tc::optim::MP_Expr::MP_Expr(const std::string& expression,
@@ -60,8 +117,9 @@ tc::optim::MP_Expr::MP_Expr(const std::string& expression,
 	const tc::expression::FetcherMap& fetcher_map,
 	const std::vector<std::string>& parameters,
 	tc::OptRef<const std::vector<std::string>> constants)
-	: fetcher_map(fetcher_map)
+	: m_pArena(std::make_unique<tc::expression::Arena>()), fetcher_map(fetcher_map)
 {
+	tc::expression::ArenaScope arena_scope(*m_pArena);
 
 	this->expression = expression;
 	this->parameters = parameters;
@@ -94,6 +152,7 @@ tc::optim::MP_Expr::MP_Expr(const std::string& expression,
 
 		eval = std::make_unique<tc::expression::Expression>(shunter_toks,
 			tc::expression::Expression::default_expression_creation_map(), this->fetcher_map);
+		tc::expression::simplify(*eval, basecontext);
 	}
 
 	// Diff
@@ -107,18 +166,22 @@ tc::optim::MP_Expr::MP_Expr(const std::string& expression,
 		auto shunter_toks = shunter.shunt(std::move(toks));
 
 		diff.emplace_back(std::make_unique<tc::expression::Expression>(shunter_toks, tc::expression::Expression::default_expression_creation_map(), this->fetcher_map));
+		tc::expression::simplify(*diff.back(), basecontext);
 	}
 
 	// Create seconddiff expressions
+	tc::expression::DiffMemo memo;
 	for (int i = 0; i < diff.size(); ++i) {
 		for (int j = 0; j < i + 1; ++j) {
-			seconddiff.emplace_back(diff[i]->exprdiffnode(tc::expression::VariableToken(parameters[j])));
+			seconddiff.emplace_back(diff[i]->exprdiffnode(tc::expression::VariableToken(parameters[j]), memo));
+			tc::expression::simplify(*seconddiff.back(), basecontext);
 		}
 	}
 
 	// Get back hessian expressions here
 	// TODO
 
+	compile_tapes();
 }
 
 tc::optim::MP_Expr::MP_Expr(const std::string& expression,
@@ -127,8 +190,12 @@ tc::optim::MP_Expr::MP_Expr(const std::string& expression,
 	const tc::expression::FetcherMap& fetcher_map,
 	const std::vector<std::string>& parameters,
 	tc::OptRef<const std::vector<std::string>> constants)
-	: fetcher_map(fetcher_map)
+	: m_pArena(std::make_unique<tc::expression::Arena>()), fetcher_map(fetcher_map)
 {
+	tc::expression::ArenaScope arena_scope(*m_pArena);
+	this->expression = expression;
+	this->diffexpressions = diffexpressions;
+	this->seconddiffexpressions = seconddiffexpressions;
 	this->parameters = parameters;
 	if (constants.has_value())
 		this->constants = constants;
@@ -165,6 +232,7 @@ tc::optim::MP_Expr::MP_Expr(const std::string& expression,
 
 		eval = std::make_unique<tc::expression::Expression>(shunter_toks,
 			tc::expression::Expression::default_expression_creation_map(), this->fetcher_map);
+		tc::expression::simplify(*eval, basecontext);
 	}
 
 	// Diff
@@ -178,6 +246,7 @@ tc::optim::MP_Expr::MP_Expr(const std::string& expression,
 		auto shunter_toks = shunter.shunt(std::move(toks));
 
 		diff.emplace_back(std::make_unique<tc::expression::Expression>(shunter_toks, tc::expression::Expression::default_expression_creation_map(), this->fetcher_map));
+		tc::expression::simplify(*diff.back(), basecontext);
 	}
 
 	// Second diff
@@ -191,6 +260,226 @@ tc::optim::MP_Expr::MP_Expr(const std::string& expression,
 		auto shunter_toks = shunter.shunt(std::move(toks));
 
 		seconddiff.emplace_back(std::make_unique<tc::expression::Expression>(shunter_toks, tc::expression::Expression::default_expression_creation_map(), this->fetcher_map));
+		tc::expression::simplify(*seconddiff.back(), basecontext);
 	}
 
+	compile_tapes();
+}
+
+tc::optim::MP_Expr::MP_Expr(std::istream& in)
+	: fetcher_map(empty_fetcher_map())
+{
+	using namespace tc::expression;
+
+	read_binary_header(in, "TCMP", MP_EXPR_FORMAT_VERSION);
+
+	expression = read_binary_string(in);
+	expressions = read_binary_vector<std::string>(in);
+	diffexpressions = read_binary_vector<std::string>(in);
+	seconddiffexpressions = read_binary_vector<std::string>(in);
+	parameters = read_binary_vector<std::string>(in);
+	if (read_binary<std::uint8_t>(in) != 0)
+		constants = read_binary_vector<std::string>(in);
+
+	m_DiffSparsity = read_binary_vector<std::int32_t>(in);
+	m_SecondDiffSparsity = read_binary_vector<std::int32_t>(in);
+
+	tape = Tape::load(in);
+
+	std::int32_t npars = parameters.size();
+	if (m_DiffSparsity.size() != npars || m_SecondDiffSparsity.size() != npars * (npars + 1) / 2 ||
+		tape.roots().size() != 1 + m_DiffSparsity.size() + m_SecondDiffSparsity.size())
+	{
+		throw std::runtime_error("serialized model does not match its tape");
+	}
+
+	// Tape inputs are bound to the parameters followed by the constants, see compile_tapes
+	std::vector<std::string> input_names = parameters;
+	if (constants.has_value()) {
+		input_names.insert(input_names.end(), constants.value().begin(), constants.value().end());
+	}
+	if (tape.input_names() != input_names)
+		throw std::runtime_error("serialized model tape inputs are not its parameters and constants");
+
+	auto valid_sparsity = [](std::int32_t s) { return s >= MP_Sparsity::ZERO && s <= MP_Sparsity::VARYING; };
+	if (!std::all_of(m_DiffSparsity.begin(), m_DiffSparsity.end(), valid_sparsity) ||
+		!std::all_of(m_SecondDiffSparsity.begin(), m_SecondDiffSparsity.end(), valid_sparsity))
+	{
+		throw std::runtime_error("serialized model has an invalid sparsity");
+	}
+
+	// Several outputs are concatenated by the evaluation root, the sparsity of the jacobian blocks depends on it
+	if (expressions.size() > 1) {
+		auto& instrs = tape.instructions();
+		auto root = std::find_if(instrs.begin(), instrs.end(), [this](const TapeInstruction& instr) { return instr.out == tape.root(); });
+		if (root == instrs.end() || root->op != TapeOp::CONCAT)
+			throw std::runtime_error("serialized multi output model does not concatenate its outputs");
+	}
+}
+
+void tc::optim::MP_Expr::save(std::ostream& out) const
+{
+	using namespace tc::expression;
+
+	write_binary_header(out, "TCMP", MP_EXPR_FORMAT_VERSION);
+
+	write_binary(out, expression);
+	write_binary(out, expressions);
+	write_binary(out, diffexpressions);
+	write_binary(out, seconddiffexpressions);
+	write_binary(out, parameters);
+	write_binary<std::uint8_t>(out, constants.has_value());
+	if (constants.has_value())
+		write_binary(out, constants.value());
+
+	write_binary(out, m_DiffSparsity);
+	write_binary(out, m_SecondDiffSparsity);
+
+	tape.save(out);
+}
+
+void tc::optim::MP_Expr::differentiate(const tc::expression::LexContext& context)
+{
+	// One memo for all derivatives, so subterms shared between them and with eval are differentiated once
+	tc::expression::DiffMemo memo;
+
+	for (auto& p : parameters) {
+		diff.emplace_back(eval->exprdiffnode(tc::expression::VariableToken(p), memo));
+		tc::expression::simplify(*diff.back(), context);
+	}
+
+	for (int i = 0; i < diff.size(); ++i) {
+		for (int j = 0; j < i + 1; ++j) {
+			seconddiff.emplace_back(diff[i]->exprdiffnode(tc::expression::VariableToken(parameters[j]), memo));
+			tc::expression::simplify(*seconddiff.back(), context);
+		}
+	}
+}
+
+void tc::optim::MP_Expr::compile_tapes()
+{
+	std::vector<tc::refw<const tc::expression::Node>> roots;
+	roots.reserve(1 + diff.size() + seconddiff.size());
+
+	roots.emplace_back(*eval);
+	for (auto& d : diff) {
+		roots.emplace_back(*d);
+	}
+	for (auto& sd : seconddiff) {
+		roots.emplace_back(*sd);
+	}
+
+	// Tape inputs are bound to the parameters followed by the constants
+	std::vector<std::string> input_names = parameters;
+	if (constants.has_value()) {
+		input_names.insert(input_names.end(), constants.value().begin(), constants.value().end());
+	}
+
+	tape = tc::expression::Tape(roots, input_names);
+
+	m_DiffSparsity.clear();
+	for (auto& d : diff) {
+		m_DiffSparsity.push_back(sparsity(*d));
+	}
+	m_SecondDiffSparsity.clear();
+	for (auto& sd : seconddiff) {
+		m_SecondDiffSparsity.push_back(sparsity(*sd));
+	}
+}
+
+std::int32_t tc::optim::MP_Expr::sparsity(const tc::expression::Node& node) const
+{
+	using namespace tc::expression;
+
+	// The trees are simplified, so a derivative that is identically zero has been folded to a single token
+	const Node* root = &node;
+	while (root->get_node_type() == NodeType::EXPRESSION_NODE) {
+		root = root->m_Children[0].get();
+	}
+	std::int32_t type = root->get_node_type();
+
+	// The shapes of a concatenation are output values, only its pieces decide
+	if (type == NodeType::CONCAT_NODE) {
+		std::int32_t ret = MP_Sparsity::ZERO;
+		for (int i = 0; i < static_cast<const ConcatNode&>(*root).num_pieces(); ++i) {
+			ret = std::max(ret, sparsity(*root->m_Children[i]));
+		}
+		return ret;
+	}
+
+	if (type == NodeType::TOKEN_NODE || type == NodeType::TOKEN_FETCHER_NODE) {
+		auto& tok = *root->m_pToken;
+		if (tok.get_token_type() == TokenType::ZERO_TYPE)
+			return MP_Sparsity::ZERO;
+		if (tok.get_token_type() == TokenType::NUMBER_TYPE && static_cast<const NumberToken&>(tok).num == std::complex<float>(0.0f))
+			return MP_Sparsity::ZERO;
+	}
+
+	// Subtrees are shared, so each node is visited once
+	std::unordered_map<const Node*, bool> visited;
+	std::function<bool(const Node&)> varying = [this, &varying, &visited](const Node& n) {
+		auto it = visited.find(&n);
+		if (it != visited.end())
+			return it->second;
+
+		bool result = false;
+		if (n.get_node_type() == NodeType::VARIABLE_NODE) {
+			auto& name = static_cast<const VariableNode&>(n).get_variable_token().name;
+			result = std::find(parameters.begin(), parameters.end(), name) != parameters.end();
+		}
+		for (auto& child : n.m_Children) {
+			if (result)
+				break;
+			result = varying(*child);
+		}
+		visited.emplace(&n, result);
+		return result;
+	};
+
+	return varying(node) ? MP_Sparsity::VARYING : MP_Sparsity::CONSTANT;
+}
+
+std::int32_t tc::optim::MP_Expr::eval_slot() const
+{
+	return tape.roots()[0];
+}
+
+std::int32_t tc::optim::MP_Expr::diff_slot(std::int32_t index) const
+{
+	return tape.roots()[1 + index];
+}
+
+std::int32_t tc::optim::MP_Expr::seconddiff_slot(std::int32_t index) const
+{
+	return tape.roots()[1 + parameters.size() + index];
+}
+
+std::int32_t tc::optim::MP_Expr::num_diffs() const
+{
+	return parameters.size();
+}
+
+std::int32_t tc::optim::MP_Expr::num_seconddiffs() const
+{
+	return tape.roots().size() - 1 - parameters.size();
+}
+
+std::int32_t tc::optim::MP_Expr::num_outputs() const
+{
+	return expressions.empty() ? 1 : expressions.size();
+}
+
+std::size_t tc::optim::MP_Expr::arena_bytes() const
+{
+	return m_pArena ? m_pArena->bytes_allocated() : 0;
+}
+
+std::int32_t tc::optim::MP_Expr::diff_sparsity(std::int32_t index) const
+{
+	return m_DiffSparsity[index];
+}
+
+std::int32_t tc::optim::MP_Expr::seconddiff_sparsity(std::int32_t index) const
+{
+	return m_SecondDiffSparsity[index];
 }
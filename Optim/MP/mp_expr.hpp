@@ -2,13 +2,36 @@
 
 #include "../../pch.hpp"
 
+#include "../../Expression/arena.hpp"
 #include "../../Expression/expression.hpp"
 #include "../../Expression/nodes.hpp"
+#include "../../Expression/Parser/lexer.hpp"
+#include "../../Expression/Tape/tape.hpp"
 
 namespace tc {
 	namespace optim {
 
+		struct MP_Sparsity {
+			enum {
+				// identically zero
+				ZERO,
+				// only depends on constants, the same in every iteration
+				CONSTANT,
+				// depends on the parameters
+				VARYING,
+			};
+		};
+
+		// Bumped whenever the binary model format changes, older streams are rejected
+		constexpr std::uint32_t MP_EXPR_FORMAT_VERSION = 2;
+
 		class MP_Expr {
+		private:
+
+			// Backs every token and node created while the trees are built and differentiated, declared
+			// first so that it is destroyed after the trees
+			std::unique_ptr<tc::expression::Arena> m_pArena;
+
 		public:
 
 			MP_Expr(const std::string& expression, 
@@ -29,7 +52,23 @@ namespace tc {
 				const std::vector<std::string>& parameters,
 				tc::OptRef<const std::vector<std::string>> constants);
 
+			// A model of several outputs over the same parameters and constants, compiled to one tree whose value is the
+			// outputs concatenated along the last dimension in order, see ConcatNode. Subterms shared between
+			// the outputs are lowered and differentiated once
+			MP_Expr(const std::vector<std::string>& expressions,
+				const tc::expression::FetcherMap& fetcher_map,
+				const std::vector<std::string>& parameters,
+				tc::OptRef<const std::vector<std::string>> constants);
+
+			// Reads a model written by save. Lexing, shunting and differentiation are skipped, the loaded model
+			// only has its tape and no expression trees, so eval, diff and seconddiff stay empty
+			MP_Expr(std::istream& in);
+
+			// Writes the expressions, names, sparsity and compiled tape in the binary model format
+			void save(std::ostream& out) const;
+
 			std::string expression;
+			std::vector<std::string> expressions; // the outputs of multi output models, empty otherwise
 			std::unique_ptr<tc::expression::Expression> eval;
 
 			std::vector<std::string> diffexpressions;
@@ -38,11 +77,51 @@ namespace tc {
 			std::vector<std::string> seconddiffexpressions;
 			std::vector<std::unique_ptr<tc::expression::Expression>> seconddiff;
 
+			// eval, diff and seconddiff lowered to one tape with shared subexpressions, the tape
+			// roots are ordered eval, diff, seconddiff so evaluating the first 1, 1 + nparams or all
+			// roots gives values, values + jacobian or values + jacobian + hessian terms. Input i of the
+			// tape is parameter i for i < nparams and constant i - nparams after that
+			tc::expression::Tape tape;
+
+			std::int32_t eval_slot() const;
+
+			std::int32_t diff_slot(std::int32_t index) const;
+
+			std::int32_t seconddiff_slot(std::int32_t index) const;
+
+			// Number of jacobian columns and of unique hessian entries, also for loaded models
+			std::int32_t num_diffs() const;
+
+			std::int32_t num_seconddiffs() const;
+
+			// 1 unless the model was made from several output expressions
+			std::int32_t num_outputs() const;
+
+			// Bytes taken from the arena by lexing, differentiation and simplification, 0 for loaded models
+			std::size_t arena_bytes() const;
+
+			// MP_Sparsity of jacobian column index and of seconddiff index, found from the simplified trees
+			std::int32_t diff_sparsity(std::int32_t index) const;
+
+			std::int32_t seconddiff_sparsity(std::int32_t index) const;
+
 			std::vector<std::string> parameters;
 			std::optional<std::vector<std::string>> constants;
 
 			const tc::expression::FetcherMap& fetcher_map;
 
+		private:
+
+			// Creates diff and seconddiff from eval
+			void differentiate(const tc::expression::LexContext& context);
+
+			void compile_tapes();
+
+			std::int32_t sparsity(const tc::expression::Node& node) const;
+
+			std::vector<std::int32_t> m_DiffSparsity;
+			std::vector<std::int32_t> m_SecondDiffSparsity;
+
 		};
 
 	}
@@ -1,9 +1,12 @@
 #include "../../pch.hpp"
 
 #include "mp_model.hpp"
+#include "mp_cache.hpp"
 
 #include "../../Compute/gradients.hpp"
 
+#include <chrono>
+
 tc::optim::MP_Model::MP_Model(const MP_EvalDiffHessFunc& func, const MP_FirstDiff& firstdiff, const MP_SecondDiff& seconddiff)
 	: m_Func(func), m_FirstDiff(firstdiff), m_SecondDiff(seconddiff)
 {
@@ -12,102 +15,45 @@ tc::optim::MP_Model::MP_Model(const MP_EvalDiffHessFunc& func, const MP_FirstDif
 
 tc::optim::MP_Model::MP_Model(const std::string& expression, const std::vector<std::string>& parameters, tc::OptRef<const std::vector<std::string>> constants)
 {
-	m_pFetcherMap = std::make_unique<tc::expression::FetcherMap>();
-	int32_t size = constants.has_value() ? parameters.size() + constants.value().get().size() : parameters.size();
-	m_pFetcherMap->reserve(size);
-
-	// Constants
-	if (constants.has_value()) {
-		auto& consts = constants.value().get();
-		for (int i = 0; i < consts.size(); ++i) {
-			tc::expression::FetcherFunc constant_fetcher = [this, i]() {
-				return m_Constants[i];
-			};
-
-			m_pFetcherMap->emplace(consts[i], constant_fetcher);
-			
-		}
-	}
-
-	// Parameters
-	for (int i = 0; i < parameters.size(); ++i) {
-		tc::expression::FetcherFunc par_fetcher = [this, i]() {
-			return m_Parameters.select(1, i).unsqueeze(-1);
-		};
-
-		m_pFetcherMap->emplace(parameters[i], std::move(par_fetcher));
-	}
-
-	m_pExpr = std::make_unique<MP_Expr>(std::move(MP_Expr(expression, *m_pFetcherMap, parameters, constants)));
+	m_pExpr = MP_ExprCache::instance().get(expression, parameters, constants);
 
 	build_funcs_from_expr();
-
 }
 
 tc::optim::MP_Model::MP_Model(const std::string& expression, const std::vector<std::string>& diffexpressions, const std::vector<std::string>& parameters, tc::OptRef<const std::vector<std::string>> constants)
 {
-	m_pFetcherMap = std::make_unique<tc::expression::FetcherMap>();
-	int32_t size = constants.has_value() ? parameters.size() + constants.value().get().size() : parameters.size();
-	m_pFetcherMap->reserve(size);
-
-	// Constants
-	if (constants.has_value()) {
-		auto& consts = constants.value().get();
-		for (int i = 0; i < consts.size(); ++i) {
-			tc::expression::FetcherFunc constant_fetcher = [this, i]() {
-				return m_Constants[i];
-			};
-
-			m_pFetcherMap->emplace(consts[i], constant_fetcher);
-
-		}
-	}
-
-	// Parameters
-	for (int i = 0; i < parameters.size(); ++i) {
-		tc::expression::FetcherFunc par_fetcher = [this, i]() {
-			return m_Parameters.select(1, i).unsqueeze(-1);
-		};
-
-		m_pFetcherMap->emplace(parameters[i], std::move(par_fetcher));
-	}
-
-	m_pExpr = std::make_unique<MP_Expr>(std::move(MP_Expr(expression, *m_pFetcherMap, parameters, constants)));
+	m_pExpr = MP_ExprCache::instance().get(expression, diffexpressions, parameters, constants);
 
 	build_funcs_from_expr();
 }
 
 tc::optim::MP_Model::MP_Model(const std::string& expression, const std::vector<std::string>& diffexpressions, const std::vector<std::string>& seconddiffexpressions, const std::vector<std::string>& parameters, tc::OptRef<const std::vector<std::string>> constants)
 {
-	m_pFetcherMap = std::make_unique<tc::expression::FetcherMap>();
-	int32_t size = constants.has_value() ? parameters.size() + constants.value().get().size() : parameters.size();
-	m_pFetcherMap->reserve(size);
+	m_pExpr = MP_ExprCache::instance().get(expression, diffexpressions, seconddiffexpressions, parameters, constants);
 
-	// Constants
-	if (constants.has_value()) {
-		auto& consts = constants.value().get();
-		for (int i = 0; i < consts.size(); ++i) {
-			tc::expression::FetcherFunc constant_fetcher = [this, i]() {
-				return m_Constants[i];
-			};
+	build_funcs_from_expr();
+}
 
-			m_pFetcherMap->emplace(consts[i], constant_fetcher);
+tc::optim::MP_Model::MP_Model(const std::vector<std::string>& expressions, const std::vector<std::string>& parameters, tc::OptRef<const std::vector<std::string>> constants)
+{
+	m_pExpr = MP_ExprCache::instance().get(expressions, parameters, constants);
 
-		}
-	}
+	build_funcs_from_expr();
+}
 
-	// Parameters
-	for (int i = 0; i < parameters.size(); ++i) {
-		tc::expression::FetcherFunc par_fetcher = [this, i]() {
-			return m_Parameters.select(1, i).unsqueeze(-1);
-		};
+tc::optim::MP_Model::MP_Model(std::istream& in)
+{
+	m_pExpr = std::make_shared<const MP_Expr>(in);
 
-		m_pFetcherMap->emplace(parameters[i], std::move(par_fetcher));
-	}
+	build_funcs_from_expr();
+}
 
-	m_pExpr = std::make_unique<MP_Expr>(std::move(MP_Expr(expression, *m_pFetcherMap, parameters, constants)));
+void tc::optim::MP_Model::save(std::ostream& out) const
+{
+	if (!m_pExpr)
+		throw std::runtime_error("only expression models can be saved");
 
-	build_funcs_from_expr();
+	m_pExpr->save(out);
 }
 
 void tc::optim::MP_Model::to(torch::Device device)
@@ -126,11 +72,26 @@ void tc::optim::MP_Model::to(torch::Device device)
 
 }
 
+void tc::optim::MP_Model::set_jacobian_mode(std::int32_t mode)
+{
+	m_JacobianMode = mode;
+}
+
+void tc::optim::MP_Model::set_execution_mode(std::int32_t mode)
+{
+	m_ExecutionMode = mode;
+}
+
 std::vector<torch::Tensor>& tc::optim::MP_Model::constants()
 {
 	return m_Constants;
 }
 
+void tc::optim::MP_Model::constants_changed()
+{
+	m_ConstantsChanged = true;
+}
+
 torch::Tensor& tc::optim::MP_Model::parameters()
 {
 	return m_Parameters;
@@ -161,6 +122,89 @@ void tc::optim::MP_Model::res_jac_hess(torch::Tensor& residual, torch::Tensor& j
 	return m_Func(m_Constants, m_Parameters, residual, jacobian, hessian, data);
 }
 
+void tc::optim::MP_Model::res_grad(torch::Tensor& residual, torch::Tensor& gradient, const torch::Tensor& data)
+{
+	if (!m_pExpr)
+		throw std::runtime_error("res_grad is only available on expression models");
+
+	auto& tape = m_pExpr->tape;
+	prepare_inputs();
+	tape.eval(m_TapeInputs, m_TapeDiffSlots, 1);
+
+	auto& value = m_TapeDiffSlots[m_pExpr->eval_slot()];
+	if (tc::expression::out_fits(residual, value, data))
+		torch::sub_out(residual, value, data);
+	else
+		residual = torch::sub(value, data);
+
+	tape.eval_reverse(m_TapeDiffSlots, m_TapeSeeds, 0, residual, m_TapeGrads, m_TapeInputAdjoints);
+
+	if (!gradient.defined()) {
+		gradient = torch::zeros({ m_Parameters.size(0), m_Parameters.size(1) }, residual.options());
+	}
+	else {
+		gradient.zero_();
+	}
+
+	// Parameter inputs are (nProblems, 1) so their adjoints already are the summed gradient entries
+	for (int i = 0; i < m_TapeSeeds.size(); ++i) {
+		auto& adj = m_TapeInputAdjoints[i];
+		if (m_TapeSeeds[i] >= 0 && adj.defined()) {
+			gradient.select(1, m_TapeSeeds[i]) += adj.flatten();
+		}
+	}
+}
+
+void tc::optim::MP_Model::res_grad_gn(torch::Tensor& residual, torch::Tensor& gradient, torch::Tensor& gn, const torch::Tensor& data, int64_t block_size)
+{
+	if (block_size < 1)
+		throw std::runtime_error("block_size must be at least 1");
+
+	res_grad(residual, gradient, data);
+
+	int64_t nprob = m_Parameters.size(0);
+	int64_t npar = m_Parameters.size(1);
+	int64_t ndata = data.size(1);
+
+	// Constants of the outputs don't run along the concatenated data dimension, so they can't be narrowed
+	if (m_pExpr->num_outputs() > 1)
+		block_size = ndata;
+
+	if (!gn.defined()) {
+		gn = torch::zeros({ nprob, npar, npar }, residual.options());
+	}
+	else {
+		gn.zero_();
+	}
+
+	// Forward mode over blocks of the data dimension, constants laid out like the data are narrowed.
+	// The blocks get slots of their own so that they don't resize the full size ones
+	auto& tape = m_pExpr->tape;
+	m_TapeBlockInputs.resize(m_TapeInputs.size());
+	for (int64_t start = 0; start < ndata; start += block_size) {
+		int64_t len = std::min(block_size, ndata - start);
+
+		for (int i = 0; i < m_TapeInputs.size(); ++i) {
+			auto& input = m_TapeInputs[i];
+			if (m_TapeSeeds[i] < 0 && input.dim() == data.dim() && input.size(-1) == ndata) {
+				m_TapeBlockInputs[i] = input.narrow(-1, start, len);
+			}
+			else {
+				m_TapeBlockInputs[i] = input;
+			}
+		}
+
+		tape.eval_forward(m_TapeBlockInputs, m_TapeSeeds, npar, m_TapeBlockSlots, m_TapeGrads, 1);
+
+		auto& grad = m_TapeGrads[m_pExpr->eval_slot()];
+		if (!grad.defined())
+			continue;
+
+		auto jblock = grad.expand({ nprob, len, npar });
+		gn.baddbmm_(jblock.transpose(1, 2), jblock);
+	}
+}
+
 void tc::optim::MP_Model::diff(torch::Tensor& value, int32_t index)
 {
 	return m_FirstDiff(m_Constants, m_Parameters, index, value);
@@ -176,8 +220,46 @@ void tc::optim::MP_Model::second_diff(torch::Tensor& value, const std::pair<int3
 
 
 
+void tc::optim::MP_Model::prepare_inputs()
+{
+	int32_t npar = m_pExpr->parameters.size();
+	m_TapeInputs.resize(npar + m_Constants.size());
+
+	// The parameter views only have to be recreated if the parameter tensor or its storage was swapped out,
+	// in place updates by the optimizers are seen through the existing views
+	bool stale = !m_ViewedParameters.defined() || !m_ViewedParameters.is_same(m_Parameters) ||
+		m_ViewedParametersData != m_Parameters.data_ptr() || m_ViewedParameters.sizes() != m_Parameters.sizes() ||
+		m_ViewedParameters.strides() != m_Parameters.strides();
+
+	if (stale) {
+		for (int i = 0; i < npar; ++i) {
+			m_TapeInputs[i] = m_Parameters.select(1, i).unsqueeze(-1);
+		}
+		m_ViewedParameters = m_Parameters;
+		m_ViewedParametersData = m_Parameters.data_ptr();
+	}
+
+	for (int i = 0; i < m_Constants.size(); ++i) {
+		m_TapeInputs[npar + i] = m_Constants[i];
+	}
+}
+
 void tc::optim::MP_Model::build_funcs_from_expr()
 {
+	// Seed the tape inputs that are parameters for forward mode differentiation
+	int32_t npar = m_pExpr->parameters.size();
+	m_TapeSeeds.assign(m_pExpr->tape.input_names().size(), -1);
+	for (int i = 0; i < npar; ++i) {
+		m_TapeSeeds[i] = i;
+	}
+	m_TapeConstantInputs.assign(m_TapeSeeds.size(), true);
+	for (int i = 0; i < npar; ++i) {
+		m_TapeConstantInputs[i] = false;
+	}
+
+	if (tc::expression::FusedKernel::fusible(m_pExpr->tape)) {
+		m_pFused = std::make_unique<tc::expression::FusedKernel>(m_pExpr->tape);
+	}
 	
 	m_Func = [this](
 		// Constants									// Parameters
@@ -185,13 +267,78 @@ void tc::optim::MP_Model::build_funcs_from_expr()
 		// Values								// Jacobian								// Hessian								// Data,
 		tc::OptOutRef<torch::Tensor> values,	tc::OptOutRef<torch::Tensor> jacobian,	tc::OptOutRef<torch::Tensor> hessian,	tc::OptRef<const torch::Tensor> data)
 	{
+		std::int32_t npar = m_pExpr->num_diffs();
+
+		if (m_JacobianMode == MP_JacobianMode::FUSED && m_pFused && !hessian.has_value()) {
+			prepare_inputs();
+			const torch::Tensor& d = data.has_value() ? data.value().get() : torch::Tensor();
+
+			bool fits = m_pFused->supports(m_TapeInputs);
+			if (fits && jacobian.has_value()) {
+				auto sizes = m_pFused->result_sizes(m_TapeInputs, d);
+				sizes.push_back(npar);
+				fits = jacobian.value().get().sizes() == at::IntArrayRef(sizes);
+			}
+
+			if (fits) {
+				torch::Tensor nojacobian;
+				m_pFused->eval(m_TapeInputs, m_TapeSeeds, npar, values.value().get(), d,
+					jacobian.has_value() ? jacobian.value().get() : nojacobian);
+				return;
+			}
+		}
+
+		bool forward = (m_JacobianMode == MP_JacobianMode::FORWARD || m_JacobianMode == MP_JacobianMode::FUSED) &&
+			jacobian.has_value() && !hessian.has_value();
+
+		// One pass over the shared tape, only as far as the requested outputs need
+		if (forward) {
+			auto& tape = m_pExpr->tape;
+			prepare_inputs();
+			tape.eval_forward(m_TapeInputs, m_TapeSeeds, npar, m_TapeDiffSlots, m_TapeGrads, 1);
+		}
+		else if (hessian.has_value()) {
+			eval_tape(m_pExpr->tape.roots().size());
+		}
+		else if (jacobian.has_value()) {
+			eval_tape(1 + npar);
+		}
+		else {
+			eval_tape(1);
+		}
 
-		if (values.has_value()) {
-			values.value().get() = tc::expression::tensor_from_tentok(m_pExpr->eval->eval(), m_Parameters.device());
+		// Slots are written in place by the next evaluation, so results are always written into the callers tensors
+		{
+			auto& value = (forward ? m_TapeDiffSlots : m_TapeSlots)[m_pExpr->eval_slot()];
+			auto& out = values.value().get();
+			if (data.has_value()) {
+				if (tc::expression::out_fits(out, value, data.value().get()))
+					torch::sub_out(out, value, data.value().get());
+				else
+					out = torch::sub(value, data.value().get());
+			}
+			else {
+				tc::expression::tensor_into(value, out);
+			}
 		}
 
-		if (data.has_value()) {
-			values.value().get() -= data.value();
+		if (forward) {
+			// The gradient broadcasts to (nProblems, nData, nParams)
+			auto& grad = m_TapeGrads[m_pExpr->eval_slot()];
+			if (grad.defined()) {
+				jacobian.value().get().copy_(grad);
+			}
+			else {
+				jacobian.value().get().zero_();
+			}
+		}
+		else if (jacobian.has_value()) {
+			for (int i = 0; i < npar; ++i) {
+				if (m_pExpr->diff_sparsity(i) == MP_Sparsity::ZERO)
+					jacobian.value().get().select(2, i).zero_();
+				else
+					jacobian.value().get().select(2, i) = m_TapeSlots[m_pExpr->diff_slot(i)];
+			}
 		}
 
 		if (hessian.has_value()) {
@@ -205,15 +352,24 @@ void tc::optim::MP_Model::build_funcs_from_expr()
 				throw std::runtime_error("data OptRef must be filled if hessian shall be evaluated");
 			}
 
-			int64_t npar = jacobian.value().get().size(2);
-
 			// r @ del2 r
 			{
-				auto it = m_pExpr->seconddiff.begin();
+				int k = 0;
 				for (int i = 0; i < npar; ++i) {
 					for (int j = 0; j < i + 1; ++j) {
-						hessian.value().get().select(1, i).select(1, j) = torch::sum(torch::mul(values.value().get(), tc::expression::tensor_from_tentok((*it)->eval(), m_Parameters.device())), 1);
-						++it;
+						auto hij = hessian.value().get().select(1, i).select(1, j);
+						if (m_pExpr->seconddiff_sparsity(k) == MP_Sparsity::ZERO) {
+							hij.zero_();
+							++k;
+							continue;
+						}
+						auto& seconddiff = m_TapeSlots[m_pExpr->seconddiff_slot(k)];
+						if (tc::expression::out_fits(m_HessianProduct, values.value().get(), seconddiff))
+							torch::mul_out(m_HessianProduct, values.value().get(), seconddiff);
+						else
+							m_HessianProduct = torch::mul(values.value().get(), seconddiff);
+						torch::sum_out(hij, m_HessianProduct, 1);
+						++k;
 					}
 				}
 
@@ -225,23 +381,7 @@ void tc::optim::MP_Model::build_funcs_from_expr()
 				}
 			}
 
-
-			// Jacobian
-			for (int i = 0; i < m_pExpr->diff.size(); ++i) {
-				jacobian.value().get().select(2, i) = tc::expression::tensor_from_tentok(m_pExpr->diff[i]->eval(), m_Parameters.device());
-			}
-
-
-			hessian.value().get() += torch::bmm(jacobian.value().get().transpose(1, 2), jacobian.value().get());
-		}
-
-		if (jacobian.has_value()) {
-			// If we wanted hessian the jacobian is already calculated
-			if (!hessian.has_value()) {
-				for (int i = 0; i < m_pExpr->diff.size(); ++i) {
-					jacobian.value().get().select(2, i) = tc::expression::tensor_from_tentok(m_pExpr->diff[i]->eval(), m_Parameters.device());
-				}
-			}
+			hessian.value().get().baddbmm_(jacobian.value().get().transpose(1, 2), jacobian.value().get());
 		}
 
 	};
@@ -252,7 +392,8 @@ void tc::optim::MP_Model::build_funcs_from_expr()
 		// Derivative
 		torch::Tensor& derivative)
 	{
-		derivative = tc::expression::tensor_from_tentok(m_pExpr->diff[index]->eval(), m_Parameters.device());
+		eval_tape(2 + index);
+		tc::expression::tensor_into(m_TapeSlots[m_pExpr->diff_slot(index)], derivative);
 	};
 
 	m_SecondDiff = [this](
@@ -269,7 +410,138 @@ void tc::optim::MP_Model::build_funcs_from_expr()
 			index = (indices.first * (indices.first + 1) / 2) + indices.second;
 		}
 
-		secondderivative = tc::expression::tensor_from_tentok(m_pExpr->seconddiff[index]->eval(), m_Parameters.device());
+		eval_tape(2 + m_pExpr->num_diffs() + index);
+		tc::expression::tensor_into(m_TapeSlots[m_pExpr->seconddiff_slot(index)], secondderivative);
+	};
+
+}
+
+void tc::optim::MP_Model::eval_tape(std::int32_t nroots)
+{
+	prepare_inputs();
+
+	if (use_script(nroots))
+		eval_tape_scripted(nroots);
+	else
+		eval_tape_eager(nroots);
+}
+
+void tc::optim::MP_Model::eval_tape_eager(std::int32_t nroots)
+{
+	auto& tape = m_pExpr->tape;
+
+	// Constant-only slots are reevaluated when a constant was swapped out or flagged as changed
+	bool refresh = m_ConstantsChanged || m_HoistedConstants.size() != m_Constants.size();
+	for (int i = 0; !refresh && i < m_Constants.size(); ++i) {
+		refresh = !m_HoistedConstants[i].is_same(m_Constants[i]) || m_HoistedConstantsData[i] != m_Constants[i].data_ptr();
+	}
+
+	// Shapes are inferred and the buffers planned once, and again only when the input shapes change
+	if (!tape.plan_matches(m_TapePlan, m_TapeInputs)) {
+		m_TapePlan = tape.plan_buffers(m_TapeInputs, m_TapeConstantInputs, true);
+		tape.allocate_buffers(m_TapePlan, m_TapeBuffers);
+		m_TapeSlots.clear();
+		refresh = true;
+	}
+
+	tape.eval(m_TapeInputs, m_TapePlan, m_TapeBuffers, m_TapeSlots, nroots, refresh);
+
+	if (refresh) {
+		m_HoistedConstants = m_Constants;
+		m_HoistedConstantsData.resize(m_Constants.size());
+		for (int i = 0; i < m_Constants.size(); ++i) {
+			m_HoistedConstantsData[i] = m_Constants[i].data_ptr();
+		}
+		m_ConstantsChanged = false;
+	}
+}
+
+void tc::optim::MP_Model::eval_tape_scripted(std::int32_t nroots)
+{
+	auto& tape = m_pExpr->tape;
+	m_pScripted->run(script_method(nroots), m_TapeInputs, m_ScriptOutputs);
+
+	// Only the root slots are read after eval_tape, the planned eager evaluation reassigns every other slot it uses
+	if (m_TapeSlots.size() < tape.num_slots())
+		m_TapeSlots.resize(tape.num_slots());
+	for (int i = 0; i < m_ScriptOutputs.size(); ++i) {
+		m_TapeSlots[tape.roots()[i]] = m_ScriptOutputs[i];
+	}
+}
+
+std::string tc::optim::MP_Model::script_method(std::int32_t nroots)
+{
+	std::int32_t npar = m_pExpr->num_diffs();
+	std::int32_t nall = m_pExpr->tape.roots().size();
+
+	// One method each for values, values and jacobian, and everything
+	std::string name = "hessian";
+	std::int32_t mroots = nall;
+	if (nroots <= 1) {
+		name = "value";
+		mroots = 1;
+	}
+	else if (nroots <= 1 + npar) {
+		name = "jacobian";
+		mroots = std::min(1 + npar, nall);
+	}
+
+	if (!m_pScripted)
+		m_pScripted = std::make_unique<tc::expression::ScriptedTape>(m_pExpr->tape);
+	if (!m_pScripted->has_method(name))
+		m_pScripted->add_method(name, mroots);
+
+	return name;
+}
+
+bool tc::optim::MP_Model::use_script(std::int32_t nroots)
+{
+	// Models calling custom functions are always evaluated eagerly
+	if (m_ExecutionMode == MP_ExecutionMode::EAGER || !tc::expression::ScriptedTape::scriptable(m_pExpr->tape))
+		return false;
+	if (m_ExecutionMode == MP_ExecutionMode::SCRIPTED)
+		return true;
+
+	// The timings only hold for the input shapes they were made with
+	bool same_sizes = m_ScriptChoiceSizes.size() == m_TapeInputs.size();
+	for (int i = 0; same_sizes && i < m_TapeInputs.size(); ++i) {
+		same_sizes = m_TapeInputs[i].sizes() == at::IntArrayRef(m_ScriptChoiceSizes[i]);
+	}
+	if (!same_sizes) {
+		m_ScriptChoices.clear();
+		m_ScriptChoiceSizes.clear();
+		for (auto& input : m_TapeInputs) {
+			m_ScriptChoiceSizes.push_back(input.sizes().vec());
+		}
+	}
+
+	std::string method = script_method(nroots);
+	auto it = m_ScriptChoices.find(method);
+	if (it != m_ScriptChoices.end())
+		return it->second;
+
+	// The profiling executor only specializes and fuses a graph after its first runs, so both are warmed up first
+	constexpr int warmup_runs = 3;
+	constexpr int timed_runs = 5;
+	auto time = [this](const std::function<void()>& run) {
+		for (int i = 0; i < warmup_runs; ++i) {
+			run();
+		}
+		if (m_Parameters.is_cuda())
+			torch::cuda::synchronize();
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < timed_runs; ++i) {
+			run();
+		}
+		if (m_Parameters.is_cuda())
+			torch::cuda::synchronize();
+		return std::chrono::steady_clock::now() - start;
 	};
 
+	auto eager_time = time([this, nroots]() { eval_tape_eager(nroots); });
+	auto scripted_time = time([this, nroots]() { eval_tape_scripted(nroots); });
+
+	bool scripted = scripted_time < eager_time;
+	m_ScriptChoices[method] = scripted;
+	return scripted;
 }
@@ -5,6 +5,8 @@
 #include <optional>
 #include "../../Expression/expression.hpp"
 #include "mp_expr.hpp"
+#include "../../Expression/Tape/fused.hpp"
+#include "../../Expression/Tape/script.hpp"
 
 namespace tc {
 	namespace optim {
@@ -27,6 +29,29 @@ namespace tc {
 			// Second Derivative
 			torch::Tensor&)>;
 
+		struct MP_JacobianMode {
+			enum {
+				// jacobian columns are evaluated from the symbolic diff expressions
+				SYMBOLIC,
+				// jacobian is evaluated along with the values by forward mode differentiation of the eval expression
+				FORWARD,
+				// values and jacobian are evaluated in one fused loop over the elements, on the cpu for real
+				// models, anything else falls back to FORWARD
+				FUSED,
+			};
+		};
+
+		struct MP_ExecutionMode {
+			enum {
+				// the tape is evaluated one libtorch call per instruction
+				EAGER,
+				// the tape is run as a TorchScript module, letting the graph executor optimize and fuse it
+				SCRIPTED,
+				// both are timed the first time an output set is evaluated for some input shapes, the faster one is kept
+				AUTO,
+			};
+		};
+
 		class MP_Model {
 		public:
 
@@ -50,10 +75,33 @@ namespace tc {
 				const std::vector<std::string>& parameters,
 				tc::OptRef<const std::vector<std::string>> constants);
 
+			// One model of several outputs, residuals and jacobians are those of the outputs concatenated along the data
+			// dimension in order. The outputs are compiled together, so subterms they share are evaluated once
+			MP_Model(const std::vector<std::string>& expressions,
+				const std::vector<std::string>& parameters,
+				tc::OptRef<const std::vector<std::string>> constants);
+
+			// Loads an expression model written by save, without lexing or differentiating anything
+			MP_Model(std::istream& in);
+
+			// Writes the compiled expression model in the binary model format. Expression models only
+			void save(std::ostream& out) const;
+
 			void to(torch::Device device);
+
+			// Only affects expression models, a hessian is always evaluated from the symbolic expressions
+			void set_jacobian_mode(std::int32_t mode);
+
+			// Only affects expression models, and of those the tape evaluations that aren't forward mode. Models whose tape
+			// can't be scripted, see ScriptedTape::scriptable, are always evaluated eagerly
+			void set_execution_mode(std::int32_t mode);
 			
 
 			std::vector<torch::Tensor>& constants();
+
+			// Subexpressions of expression models that only depend on constants are evaluated once and cached.
+			// Replacing a constant tensor is noticed automatically, call this after modifying one in place
+			void constants_changed();
 		
 			torch::Tensor& parameters();
 
@@ -68,6 +116,16 @@ namespace tc {
 			
 			void res_jac_hess(torch::Tensor& residual, torch::Tensor& jacobian, torch::Tensor& hessian, const torch::Tensor& data);
 
+			// gradient = J^T r by a reverse sweep over the expression, J is never formed. Expression models only
+			void res_grad(torch::Tensor& residual, torch::Tensor& gradient, const torch::Tensor& data);
+
+			// As res_grad, and also the Gauss-Newton matrix J^T J accumulated over blocks of at most block_size
+			// data points, so only a (nProblems, block_size, nParams) part of J exists at any time. block_size must be at
+			// least 1. Constants that vary along the data must be laid out like the data, (1 or nProblems, nData), so
+			// that they are split into the same blocks, constants of any other shape are used whole. The data dimension
+			// of multi output models is made of several outputs, they are always evaluated in one block
+			void res_grad_gn(torch::Tensor& residual, torch::Tensor& gradient, torch::Tensor& gn, const torch::Tensor& data, int64_t block_size);
+
 			void diff(torch::Tensor& value, int32_t index);
 
 			void second_diff(torch::Tensor& value, const std::pair<int32_t, int32_t>& indices);
@@ -76,14 +134,58 @@ namespace tc {
 			
 			void build_funcs_from_expr();
 
+			// fills m_TapeInputs with the parameter views followed by the constants
+			void prepare_inputs();
+
+			// evaluates at least the first nroots roots of the expression tape into m_TapeSlots, eagerly or scripted
+			// depending on the execution mode
+			void eval_tape(std::int32_t nroots);
+
+			// intermediates live in the planned m_TapeBuffers
+			void eval_tape_eager(std::int32_t nroots);
+
+			void eval_tape_scripted(std::int32_t nroots);
+
+			// name of the scripted method covering the first nroots roots, added to the module on first use
+			std::string script_method(std::int32_t nroots);
+
+			// times both ways of evaluating in AUTO mode
+			bool use_script(std::int32_t nroots);
+
 		private:
 
 			MP_EvalDiffHessFunc m_Func;
 			MP_FirstDiff m_FirstDiff;
 			MP_SecondDiff m_SecondDiff;
 
-			std::unique_ptr<tc::expression::FetcherMap> m_pFetcherMap;
-			std::unique_ptr<MP_Expr> m_pExpr;
+			std::shared_ptr<const MP_Expr> m_pExpr; // shared through MP_ExprCache with every model of the same expression
+
+			// scratch space reused by every tape evaluation
+			std::vector<torch::Tensor> m_TapeInputs;
+			torch::Tensor m_ViewedParameters; // the parameter tensor the views in m_TapeInputs were taken of
+			void* m_ViewedParametersData = nullptr;
+			std::vector<torch::Tensor> m_TapeSlots; // backed by m_TapeBuffers, only the roots are valid after eval_tape
+			tc::expression::TapeBufferPlan m_TapePlan;
+			std::vector<torch::Tensor> m_TapeBuffers;
+			std::vector<torch::Tensor> m_TapeDiffSlots; // unplanned slots for forward and reverse mode
+			std::vector<bool> m_TapeConstantInputs;
+			std::unique_ptr<tc::expression::FusedKernel> m_pFused;
+			std::unique_ptr<tc::expression::ScriptedTape> m_pScripted;
+			std::vector<torch::Tensor> m_ScriptOutputs;
+			std::map<std::string, bool> m_ScriptChoices; // per scripted method, whether AUTO found it faster than eager
+			std::vector<std::vector<int64_t>> m_ScriptChoiceSizes; // the input sizes the choices were made for
+			std::vector<torch::Tensor> m_HoistedConstants; // the constants the hoisted slots were evaluated with
+			std::vector<void*> m_HoistedConstantsData;
+			bool m_ConstantsChanged = true;
+			torch::Tensor m_HessianProduct; // residual times second derivative, reused between evaluations
+
+			std::int32_t m_JacobianMode = MP_JacobianMode::SYMBOLIC;
+			std::int32_t m_ExecutionMode = MP_ExecutionMode::EAGER;
+			std::vector<std::int32_t> m_TapeSeeds; // parameter index of each tape input, -1 for constants
+			std::vector<torch::Tensor> m_TapeGrads;
+			std::vector<torch::Tensor> m_TapeInputAdjoints;
+			std::vector<torch::Tensor> m_TapeBlockInputs;
+			std::vector<torch::Tensor> m_TapeBlockSlots;
 
 			torch::Tensor m_Parameters;
 			std::vector<torch::Tensor> m_Constants;
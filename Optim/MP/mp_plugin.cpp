@@ -0,0 +1,71 @@
+#include "../../pch.hpp"
+
+#include "mp_plugin.hpp"
+#include "../../Expression/nodes.hpp"
+
+void tc::optim::mp_plugin_assemble(const std::vector<torch::Tensor>& slots, std::int32_t eval_slot,
+	const std::vector<std::int32_t>& diff_slots, const std::vector<std::int32_t>& seconddiff_slots,
+	torch::Tensor& values, tc::OptOutRef<torch::Tensor> jacobian, tc::OptOutRef<torch::Tensor> hessian, tc::OptRef<const torch::Tensor> data)
+{
+	auto& value = slots[eval_slot];
+	if (data.has_value()) {
+		if (tc::expression::out_fits(values, value, data.value().get()))
+			torch::sub_out(values, value, data.value().get());
+		else
+			values = torch::sub(value, data.value().get());
+	}
+	else {
+		tc::expression::tensor_into(value, values);
+	}
+
+	if (jacobian.has_value()) {
+		for (int i = 0; i < diff_slots.size(); ++i) {
+			jacobian.value().get().select(2, i) = slots[diff_slots[i]];
+		}
+	}
+
+	if (hessian.has_value()) {
+		// H = J^T @ J + r @ del2 r
+
+		if (!jacobian.has_value()) {
+			throw std::runtime_error("jacobian OptOutRef must be filled if hessian shall be evaluated");
+		}
+
+		if (!data.has_value()) {
+			throw std::runtime_error("data OptRef must be filled if hessian shall be evaluated");
+		}
+
+		auto& H = hessian.value().get();
+		std::int32_t npar = diff_slots.size();
+
+		int k = 0;
+		for (int i = 0; i < npar; ++i) {
+			for (int j = 0; j < i + 1; ++j) {
+				auto hij = H.select(1, i).select(1, j);
+				torch::sum_out(hij, torch::mul(values, slots[seconddiff_slots[k]]), 1);
+				++k;
+			}
+		}
+
+		for (int i = 0; i < npar; ++i) {
+			for (int j = i + 1; j < npar; ++j) {
+				H.select(1, i).select(1, j) = H.select(1, j).select(1, i);
+			}
+		}
+
+		H.baddbmm_(jacobian.value().get().transpose(1, 2), jacobian.value().get());
+	}
+}
+
+void tc::optim::mp_plugin_write(const torch::Tensor& slot, torch::Tensor& out)
+{
+	tc::expression::tensor_into(slot, out);
+}
+
+std::int32_t tc::optim::mp_plugin_seconddiff_index(const std::pair<int32_t, int32_t>& indices)
+{
+	if (indices.second > indices.first) {
+		return (indices.second * (indices.second + 1) / 2) + indices.first;
+	}
+	return (indices.first * (indices.first + 1) / 2) + indices.second;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "../../pch.hpp"
+
+#ifdef _WIN32
+#define TC_PLUGIN_EXPORT extern "C" __declspec(dllexport)
+#else
+#define TC_PLUGIN_EXPORT extern "C" __attribute__((visibility("default")))
+#endif
+
+namespace tc {
+	namespace optim {
+
+		// Bumped whenever MP_ModelPlugin changes, plugins built against another version are rejected
+		constexpr std::int32_t MP_PLUGIN_ABI_VERSION = 1;
+
+		// Name of the function every model plugin exports, returning its MP_ModelPlugin
+		constexpr const char* MP_PLUGIN_ENTRY = "tc_mp_model_plugin";
+
+		using MP_PluginEvalDiffHessFunc = void(*)(
+			// Constants						// Parameters
+			const std::vector<torch::Tensor>&,	const torch::Tensor&,
+			// Values							// Jacobian						// Hessian						// Data,
+			torch::Tensor&,						tc::OptOutRef<torch::Tensor>,	tc::OptOutRef<torch::Tensor>,	tc::OptRef<const torch::Tensor>);
+
+		using MP_PluginFirstDiff = void(*)(
+			// Constants						// Parameters			// Variable index
+			const std::vector<torch::Tensor>&,	const torch::Tensor&,	int32_t,
+			// Derivative
+			torch::Tensor&);
+
+		using MP_PluginSecondDiff = void(*)(
+			// Constants						// Parameters			// Variable indices
+			const std::vector<torch::Tensor>&,	const torch::Tensor&,	const std::pair<int32_t, int32_t>&,
+			// Second Derivative
+			torch::Tensor&);
+
+		struct MP_ModelPlugin {
+			std::int32_t abi_version;
+			std::string name;
+			std::string expression;
+			std::vector<std::string> parameters;
+			std::vector<std::string> constants;
+			MP_PluginEvalDiffHessFunc func;
+			MP_PluginFirstDiff firstdiff;
+			MP_PluginSecondDiff seconddiff;
+		};
+
+		using MP_PluginEntry = const MP_ModelPlugin* (*)();
+
+		// Runtime support for generated plugins
+
+		// Writes values, jacobian and hessian from slots evaluated by generated code the same way expression
+		// models do, diff_slots has one entry per parameter and seconddiff_slots the lower triangle by rows
+		void mp_plugin_assemble(const std::vector<torch::Tensor>& slots, std::int32_t eval_slot,
+			const std::vector<std::int32_t>& diff_slots, const std::vector<std::int32_t>& seconddiff_slots,
+			torch::Tensor& values, tc::OptOutRef<torch::Tensor> jacobian, tc::OptOutRef<torch::Tensor> hessian, tc::OptRef<const torch::Tensor> data);
+
+		// Copies a slot into out, reusing the storage of out if it has the right shape
+		void mp_plugin_write(const torch::Tensor& slot, torch::Tensor& out);
+
+		// Index of the hessian entry (i,j) in the lower triangle by rows
+		std::int32_t mp_plugin_seconddiff_index(const std::pair<int32_t, int32_t>& indices);
+
+	}
+}
@@ -0,0 +1,81 @@
+#include "../../pch.hpp"
+
+#include "mp_registry.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+tc::optim::MP_ModelRegistry& tc::optim::MP_ModelRegistry::instance()
+{
+	static MP_ModelRegistry registry;
+	return registry;
+}
+
+void tc::optim::MP_ModelRegistry::add(const MP_ModelPlugin& plugin)
+{
+	// The layout of the rest of the plugin depends on the abi, so nothing else is read before it is checked
+	if (plugin.abi_version != MP_PLUGIN_ABI_VERSION)
+		throw std::runtime_error("model plugin was built for plugin abi version " + std::to_string(plugin.abi_version) +
+			", expected " + std::to_string(MP_PLUGIN_ABI_VERSION));
+
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_Plugins[plugin.name] = &plugin;
+}
+
+std::string tc::optim::MP_ModelRegistry::load(const std::string& path)
+{
+#ifdef _WIN32
+	HMODULE handle = LoadLibraryA(path.c_str());
+	if (handle == nullptr)
+		throw std::runtime_error("failed to load model plugin " + path);
+	auto entry = reinterpret_cast<MP_PluginEntry>(GetProcAddress(handle, MP_PLUGIN_ENTRY));
+#else
+	void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (handle == nullptr)
+		throw std::runtime_error("failed to load model plugin " + path + ": " + dlerror());
+	auto entry = reinterpret_cast<MP_PluginEntry>(dlsym(handle, MP_PLUGIN_ENTRY));
+#endif
+	if (entry == nullptr)
+		throw std::runtime_error(path + " does not export " + MP_PLUGIN_ENTRY);
+
+	const MP_ModelPlugin* plugin = entry();
+	if (plugin->abi_version != MP_PLUGIN_ABI_VERSION)
+		throw std::runtime_error("model plugin " + path + " was built for plugin abi version " + std::to_string(plugin->abi_version) +
+			", expected " + std::to_string(MP_PLUGIN_ABI_VERSION));
+	add(*plugin);
+	return plugin->name;
+}
+
+bool tc::optim::MP_ModelRegistry::contains(const std::string& name) const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	return m_Plugins.find(name) != m_Plugins.end();
+}
+
+const tc::optim::MP_ModelPlugin& tc::optim::MP_ModelRegistry::get(const std::string& name) const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	auto it = m_Plugins.find(name);
+	if (it == m_Plugins.end())
+		throw std::runtime_error("no model named " + name + " is registered");
+	return *it->second;
+}
+
+std::vector<std::string> tc::optim::MP_ModelRegistry::names() const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	std::vector<std::string> ret;
+	for (auto& p : m_Plugins) {
+		ret.push_back(p.first);
+	}
+	return ret;
+}
+
+std::unique_ptr<tc::optim::MP_Model> tc::optim::MP_ModelRegistry::create(const std::string& name) const
+{
+	auto& plugin = get(name);
+	return std::make_unique<MP_Model>(plugin.func, plugin.firstdiff, plugin.seconddiff);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "../../pch.hpp"
+
+#include <map>
+#include <mutex>
+
+#include "mp_model.hpp"
+#include "mp_plugin.hpp"
+
+namespace tc {
+	namespace optim {
+
+		// Process wide set of models compiled ahead of time, either linked in and added directly
+		// or loaded from plugin shared objects built by tc_add_mp_model_plugin
+		class MP_ModelRegistry {
+		public:
+
+			static MP_ModelRegistry& instance();
+
+			// The plugin must outlive the registry
+			void add(const MP_ModelPlugin& plugin);
+
+			// Loads a plugin shared object, registers its model and returns the model name.
+			// The shared object stays loaded for the lifetime of the process
+			std::string load(const std::string& path);
+
+			bool contains(const std::string& name) const;
+
+			const MP_ModelPlugin& get(const std::string& name) const;
+
+			std::vector<std::string> names() const;
+
+			// A model evaluating with the plugin functions, constants and parameters are set as usual
+			std::unique_ptr<MP_Model> create(const std::string& name) const;
+
+		private:
+
+			MP_ModelRegistry() = default;
+
+		private:
+
+			mutable std::mutex m_Mutex;
+			std::map<std::string, const MP_ModelPlugin*> m_Plugins;
+		};
+
+	}
+}
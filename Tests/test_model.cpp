@@ -591,6 +591,199 @@ void test_t2_times(int32_t nprob, int32_t ndata) {
 
 }
 
+void test_model_cache(int32_t nmodels) {
+	std::vector<std::string> parameters{ "S0", "f", "D1", "D2" };
+	std::vector<std::string> constants{ "b" };
+
+	std::string expression = "S0*(f*exp(-b*D1)+(1-f)*exp(-b*D2))";
+
+	// The first model compiles the expression, the rest share it
+	auto t1 = std::chrono::steady_clock::now();
+	tc::optim::MP_Model first(expression, parameters, constants);
+	auto t2 = std::chrono::steady_clock::now();
+
+	std::vector<std::unique_ptr<tc::optim::MP_Model>> models;
+	for (int i = 0; i < nmodels; ++i) {
+		models.emplace_back(std::make_unique<tc::optim::MP_Model>(expression, parameters, constants));
+	}
+	auto t3 = std::chrono::steady_clock::now();
+
+	std::cout << "cached expressions: " << tc::optim::MP_ExprCache::instance().size() << ", arena bytes: "
+		<< tc::optim::MP_ExprCache::instance().get(expression, parameters, constants)->arena_bytes() << std::endl;
+	// Only the parentheses and whitespace differ, so the compiled expression is shared
+	std::string spelled = "(S0) * (f*exp(-b*D1) + ((1-f)*exp(-b*D2)))";
+	std::cout << "same canonical expression shared: " << (tc::optim::MP_ExprCache::instance().get(spelled, parameters, constants)
+		== tc::optim::MP_ExprCache::instance().get(expression, parameters, constants)) << std::endl;
+	std::cout << "first model time: " << std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() << std::endl;
+	std::cout << "cached model time: " << std::chrono::duration_cast<std::chrono::microseconds>(t3 - t2).count() / nmodels << std::endl;
+
+	// Precompiled models load without lexing or differentiating
+	std::stringstream stream;
+	first.save(stream);
+	auto t4 = std::chrono::steady_clock::now();
+	tc::optim::MP_Model loaded(stream);
+	auto t5 = std::chrono::steady_clock::now();
+
+	torch::Tensor params = torch::rand({ 10, 4 });
+	std::vector<torch::Tensor> consts{ torch::rand({ 1, 8 }) };
+	first.parameters() = params;
+	first.constants() = consts;
+	loaded.parameters() = params;
+	loaded.constants() = consts;
+
+	torch::Tensor jac = torch::empty({ 10, 8, 4 });
+	torch::Tensor jac2 = torch::empty({ 10, 8, 4 });
+	torch::Tensor hes = torch::empty({ 10, 4, 4 });
+	torch::Tensor hes2 = torch::empty({ 10, 4, 4 });
+	torch::Tensor res, res2;
+	torch::Tensor data = torch::rand({ 10, 8 });
+	first.res_jac_hess(res, jac, hes, data);
+	loaded.res_jac_hess(res2, jac2, hes2, data);
+
+	std::cout << "serialized bytes: " << stream.str().size() << ", loaded model time: " << std::chrono::duration_cast<std::chrono::microseconds>(t5 - t4).count() << std::endl;
+	std::cout << "loaded equal: " << (torch::allclose(res, res2) && torch::allclose(jac, jac2) && torch::allclose(hes, hes2)) << std::endl;
+
+	// Renaming the first parameter, the second S0 in the stream, leaves the tape bound to the old name
+	std::string renamed = stream.str();
+	renamed.replace(renamed.find("S0", renamed.find("S0") + 2), 2, "X0");
+	std::stringstream renamed_stream(renamed);
+	bool renamed_rejected = false;
+	try {
+		tc::optim::MP_Model renamed_model(renamed_stream);
+	}
+	catch (const std::runtime_error&) {
+		renamed_rejected = true;
+	}
+	std::cout << "renamed parameters rejected: " << renamed_rejected << std::endl;
+}
+
+void test_custom_function() {
+	int32_t nprob = 10;
+	int32_t ndata = 8;
+
+	// exp(-b*ADC) as a custom function of (b, ADC), with its derivatives written out by hand
+	tc::expression::CustomFunction function;
+	function.name = "adcdecay";
+	function.n_inputs = 2;
+	function.eval = [](const std::vector<torch::Tensor>& x) { return torch::exp(-x[0] * x[1]); };
+	function.derivatives = {
+		[](const std::vector<torch::Tensor>& x) { return -x[1] * torch::exp(-x[0] * x[1]); },
+		[](const std::vector<torch::Tensor>& x) { return -x[0] * torch::exp(-x[0] * x[1]); },
+	};
+	function.second_derivatives = {
+		[](const std::vector<torch::Tensor>& x) { return x[1] * x[1] * torch::exp(-x[0] * x[1]); },
+		[](const std::vector<torch::Tensor>& x) { return (x[0] * x[1] - 1) * torch::exp(-x[0] * x[1]); },
+		[](const std::vector<torch::Tensor>& x) { return x[0] * x[0] * torch::exp(-x[0] * x[1]); },
+	};
+	tc::expression::CustomFunctionRegistry::instance().add(std::move(function));
+
+	std::vector<std::string> parameters{ "S0","ADC" };
+	std::vector<std::string> constants{ "b" };
+
+	tc::optim::MP_Model custom("S0*adcdecay(b, ADC)", parameters, constants);
+	tc::optim::MP_Model inline_model("S0*exp(-b*ADC)", parameters, constants);
+
+	torch::Tensor params = torch::rand({ nprob, 2 });
+	std::vector<torch::Tensor> consts{ torch::rand({ 1, ndata }) };
+	custom.parameters() = params;
+	custom.constants() = consts;
+	inline_model.parameters() = params;
+	inline_model.constants() = consts;
+
+	torch::Tensor jac = torch::empty({ nprob, ndata, 2 });
+	torch::Tensor jac2 = torch::empty({ nprob, ndata, 2 });
+	torch::Tensor hes = torch::empty({ nprob, 2, 2 });
+	torch::Tensor hes2 = torch::empty({ nprob, 2, 2 });
+	torch::Tensor res, res2;
+	torch::Tensor data = torch::rand({ nprob, ndata });
+	custom.res_jac_hess(res, jac, hes, data);
+	inline_model.res_jac_hess(res2, jac2, hes2, data);
+
+	// Models created after the function is replaced call the new kernels, not the cached ones
+	tc::expression::CustomFunction doubled;
+	doubled.name = "adcdecay";
+	doubled.n_inputs = 2;
+	doubled.eval = [](const std::vector<torch::Tensor>& x) { return 2 * torch::exp(-x[0] * x[1]); };
+	tc::expression::CustomFunctionRegistry::instance().add(std::move(doubled));
+
+	tc::optim::MP_Model replaced("S0*adcdecay(b, ADC)", parameters, constants);
+	replaced.parameters() = params;
+	replaced.constants() = consts;
+	torch::Tensor value, value2;
+	replaced.eval(value);
+	inline_model.eval(value2);
+
+	std::cout << "custom equal: " << torch::allclose(res, res2) << ", custom jacobian equal: " << torch::allclose(jac, jac2)
+		<< ", custom hessian equal: " << torch::allclose(hes, hes2) << ", replaced custom equal: " << torch::allclose(value, 2 * value2) << std::endl;
+}
+
+void test_multi_output() {
+	int32_t nprob = 10;
+	int32_t nb = 6;
+	int32_t nte = 4;
+
+	// A diffusion and a relaxation series of the same voxels, fitted together. Each output only depends on
+	// some of the parameters, so the jacobian has zero blocks
+	std::vector<std::string> parameters{ "S0","ADC","T2" };
+	std::vector<std::string> constants{ "b","TE" };
+	std::vector<std::string> adc_constants{ "b" };
+	std::vector<std::string> t2_constants{ "TE" };
+	std::vector<std::string> expressions{ "S0*exp(-b*ADC)", "S0*exp(-TE/T2)" };
+
+	tc::optim::MP_Model multi(expressions, parameters, constants);
+	tc::optim::MP_Model adc(expressions[0], parameters, adc_constants);
+	tc::optim::MP_Model t2(expressions[1], parameters, t2_constants);
+
+	torch::Tensor params = torch::rand({ nprob, 3 }) + 0.5;
+	torch::Tensor b = torch::rand({ 1, nb });
+	torch::Tensor te = torch::rand({ 1, nte });
+	multi.parameters() = params;
+	multi.constants() = { b, te };
+	adc.parameters() = params;
+	adc.constants() = { b };
+	t2.parameters() = params;
+	t2.constants() = { te };
+
+	torch::Tensor data = torch::rand({ nprob, nb + nte });
+	torch::Tensor jac = torch::empty({ nprob, nb + nte, 3 });
+	torch::Tensor hes = torch::empty({ nprob, 3, 3 });
+	torch::Tensor res;
+	multi.res_jac_hess(res, jac, hes, data);
+
+	// The hessian sums over the data dimension, so it is the sum of the hessians of the outputs
+	torch::Tensor adc_jac = torch::empty({ nprob, nb, 3 });
+	torch::Tensor t2_jac = torch::empty({ nprob, nte, 3 });
+	torch::Tensor adc_hes = torch::empty({ nprob, 3, 3 });
+	torch::Tensor t2_hes = torch::empty({ nprob, 3, 3 });
+	torch::Tensor adc_res, t2_res;
+	adc.res_jac_hess(adc_res, adc_jac, adc_hes, data.narrow(1, 0, nb).contiguous());
+	t2.res_jac_hess(t2_res, t2_jac, t2_hes, data.narrow(1, nb, nte).contiguous());
+
+	torch::Tensor expected_jac = torch::cat({ adc_jac, t2_jac }, 1);
+
+	// Forward mode gives the same concatenated jacobian
+	torch::Tensor forward_jac = torch::empty({ nprob, nb + nte, 3 });
+	torch::Tensor value;
+	multi.set_jacobian_mode(tc::optim::MP_JacobianMode::FORWARD);
+	multi.eval_jac(value, forward_jac);
+
+	std::cout << "multi output equal: " << torch::allclose(res, torch::cat({ adc_res, t2_res }, 1))
+		<< ", multi jacobian equal: " << torch::allclose(jac, expected_jac)
+		<< ", multi forward jacobian equal: " << torch::allclose(forward_jac, expected_jac)
+		<< ", multi hessian equal: " << torch::allclose(hes, adc_hes + t2_hes) << std::endl;
+
+	// A single output is the plain model
+	std::vector<std::string> single_expressions{ expressions[0] };
+	tc::optim::MP_Model single(single_expressions, parameters, adc_constants);
+	single.parameters() = params;
+	single.constants() = { b };
+	torch::Tensor single_jac = torch::empty({ nprob, nb, 3 });
+	torch::Tensor single_res;
+	single.res_jac(single_res, single_jac, data.narrow(1, 0, nb).contiguous());
+
+	std::cout << "single output equal: " << torch::allclose(single_res, adc_res) << ", single jacobian equal: " << torch::allclose(single_jac, adc_jac) << std::endl;
+}
+
 
 int main() {
 
@@ -614,6 +807,11 @@ int main() {
 	test_irmag_times(1000000, 10);
 	test_irmag_times(1000000, 10);
 	
+	test_model_cache(100);
+
+	test_custom_function();
+
+	test_multi_output();
 
 	/*
 	test_t2_values();
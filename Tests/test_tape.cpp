@@ -0,0 +1,240 @@
+#include "../compute.hpp"
+#include "../Expression/Tape/serialize.hpp"
+
+
+void test_tape(int64_t nprob) {
+	using namespace tc::expression;
+
+	torch::InferenceMode im_guard;
+
+	int64_t nparam = 4;
+	int64_t ndata = 21;
+	torch::Tensor x = torch::rand({ nprob,nparam });
+	torch::Tensor b = torch::rand({ 1, ndata });
+	torch::Device device = x.device();
+
+	FetcherMap map;
+	map.emplace("S0", [&x]() { return x.select(1, 0).unsqueeze(-1); });
+	map.emplace("f", [&x]() { return x.select(1, 1).unsqueeze(-1); });
+	map.emplace("D1", [&x]() { return x.select(1, 2).unsqueeze(-1); });
+	map.emplace("D2", [&x]() { return x.select(1, 3).unsqueeze(-1); });
+	map.emplace("b", [&b]() { return b; });
+
+	LexContext context;
+	context.variables.emplace_back("S0");
+	context.variables.emplace_back("f");
+	context.variables.emplace_back("D1");
+	context.variables.emplace_back("D2");
+	context.variables.emplace_back("b");
+
+	Lexer lexer(std::move(context));
+	std::string expr = "S0*(f*exp(-b*D1)+(1-f)*exp(-b*D2))";
+
+	Shunter shunter;
+	auto shunted_toks = shunter.shunt(lexer.lex(expr));
+
+	Expression expression(shunted_toks, Expression::default_expression_creation_map(), map);
+	auto dexpression = expression.exprdiffnode(VariableToken("D1"));
+
+	Tape tape(expression);
+	Tape dtape(*dexpression);
+	Tape shared(std::vector<tc::refw<const Node>>{ expression, *dexpression });
+
+	std::vector<torch::Tensor> inputs;
+	std::vector<torch::Tensor> slots;
+	std::vector<torch::Tensor> dslots;
+	std::vector<torch::Tensor> sslots;
+	std::vector<torch::Tensor> fslots;
+
+	auto t1 = std::chrono::steady_clock::now();
+	torch::Tensor y1 = tensor_from_tentok(expression.eval(), device);
+	torch::Tensor dy1 = tensor_from_tentok(dexpression->eval(), device);
+	auto t2 = std::chrono::steady_clock::now();
+
+	auto t3 = std::chrono::steady_clock::now();
+	tape.fetch_inputs(inputs);
+	tape.eval(inputs, slots);
+	torch::Tensor y2 = slots[tape.root()];
+	dtape.fetch_inputs(inputs);
+	dtape.eval(inputs, dslots);
+	torch::Tensor dy2 = dslots[dtape.root()];
+	auto t4 = std::chrono::steady_clock::now();
+
+	shared.fetch_inputs(inputs);
+	shared.eval(inputs, sslots);
+	torch::Tensor dy3 = sslots[shared.roots()[1]];
+
+	// Forward mode, seed S0, f, D1, D2 with their parameter index
+	std::vector<std::int32_t> seeds;
+	for (auto& name : tape.input_names()) {
+		std::vector<std::string> pars = { "S0", "f", "D1", "D2" };
+		auto it = std::find(pars.begin(), pars.end(), name);
+		seeds.push_back(it != pars.end() ? std::distance(pars.begin(), it) : -1);
+	}
+	std::vector<torch::Tensor> grads;
+	tape.fetch_inputs(inputs);
+	tape.eval_forward(inputs, seeds, nparam, fslots, grads, 1);
+	torch::Tensor dy4 = grads[tape.root()].select(-1, 2);
+
+	// Values and jacobian in one fused loop
+	FusedKernel fused(tape);
+	torch::Tensor fy;
+	torch::Tensor fjac = torch::empty({ nprob, ndata, nparam });
+	tape.fetch_inputs(inputs);
+	fused.eval(inputs, seeds, nparam, fy, torch::Tensor(), fjac);
+
+	// Repeated evaluations write into the storage of the previous ones
+	torch::Tensor y3;
+	expression.eval_into(y3);
+	void* y3data = y3.data_ptr();
+	expression.eval_into(y3);
+	void* y2data = y2.data_ptr();
+	tape.fetch_inputs(inputs);
+	tape.eval(inputs, slots);
+	bool reused = y3.data_ptr() == y3data && slots[tape.root()].data_ptr() == y2data;
+
+	// Shared tape with its intermediates in planned buffers
+	std::vector<torch::Tensor> pslots;
+	std::vector<torch::Tensor> buffers;
+	shared.fetch_inputs(inputs);
+	auto plan = shared.plan_buffers(inputs);
+	shared.allocate_buffers(plan, buffers);
+	shared.eval(inputs, plan, buffers, pslots, 2, true);
+	torch::Tensor dy5 = pslots[shared.roots()[1]];
+
+	// b is constant, so -b is hoisted and only evaluated on the refreshing call
+	std::vector<bool> constant_inputs;
+	for (auto& name : shared.input_names()) {
+		constant_inputs.push_back(name == "b");
+	}
+	std::vector<torch::Tensor> hslots;
+	std::vector<torch::Tensor> hbuffers;
+	auto hplan = shared.plan_buffers(inputs, constant_inputs);
+	shared.allocate_buffers(hplan, hbuffers);
+	shared.eval(inputs, hplan, hbuffers, hslots, 2, true);
+	shared.eval(inputs, hplan, hbuffers, hslots, 2, false);
+	torch::Tensor dy6 = hslots[shared.roots()[1]];
+	auto nhoisted = std::count(hplan.hoisted.begin(), hplan.hoisted.end(), true);
+
+	// Independent instructions of a level may run concurrently, the cost model decides per level
+	std::vector<torch::Tensor> cslots;
+	std::vector<torch::Tensor> cbuffers;
+	auto cplan = shared.plan_buffers(inputs, {}, true);
+	shared.allocate_buffers(cplan, cbuffers);
+	shared.eval(inputs, cplan, cbuffers, cslots, 2, true);
+	torch::Tensor dy9 = cslots[shared.roots()[1]];
+	auto schedule = shared.plan_schedule(inputs);
+	auto nparallel = std::count(schedule.parallel.begin(), schedule.parallel.end(), true);
+
+	// The same roots through a TorchScript graph
+	ScriptedTape scripted(shared);
+	scripted.add_method("diff", 2);
+	std::vector<torch::Tensor> soutputs;
+	scripted.run("diff", inputs, soutputs);
+	torch::Tensor dy7 = soutputs[1];
+
+	// Double inputs get double literals
+	std::vector<torch::Tensor> dinputs;
+	std::vector<torch::Tensor> dtslots;
+	tape.fetch_inputs(dinputs);
+	for (auto& input : dinputs) {
+		input = input.to(torch::kDouble);
+	}
+	tape.eval(dinputs, dtslots);
+	bool double_kept = dtslots[tape.root()].scalar_type() == torch::kDouble;
+
+	// Derivatives built with one memo share their subterms
+	DiffMemo memo;
+	auto mexpression = expression.exprdiffnode(VariableToken("D1"), memo);
+	auto mexpression2 = expression.exprdiffnode(VariableToken("D1"), memo);
+	bool memoized = mexpression->m_Children[0] == mexpression2->m_Children[0];
+	torch::Tensor dy8 = tensor_from_tentok(mexpression->eval(), device);
+
+	// Simplify rewrites f*exp(-b*D1) + (1-f)*exp(-b*D2) into an fma
+	auto fused_root = simplify(expression.m_Children[0], LexContext());
+	Tape ftape(*fused_root);
+	auto nfma = std::count_if(ftape.instructions().begin(), ftape.instructions().end(),
+		[](const TapeInstruction& instr) { return instr.op == TapeOp::FMA; });
+	torch::Tensor y4 = ftape.eval();
+
+	// 1 + f*D1 is an fma by the time its log is simplified, it still becomes log1p. log(exp(x)) is kept for complex x
+	Expression log1p_expression(shunter.shunt(lexer.lex("log(1+f*D1)")), Expression::default_expression_creation_map(), map);
+	Expression complex_expression(shunter.shunt(lexer.lex("log(exp(2i*D1))")), Expression::default_expression_creation_map(), map);
+	bool log1p_fused = simplify(log1p_expression.m_Children[0], LexContext())->get_node_type() == NodeType::LOG1P_NODE;
+	bool complex_log_kept = simplify(complex_expression.m_Children[0], LexContext())->get_node_type() == NodeType::LOG_NODE;
+
+	bool shapes_inferred = at::IntArrayRef(std::get<0>(shared.infer_shapes(inputs)[shared.roots()[1]])) == dy3.sizes();
+
+	std::cout << "tape instructions: " << tape.instructions().size() << ", diff tape instructions: " << dtape.instructions().size() << std::endl;
+	std::cout << "shared tape instructions: " << shared.instructions().size() << std::endl;
+	std::cout << "eval equal: " << torch::allclose(y1, y2) << ", diff equal: " << torch::allclose(dy1, dy2) << ", shared diff equal: " << torch::allclose(dy1, dy3)
+		<< ", forward diff equal: " << torch::allclose(dy1, dy4) << std::endl;
+	std::cout << "planned buffers: " << plan.buffer_keys.size() << ", planned diff equal: " << torch::allclose(dy1, dy5)
+		<< ", shapes inferred: " << shapes_inferred << std::endl;
+	std::cout << "hoisted slots: " << nhoisted << ", hoisted diff equal: " << torch::allclose(dy1, dy6) << std::endl;
+	std::cout << "levels: " << schedule.levels.size() << ", parallel levels: " << nparallel << ", scheduled diff equal: " << torch::allclose(dy1, dy9) << std::endl;
+	std::cout << "scripted diff equal: " << torch::allclose(dy1, dy7) << std::endl;
+	std::cout << "fused equal: " << torch::allclose(y1, fy) << ", fused diff equal: " << torch::allclose(dy1, fjac.select(-1, 2)) << std::endl;
+	std::cout << "real tape: " << tape.is_real() << ", double kept: " << double_kept << ", double equal: " << torch::allclose(y1, dtslots[tape.root()].to(torch::kFloat)) << std::endl;
+	std::cout << "fma ops: " << nfma << ", fma equal: " << torch::allclose(y1, y4) << std::endl;
+	std::cout << "log1p fused: " << log1p_fused << ", complex log kept: " << complex_log_kept << std::endl;
+	std::cout << "memoized diff: " << memoized << ", memoized diff equal: " << torch::allclose(dy1, dy8) << std::endl;
+	std::cout << "eval_into equal: " << torch::allclose(y1, y3) << ", storage reused: " << reused << std::endl;
+	std::cout << "node time: " << std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() << std::endl;
+	std::cout << "tape time: " << std::chrono::duration_cast<std::chrono::microseconds>(t4 - t3).count() << std::endl;
+}
+
+void test_tape_load() {
+	using namespace tc::expression;
+
+	// x + ? with the second operand of the ADD missing
+	std::stringstream corrupt;
+	write_binary_header(corrupt, "TCTP", TAPE_FORMAT_VERSION);
+	write_binary(corrupt, std::vector<std::string>{ "x" });
+	write_binary<std::uint64_t>(corrupt, 2);
+	for (auto& instr : { TapeInstruction{ TapeOp::INPUT, 0, {}, 0 }, TapeInstruction{ TapeOp::ADD, 1, { 0 }, -1 } }) {
+		write_binary(corrupt, instr.op);
+		write_binary(corrupt, instr.out);
+		write_binary(corrupt, instr.payload);
+		write_binary(corrupt, instr.in);
+	}
+	write_binary<std::uint64_t>(corrupt, 0);
+	write_binary<std::uint64_t>(corrupt, 0);
+	write_binary<std::uint64_t>(corrupt, 0);
+	write_binary(corrupt, std::vector<std::int32_t>{ 1 });
+	write_binary(corrupt, std::vector<std::int32_t>{ 2 });
+
+	bool arity_rejected = false;
+	try {
+		Tape::load(corrupt);
+	}
+	catch (const std::runtime_error&) {
+		arity_rejected = true;
+	}
+
+	// A length prefix far beyond the end of the stream
+	std::stringstream truncated;
+	write_binary_header(truncated, "TCTP", TAPE_FORMAT_VERSION);
+	write_binary<std::uint64_t>(truncated, 1);
+	write_binary<std::uint64_t>(truncated, std::uint64_t(1) << 31);
+
+	bool truncated_rejected = false;
+	try {
+		Tape::load(truncated);
+	}
+	catch (const std::runtime_error&) {
+		truncated_rejected = true;
+	}
+
+	std::cout << "invalid arity rejected: " << arity_rejected << ", truncated rejected: " << truncated_rejected << std::endl;
+}
+
+int main() {
+
+	test_tape(10);
+	test_tape(10);
+	test_tape(10000);
+
+	test_tape_load();
+
+}
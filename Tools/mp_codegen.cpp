@@ -0,0 +1,47 @@
+#include "../compute.hpp"
+
+#include <fstream>
+#include <sstream>
+
+// mp_codegen <name> <expression> <parameters> <constants> <output>
+// parameters and constants are comma separated lists, constants may be empty
+std::vector<std::string> split_list(const std::string& list)
+{
+	std::vector<std::string> ret;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		if (!item.empty())
+			ret.push_back(item);
+	}
+	return ret;
+}
+
+int main(int argc, char* argv[]) {
+
+	if (argc != 6) {
+		std::cerr << "usage: mp_codegen <name> <expression> <parameters> <constants> <output>" << std::endl;
+		return 1;
+	}
+
+	std::string name = argv[1];
+	std::string expression = argv[2];
+	auto parameters = split_list(argv[3]);
+	auto constants = split_list(argv[4]);
+
+	try {
+		std::string source = tc::optim::mp_generate_plugin_source(name, expression, parameters,
+			constants.empty() ? std::nullopt : tc::OptRef<const std::vector<std::string>>(constants));
+
+		std::ofstream out(argv[5]);
+		out << source;
+		if (!out)
+			throw std::runtime_error(std::string("failed to write ") + argv[5]);
+	}
+	catch (std::exception& e) {
+		std::cerr << "mp_codegen: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,29 @@
+# tc_add_mp_model_plugin(<target> NAME <name> EXPRESSION <expression> PARAMETERS <parameter>... [CONSTANTS <constant>...])
+#
+# Generates the C++ source of an expression model with ComputeMPCodegen and builds it into a
+# loadable module, load it at runtime with tc::optim::MP_ModelRegistry::instance().load(path)
+
+set(TC_COMPUTE_SOURCE_DIR "${CMAKE_CURRENT_LIST_DIR}/..")
+
+function(tc_add_mp_model_plugin target)
+    cmake_parse_arguments(PLUGIN "" "NAME;EXPRESSION" "PARAMETERS;CONSTANTS" ${ARGN})
+
+    if (NOT PLUGIN_NAME OR NOT PLUGIN_EXPRESSION OR NOT PLUGIN_PARAMETERS)
+        message(FATAL_ERROR "tc_add_mp_model_plugin needs NAME, EXPRESSION and PARAMETERS")
+    endif()
+
+    string(JOIN "," parameters ${PLUGIN_PARAMETERS})
+    string(JOIN "," constants ${PLUGIN_CONSTANTS})
+
+    set(source "${CMAKE_CURRENT_BINARY_DIR}/${target}.cpp")
+    add_custom_command(
+        OUTPUT "${source}"
+        COMMAND ComputeMPCodegen "${PLUGIN_NAME}" "${PLUGIN_EXPRESSION}" "${parameters}" "${constants}" "${source}"
+        DEPENDS ComputeMPCodegen
+        COMMENT "Generating model plugin ${PLUGIN_NAME}"
+        VERBATIM)
+
+    add_library(${target} MODULE "${source}")
+    target_include_directories(${target} PRIVATE "${TC_COMPUTE_SOURCE_DIR}")
+    target_link_libraries(${target} ComputeLib)
+endfunction()
@@ -11,9 +11,16 @@
 #include "Expression/Parser/lexer.hpp"
 #include "Expression/Parser/shunter.hpp"
 #include "Expression/TokenAlgebra/token_algebra.hpp"
+#include "Expression/arena.hpp"
+#include "Expression/custom.hpp"
 #include "Expression/token.hpp"
 #include "Expression/nodes.hpp"
 #include "Expression/expression.hpp"
+#include "Expression/Simplify/simplify.hpp"
+#include "Expression/Tape/tape.hpp"
+#include "Expression/Tape/fused.hpp"
+#include "Expression/Tape/script.hpp"
+#include "Expression/Tape/serialize.hpp"
 
 // Optim
 #include "Optim/MP/mp_model.hpp"
@@ -21,6 +28,10 @@
 #include "Optim/MP/mp_optim.hpp"
 #include "Optim/MP/mp_strp.hpp"
 #include "Optim/MP/mp_slm.hpp"
+#include "Optim/MP/mp_plugin.hpp"
+#include "Optim/MP/mp_codegen.hpp"
+#include "Optim/MP/mp_registry.hpp"
+#include "Optim/MP/mp_cache.hpp"
 
 // Models
 #include "Models/mp_models.hpp"
@@ -10,5 +10,6 @@
 
 #include <cstdint>
 #include <optional>
+#include <variant>
 
 #include "tc.hpp"
\ No newline at end of file